@@ -0,0 +1,35 @@
+#!/bin/sh
+# Runs the same load against the epoll and the io_uring backend of the server, one after the other.
+# Run from the directory with the server and client executables, the arguments after the number of server threads go
+# to the client, e.g.: bench/backend_bench.sh 2 -t 2 -c 64 -d 5
+THREADS=${1:-2}
+[ $# -gt 0 ] && shift
+PORT=8090
+FIFO=$(mktemp -u)
+mkfifo "$FIFO" || exit 1
+trap 'rm -f "$FIFO"' EXIT
+
+for MODE in sharded uring; do
+	# the server reads its commands from the fifo, so it can be told to exit
+	./server "$THREADS" "$PORT" "$MODE" <"$FIFO" >/dev/null 2>&1 &
+	SERVER=$!
+	exec 3>"$FIFO"
+	# the client fails as long as nothing accepts connections on the port
+	READY=0
+	for i in $(seq 50); do
+		./client -p "$PORT" -c 1 -d 0 -w 0 >/dev/null 2>&1 && READY=1 && break
+		sleep 0.1
+	done
+	if [ "$READY" = 0 ]; then
+		echo "the $MODE server did not start" >&2
+		kill "$SERVER"
+		exit 1
+	fi
+
+	echo "== $MODE"
+	./client -p "$PORT" "$@"
+
+	echo exit >&3
+	exec 3>&-
+	wait "$SERVER"
+done
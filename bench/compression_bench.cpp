@@ -0,0 +1,131 @@
+// Requests static files from a running server with and without "Accept-Encoding: gzip" and compares the bytes sent
+// over the wire and the throughput.
+//
+// Usage: compression_bench [port] [requests per connection] [connections] [path...]
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct Result {
+	std::size_t requests = 0, bytes = 0, failed = 0;
+};
+
+static int connectTo(int port) {
+	int sock = socket(AF_INET6, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+	sockaddr_in6 addr = {};
+	addr.sin6_family  = AF_INET6;
+	addr.sin6_port	  = htons(port);
+	inet_pton(AF_INET6, "::1", &addr.sin6_addr);
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/// Reads one response from a keep-alive connection and returns its size on the wire, 0 on error.
+static std::size_t readResponse(int sock, std::string &buffer) {
+	std::size_t headEnd;
+	while ((headEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+		char	chunk[16384];
+		ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+		if (n <= 0) return 0;
+		buffer.append(chunk, n);
+	}
+
+	std::size_t length = 0, pos = buffer.find("Content-Length: ");
+	if (pos != std::string::npos && pos < headEnd) {
+		std::from_chars(buffer.data() + pos + 16, buffer.data() + headEnd, length);
+	}
+
+	std::size_t total = headEnd + 4 + length;
+	while (buffer.size() < total) {
+		char	chunk[65536];
+		ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+		if (n <= 0) return 0;
+		buffer.append(chunk, n);
+	}
+	buffer.erase(0, total);
+	return total;
+}
+
+static Result run(int port, std::size_t requests, const std::vector<std::string> &paths, bool gzip) {
+	Result result;
+	int	   sock = connectTo(port);
+	if (sock < 0) {
+		result.failed = requests;
+		return result;
+	}
+
+	std::string buffer;
+	for (std::size_t i = 0; i < requests; i++) {
+		std::string request = "GET " + paths[i % paths.size()] + " HTTP/1.1\r\nHost: localhost\r\n";
+		if (gzip) request += "Accept-Encoding: gzip, deflate, br\r\n";
+		request += "\r\n";
+		if (send(sock, request.data(), request.size(), MSG_NOSIGNAL) != ssize_t(request.size())) {
+			result.failed += requests - i;
+			break;
+		}
+
+		std::size_t bytes = readResponse(sock, buffer);
+		if (!bytes) {
+			result.failed += requests - i;
+			break;
+		}
+		result.bytes += bytes;
+		++result.requests;
+	}
+	close(sock);
+	return result;
+}
+
+static void report(const char *name, int port, std::size_t requests, int connections,
+				   const std::vector<std::string> &paths, bool gzip) {
+	std::vector<Result>		 results(connections);
+	std::vector<std::thread> threads;
+
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < connections; i++) {
+		threads.emplace_back([&, i] { results[i] = run(port, requests, paths, gzip); });
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	Result total;
+	for (const Result &r : results) {
+		total.requests += r.requests;
+		total.bytes += r.bytes;
+		total.failed += r.failed;
+	}
+
+	std::cout << name << ": " << std::size_t(total.requests / elapsed.count()) << " requests/s, "
+			  << (total.requests ? total.bytes / total.requests : 0) << " bytes/response, "
+			  << total.bytes / elapsed.count() / (1 << 20) << " MiB/s on the wire";
+	if (total.failed) std::cout << ", " << total.failed << " failed";
+	std::cout << std::endl;
+}
+
+int main(int argc, char **argv) {
+	int			port		= argc > 1 ? std::stoi(argv[1]) : 8080;
+	std::size_t requests	= argc > 2 ? std::stoul(argv[2]) : 10000;
+	int			connections = argc > 3 ? std::stoi(argv[3]) : 4;
+
+	std::vector<std::string> paths(argv + std::min(argc, 4), argv + argc);
+	if (paths.empty()) paths = {"/", "/bluefish.svg", "/window-close.svg"};
+
+	report("identity", port, requests, connections, paths, false);
+	report("gzip", port, requests, connections, paths, true);
+	return 0;
+}
@@ -0,0 +1,102 @@
+// Compares the incremental HTTPParser against the std::getline based request parsing it replaced.
+
+#include <charconv>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+
+#include <http_parser.hpp>
+#include <router.hpp>
+
+static const std::string request =
+	"POST /sort?format=json HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Content-Type: text/plain\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: no-cache\r\n"
+	"\r\n";
+
+/// Serves the request from memory through the same virtual streambuf interface SocketBuffer uses.
+class MemoryBuffer : public std::streambuf {
+   public:
+	void reset(const std::string &s) {
+		char *p = const_cast<char *>(s.data());
+		setg(p, p, p + s.size());
+	}
+};
+
+template <class F>
+static void run(const char *name, std::size_t iterations, F &&f) {
+	auto		start = std::chrono::steady_clock::now();
+	std::size_t check = 0;
+	for (std::size_t i = 0; i < iterations; i++) {
+		check += f();
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << name << ": " << std::size_t(iterations / elapsed.count()) << " requests/s per core, "
+			  << elapsed.count() * 1e9 / iterations << " ns/request (checksum " << check << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	std::size_t iterations = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+	MemoryBuffer buffer;
+	std::istream stream(&buffer);
+
+	run("getline", iterations, [&] {
+		buffer.reset(request);
+		stream.clear();
+
+		std::string line;
+		std::getline(stream, line);
+
+		std::istringstream	ss(line);
+		Router::RequestType type;
+		{
+			std::string type_s;
+			ss >> type_s;
+			type = Router::RequestType::fromString(type_s);
+		}
+		std::string path;
+		ss >> path;
+
+		std::size_t body_len = 0;
+		while (std::getline(stream, line)) {
+			if (line.starts_with("Content-Length:")) {
+				std::string_view length = std::string_view(line).substr(16);
+				std::from_chars(length.begin(), length.end(), body_len);
+			}
+			if (line == "\r") break;
+		}
+		return path.size() + type + body_len;
+	});
+
+	HTTPParser parser;
+	run("HTTPParser", iterations, [&] {
+		parser.reset();
+		parser.parse(request);
+		const HTTPRequest &r = parser.request;
+		return r.path.size() + Router::RequestType::fromString(r.method) + r.contentLength + r.numHeaders;
+	});
+
+	// the same request arriving in three reads
+	std::string_view whole = request;
+	run("HTTPParser (3 reads)", iterations, [&] {
+		parser.reset();
+		parser.parse(whole.substr(0, 40));
+		parser.parse(whole.substr(0, 200));
+		parser.parse(whole);
+		const HTTPRequest &r = parser.request;
+		return r.path.size() + Router::RequestType::fromString(r.method) + r.contentLength + r.numHeaders;
+	});
+
+	return 0;
+}
@@ -0,0 +1,89 @@
+// Compares route lookup in RouteTree against the exact-match map plus served-prefix scan the router used before.
+//
+// Usage: router_bench [routes] [iterations]
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <route_tree.hpp>
+#include <utils.hpp>
+
+template <class F>
+static void run(const char *name, std::size_t iterations, F &&f) {
+	auto		start = std::chrono::steady_clock::now();
+	std::size_t check = 0;
+	for (std::size_t i = 0; i < iterations; i++) {
+		check += f(i);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << name << ": " << elapsed.count() * 1e9 / iterations << " ns/lookup (checksum " << check << ")"
+			  << std::endl;
+}
+
+/// The lookup Router::handleRequest did before the tree: an exact match, then every prefix ending in '/'.
+struct MapRouter {
+	std::unordered_map<std::pair<std::string, int>, int>								  map;
+	std::unordered_map<std::string, int, std::hash<std::string>, std::equal_to<>> served;
+
+	int find(int method, std::string_view path) const {
+		auto handler = map.find({std::string(path), method});
+		if (handler != map.end()) return handler->second;
+
+		std::size_t i = path.size() - 1;
+		do {
+			auto j = served.find(path.substr(0, i + 1));
+			if (j != served.end()) return j->second;
+		} while ((i = path.rfind('/', std::max(i - 1, 0ul))) != std::string_view::npos);
+		return -1;
+	}
+};
+
+int main(int argc, char **argv) {
+	std::size_t numRoutes  = argc > 1 ? std::stoul(argv[1]) : 5000;
+	std::size_t iterations = argc > 2 ? std::stoul(argv[2]) : 2000000;
+
+	RouteTree<int> tree;
+	MapRouter	   old;
+
+	std::vector<std::string> staticPaths, paramPaths;
+	for (std::size_t i = 0; i < numRoutes; i++) {
+		std::string base = "/api/v" + std::to_string(i % 3) + "/resource" + std::to_string(i);
+		tree.insert(0, base, int(i));
+		tree.insert(0, base + "/:id/items/:item", int(i));
+		old.map.insert({{base, 0}, int(i)});
+		staticPaths.push_back(base);
+		paramPaths.push_back(base + "/" + std::to_string(i * 7) + "/items/" + std::to_string(i * 13));
+	}
+	tree.insert(0, "/static/*file", -1);
+	tree.insert(0, "/*file", -2);
+	old.served.insert({"/static/", -1});
+	old.served.insert({"/", -2});
+	tree.compile();
+
+	std::vector<std::string> filePaths = {"/static/css/site/main.css", "/index.html", "/img/logo/blue/fish.svg"};
+
+	std::cout << tree.size() << " routes" << std::endl;
+
+	RouteParams params;
+	uint32_t	allowed;
+
+	// visit the routes in a scattered order, so that neither side profits from nodes allocated next to each other
+	auto pick = [&](std::size_t i) { return std::size_t(i * 2654435761u) % numRoutes; };
+
+	auto treeFind = [&](std::string_view path) {
+		const int *v = tree.find(0, path, params, allowed);
+		return (v ? *v : 0) + params.size;
+	};
+
+	run("map, static", iterations, [&](std::size_t i) { return old.find(0, staticPaths[pick(i)]); });
+	run("tree, static", iterations, [&](std::size_t i) { return treeFind(staticPaths[pick(i)]); });
+	run("tree, two parameters", iterations, [&](std::size_t i) { return treeFind(paramPaths[pick(i)]); });
+	run("map, served files", iterations, [&](std::size_t i) { return old.find(0, filePaths[i % filePaths.size()]); });
+	run("tree, served files", iterations, [&](std::size_t i) { return treeFind(filePaths[i % filePaths.size()]); });
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Compares the sort engine behind /sort (parseIntegers, radixSort, writeJSONArray) against the from_chars loop,
+// std::sort and ostringstream it replaced, for arrays of 1e3 up to max elements.
+//
+// Usage: sort_bench [max elements] [threads]
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sort.hpp>
+
+/// Runs f enough times to take a while and returns the time per element in nanoseconds.
+template <class F>
+static double measure(std::size_t n, F &&f) {
+	std::size_t repeat = std::max<std::size_t>(1, 10000000 / n);
+	auto		start  = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < repeat; i++) f();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count() * 1e9 / repeat / n;
+}
+
+static void check(bool ok, const char *what) {
+	if (ok) return;
+	std::cerr << what << " gave a different result" << std::endl;
+	std::exit(1);
+}
+
+int main(int argc, char **argv) {
+	std::size_t max		= argc > 1 ? std::stoul(argv[1]) : 10000000;
+	unsigned	threads = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+
+	std::cout << "ns per element, radix sort on " << threads << " threads from " << PARALLEL_SORT_THRESHOLD
+			  << " elements" << std::endl;
+	std::cout << std::setw(10) << "n" << std::setw(12) << "from_chars" << std::setw(12) << "parse" << std::setw(12)
+			  << "std::sort" << std::setw(12) << "radix" << std::setw(12) << "ostream" << std::setw(12) << "write"
+			  << std::endl;
+
+	std::mt19937 rng(42);
+	for (std::size_t n = 1000; n <= max; n *= 10) {
+		std::vector<int32_t> values(n);
+		for (int32_t &v : values) v = int32_t(rng());
+
+		std::string text;
+		for (int32_t v : values) text += std::to_string(v) + ' ';
+
+		std::vector<int32_t> parsed;
+		double				 fromChars = measure(n, [&] {
+			 parsed.clear();
+			 const char *p = text.data(), *end = text.data() + text.size();
+			 for (;;) {
+				 while (p != end && std::isspace((unsigned char)*p)) ++p;
+				 if (p == end) break;
+				 int32_t x = 0;
+				 p = std::from_chars(p, end, x).ptr;
+				 parsed.push_back(x);
+			 }
+		 });
+		check(parsed == values, "from_chars");
+		double parse = measure(n, [&] {
+			parsed.clear();
+			parseIntegers(text, parsed);
+		});
+		check(parsed == values, "parseIntegers");
+
+		std::vector<int32_t> sorted, expected = values;
+		std::sort(expected.begin(), expected.end());
+		double stdSort = measure(n, [&] {
+			sorted = values;
+			std::sort(sorted.begin(), sorted.end());
+		});
+		double radix   = measure(n, [&] {
+			  sorted = values;
+			  radixSort(sorted.data(), n, threads);
+		  });
+		check(sorted == expected, "radixSort");
+
+		std::string json;
+		double		ostream = measure(n, [&] {
+			 std::ostringstream out;
+			 out << "[";
+			 for (std::size_t i = 0; i < n; i++) out << (i ? ", " : "") << sorted[i];
+			 out << "]";
+			 json = out.str();
+		 });
+		std::unique_ptr<char[]> buffer(new char[maxJSONArraySize<int32_t>(n)]);
+		std::size_t				length = 0;
+		double					write  = measure(n, [&] {
+			 length = writeJSONArray(buffer.get(), sorted.data(), n) - buffer.get();
+		 });
+		check(std::string_view(buffer.get(), length) == json, "writeJSONArray");
+
+		std::cout << std::setw(10) << n << std::fixed << std::setprecision(2) << std::setw(12) << fromChars
+				  << std::setw(12) << parse << std::setw(12) << stdSort << std::setw(12) << radix << std::setw(12)
+				  << ostream << std::setw(12) << write << std::endl;
+	}
+
+	return 0;
+}
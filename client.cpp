@@ -1,117 +1,622 @@
-#include <fcntl.h>
+// A load generator for the server. Every thread drives its share of the connections from its own epoll instance,
+// either closed loop (each connection keeps a number of requests outstanding and sends the next one when a response
+// arrives) or open loop (requests are sent at a fixed rate, whether or not the server keeps up). The latency of every
+// response is recorded in a histogram; in open loop it is measured from when the request was due rather than from when
+// it could be sent, so that a server falling behind shows in the percentiles instead of slowing the benchmark down.
+
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <charconv>
 #include <chrono>
-#include <cstring>
+#include <deque>
+#include <iomanip>
 #include <iostream>
-#include <charconv>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <vector>
 
-#include <socket.hpp>
-#include <utils.hpp>
-
-int received = 0;
-
-void read_data(SocketStream &stream) {
-	std::string response;
-	std::size_t len = 0;
-	while (stream.good()) {
-		std::getline(stream, response);
-		if (response.empty()) return;
-		if (response.starts_with("Content-Length:")) {
-			std::string_view length = std::string_view(response).substr(16);
-			std::from_chars(length.begin(), length.end(), len);
-		}
-		if (response == "\r") break;
-	}
-	if (len) {
-		char *buffer = new char[len];
-		stream.read(buffer, len);
-		std::cout.write(buffer, std::min(len, 40ul));
-		std::cout << std::endl;
-		delete[] buffer;
-		++received;
-	} else return;
-}
+#include <histogram.hpp>
 
-Socket createConnection(const std::string &ip, short port) {
-	int sock = socket(AF_INET6, SOCK_STREAM, 0);
-	if (sock == -1) {
-		dbLog(dbg::LOG_ERROR, "Error creating socket");
-		return 1;
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+	std::string host		= "::1";
+	std::string port		= "8080";
+	unsigned	threads		= std::max(std::thread::hardware_concurrency(), 1u);
+	unsigned	connections = 64;
+	double		duration	= 10;
+	double		warmup		= 2;
+	double		rate		= 0;	// requests per second over all connections, 0 for closed loop
+	unsigned	pipeline	= 1;	// requests outstanding per connection in closed loop
+	std::size_t sortSize	= 10000;
+	std::string mix			= "page";
+};
+
+/// A kind of request and how often it is sent relative to the others.
+struct RequestType {
+	std::string name;
+	std::string request;
+	unsigned	weight = 1;
+};
+
+struct Stats {
+	Histogram			  latency;	  // in nanoseconds
+	uint64_t			  bytes			= 0;
+	uint64_t			  connectErrors = 0;
+	uint64_t			  socketErrors	= 0;	// requests lost with a connection that failed or was closed
+	uint64_t			  status[6]		= {};	// responses by status class, 1xx to 5xx
+	std::vector<uint64_t> perType;			   // responses by request type
+
+	void merge(const Stats &other) {
+		latency.merge(other.latency);
+		bytes += other.bytes;
+		connectErrors += other.connectErrors;
+		socketErrors += other.socketErrors;
+		for (int i = 0; i < 6; i++) {
+			status[i] += other.status[i];
+		}
+		perType.resize(std::max(perType.size(), other.perType.size()));
+		for (std::size_t i = 0; i < other.perType.size(); i++) {
+			perType[i] += other.perType[i];
+		}
 	}
-	struct sockaddr_in6 addr;
-	addr.sin6_family = AF_INET6;
-	addr.sin6_port	 = htons(port);
-	inet_pton(AF_INET6, ip.c_str(), &addr.sin6_addr);
-	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
-		dbLog(dbg::LOG_ERROR, "Error connecting to server: ", strerror(errno));
-		return 1;
+};
+
+/// Incrementally parses the responses arriving on a connection.
+class ResponseParser {
+   public:
+	enum class Result { MORE, DONE, ERROR };
+
+	/**
+	 * @brief Consumes what it can of data, up to the end of one response.
+	 * @return DONE once a whole response has been consumed, with its status and whether the server closes afterwards
+	 */
+	Result parse(std::string &data, std::size_t &pos) {
+		for (;;) {
+			std::string_view rest(data.data() + pos, data.size() - pos);
+			switch (m_state) {
+				case State::HEAD: {
+					std::size_t end = rest.find("\r\n\r\n");
+					if (end == std::string_view::npos) return Result::MORE;
+					if (!parseHead(rest.substr(0, end + 2))) return Result::ERROR;
+					pos += end + 4;
+					break;
+				}
+				case State::BODY: {
+					std::size_t n = std::min<std::size_t>(m_remaining, rest.size());
+					pos += n;
+					m_remaining -= n;
+					if (m_remaining) return Result::MORE;
+					m_state = State::HEAD;
+					return Result::DONE;
+				}
+				case State::CHUNK_SIZE: {
+					std::size_t end = rest.find("\r\n");
+					if (end == std::string_view::npos) return Result::MORE;
+					std::size_t size = 0;
+					auto		res	 = std::from_chars(rest.data(), rest.data() + end, size, 16);
+					if (res.ec != std::errc()) return Result::ERROR;
+					pos += end + 2;
+					m_state		= size ? State::CHUNK_DATA : State::TRAILER;
+					m_remaining = size + 2;
+					break;
+				}
+				case State::CHUNK_DATA: {
+					std::size_t n = std::min<std::size_t>(m_remaining, rest.size());
+					pos += n;
+					m_remaining -= n;
+					if (m_remaining) return Result::MORE;
+					m_state = State::CHUNK_SIZE;
+					break;
+				}
+				case State::TRAILER: {
+					std::size_t end = rest.find("\r\n");
+					if (end == std::string_view::npos) return Result::MORE;
+					pos += end + 2;
+					if (end) break;
+					m_state = State::HEAD;
+					return Result::DONE;
+				}
+			}
+		}
 	}
-	return sock;
-}
 
-int main(int argc, char **argv) {
-	int num_size = 10000;
-	if (argc < 3) {
-		std::cerr << "Usage: " << argv[0] << " <num_connections> <num_requests> <request_index>" << std::endl;
-		std::cerr << "request_index can be 0..2. \r\n"
-					 "\t0 - a request that takes a long time to be processed\r\n"
-					 "\t1 - request the main page\r\n"
-					 "\t2 - sort an array of "
-				  << num_size << " numbers\r\n";
-		return 1;
+	int	 status = 0;
+	bool close	= false;
+
+   private:
+	enum class State { HEAD, BODY, CHUNK_SIZE, CHUNK_DATA, TRAILER };
+
+	static bool iequals(std::string_view a, std::string_view b) {
+		return a.size() == b.size() &&
+			   std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) { return tolower(x) == tolower(y); });
 	}
-	int num_connections = std::stoi(argv[1]);
-	int num_requests	= std::stoi(argv[2]);
-	int index			= argc == 4 ? std::stoi(argv[3]) : 0;
 
-	std::vector<Socket>						   sockets;
-	std::vector<std::shared_ptr<SocketStream>> streams;
+	bool parseHead(std::string_view head) {
+		if (head.size() < 12 || !head.starts_with("HTTP/1.")) return false;
+		std::from_chars(head.data() + 9, head.data() + 12, status);
+		close = head[7] == '0';
 
-	for (int i = 0; i < num_connections; i++) {
-		auto &s = sockets.emplace_back(createConnection("::1", 8080));
-		streams.emplace_back(std::make_shared<SocketStream>(s));
+		bool		chunked = false;
+		std::size_t length	= 0;
+		for (std::size_t pos = head.find("\r\n") + 2; pos < head.size();) {
+			std::size_t		 end   = head.find("\r\n", pos);
+			std::string_view line  = head.substr(pos, end - pos);
+			std::size_t		 colon = line.find(':');
+			pos					   = end + 2;
+			if (colon == std::string_view::npos) continue;
+			std::string_view name = line.substr(0, colon), value = line.substr(colon + 1);
+			while (!value.empty() && value.front() == ' ') value.remove_prefix(1);
+			if (iequals(name, "Content-Length")) std::from_chars(value.data(), value.data() + value.size(), length);
+			else if (iequals(name, "Transfer-Encoding")) chunked = iequals(value, "chunked");
+			else if (iequals(name, "Connection")) close = iequals(value, "close");
+		}
+
+		if (chunked) m_state = State::CHUNK_SIZE;
+		else {
+			m_state		= State::BODY;
+			m_remaining = length;
+		}
+		return true;
 	}
 
-	std::string requests[3] = {"GET /wait HTTP/1.1\r\nHost: localhost\r\n\r\n",
-							   "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"};
+	State		m_state		= State::HEAD;
+	std::size_t m_remaining = 0;
+};
+
+struct Connection {
+	struct Pending {
+		Clock::time_point sent;	   // when the request was due, in open loop possibly before it was written
+		std::size_t		  type;
+	};
 
-	std::stringstream ss;
-	for (int i = 0; i < num_size; ++i) {
-		ss << (i ? " " : "") << (rand() % num_size);
+	int					fd		  = -1;
+	bool				connected = false;
+	std::string			out;
+	std::size_t			outPos = 0;
+	std::string			in;
+	std::size_t			inPos = 0;
+	ResponseParser		parser;
+	std::deque<Pending> pending;
+	Clock::time_point	retryAt;	// when to reconnect after a failed attempt
+};
+
+class Worker {
+   public:
+	Worker(const Options &options, const addrinfo &target, const std::vector<RequestType> &types, unsigned connections,
+		   double rate, unsigned seed)
+		: m_options(options), m_target(target), m_types(types), m_connections(connections), m_rng(seed | 1),
+		  m_closed(connections) {
+		if (rate > 0) m_interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / rate));
+		for (const RequestType &type : types) {
+			m_totalWeight += type.weight;
+		}
+		m_stats.perType.resize(types.size());
 	}
 
-	requests[2] =
-		"POST /sort HTTP/1.1\r\nHost: localhost\r\n"
-		"Content-Length: " +
-		std::to_string(ss.str().size()) + "\r\n\r\n" + ss.str() + "\n";
+	void run(Clock::time_point start, Clock::time_point measureFrom, Clock::time_point end) {
+		m_measureFrom = measureFrom;
+		m_end		  = end;
+		m_epoll		  = epoll_create1(0);
+		for (Connection &c : m_connections) {
+			open(c);
+		}
 
-	std::cout << "Packet size: " << requests[index].size() << std::endl;
+		m_nextSend = start;
+		epoll_event events[256];
+		for (;;) {
+			Clock::time_point now = Clock::now();
+			if (now >= m_end) break;
+			if (m_interval.count()) sendDue(now);
+			for (std::size_t i = 0; m_closed && i < m_connections.size(); i++) {
+				if (m_connections[i].fd < 0 && m_connections[i].retryAt <= now) open(m_connections[i]);
+			}
 
-	for (int j = 0; j < num_requests; j++) {
-		for (auto &p : streams) {
-			auto &stream = *p;
-			stream << requests[index];
-			stream.flush();
-			// std::this_thread::sleep_for(std::chrono::milliseconds(100));
-			dbLog(dbg::LOG_DEBUG, "Sent request", j);
+			int n = epoll_wait(m_epoll, events, 256, timeout(now));
+			for (int i = 0; i < n; i++) {
+				Connection &c = *static_cast<Connection *>(events[i].data.ptr);
+				if (c.fd < 0) continue;
+				if (!c.connected && !finishConnect(c)) continue;
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) receive(c);
+				if (c.fd >= 0 && (events[i].events & EPOLLOUT)) flush(c);
+			}
 		}
+
+		for (Connection &c : m_connections) {
+			if (c.fd >= 0) ::close(c.fd);
+		}
+		::close(m_epoll);
 	}
 
-	for (int i = num_connections; --i >= 0;) {
-		for (int j = 0; j < num_requests; j++) {
-			read_data(*streams[i]);
+	const Stats &stats() const { return m_stats; }
+
+   private:
+	bool closedLoop() const { return !m_interval.count(); }
+	bool measuring(Clock::time_point t) const { return t >= m_measureFrom && t < m_end; }
+
+	/// Milliseconds epoll_wait may sleep until the next request is due or the run ends.
+	int timeout(Clock::time_point now) const {
+		Clock::time_point wake = m_end;
+		if (!closedLoop()) wake = std::min(wake, m_nextSend);
+		for (std::size_t i = 0; m_closed && i < m_connections.size(); i++) {
+			if (m_connections[i].fd < 0) wake = std::min(wake, m_connections[i].retryAt);
 		}
-		streams.pop_back();
-		sockets.pop_back();
+		if (wake <= now) return 0;
+		return int(std::chrono::ceil<std::chrono::milliseconds>(wake - now).count());
 	}
 
-	std::cout << std::endl;
-	std::cout << "Sent " << num_connections * num_requests << " requests" << std::endl;
-	std::cout << "Received " << received << " responses" << std::endl;
+	void open(Connection &c) {
+		m_closed--;
+		c.fd = socket(m_target.ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (c.fd < 0 || (connect(c.fd, m_target.ai_addr, m_target.ai_addrlen) && errno != EINPROGRESS)) {
+			failConnect(c);
+			return;
+		}
+		int one = 1;
+		setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		epoll_event ev{EPOLLIN | EPOLLOUT | EPOLLET, {.ptr = &c}};
+		epoll_ctl(m_epoll, EPOLL_CTL_ADD, c.fd, &ev);
+	}
+
+	bool finishConnect(Connection &c) {
+		int		  error = 0;
+		socklen_t len	= sizeof(error);
+		if (getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+			failConnect(c);
+			return false;
+		}
+		c.connected = true;
+		if (closedLoop()) {
+			for (unsigned i = 0; i < m_options.pipeline; i++) {
+				enqueue(c, Clock::now());
+			}
+		}
+		flush(c);
+		return c.fd >= 0;
+	}
+
+	void failConnect(Connection &c) {
+		if (measuring(Clock::now())) m_stats.connectErrors++;
+		if (c.fd >= 0) ::close(c.fd);
+		c.fd	  = -1;
+		c.retryAt = Clock::now() + std::chrono::milliseconds(100);
+		m_closed++;
+	}
+
+	/**
+	 * @brief Drops the connection, the requests it still had outstanding count as failed. The main loop reconnects it
+	 * right away.
+	 */
+	void reset(Connection &c) {
+		for (const Connection::Pending &p : c.pending) {
+			if (measuring(p.sent)) m_stats.socketErrors++;
+		}
+		::close(c.fd);
+		c.fd		= -1;
+		c.connected = false;
+		c.pending.clear();
+		c.out.clear();
+		c.outPos = 0;
+		c.in.clear();
+		c.inPos	  = 0;
+		c.parser  = ResponseParser();
+		c.retryAt = Clock::now();
+		m_closed++;
+	}
+
+	std::size_t pickType() {
+		if (m_types.size() == 1) return 0;
+		// xorshift64
+		m_rng ^= m_rng << 13;
+		m_rng ^= m_rng >> 7;
+		m_rng ^= m_rng << 17;
+		uint64_t r = m_rng % m_totalWeight;
+		for (std::size_t i = 0;; i++) {
+			if (r < m_types[i].weight) return i;
+			r -= m_types[i].weight;
+		}
+	}
+
+	void enqueue(Connection &c, Clock::time_point due) {
+		std::size_t type = pickType();
+		c.out += m_types[type].request;
+		c.pending.push_back({due, type});
+	}
+
+	/// Open loop: hands every request that is due to the next connection, round robin.
+	void sendDue(Clock::time_point now) {
+		while (m_nextSend <= now) {
+			Connection *c = nullptr;
+			for (std::size_t i = 0; i < m_connections.size() && !c; i++) {
+				Connection &candidate = m_connections[m_nextConnection++ % m_connections.size()];
+				if (candidate.connected) c = &candidate;
+			}
+			// nowhere to send it, it stays due and its latency keeps growing
+			if (!c) return;
+			enqueue(*c, m_nextSend);
+			flush(*c);
+			m_nextSend += m_interval;
+		}
+	}
+
+	void flush(Connection &c) {
+		while (c.outPos < c.out.size()) {
+			ssize_t n = send(c.fd, c.out.data() + c.outPos, c.out.size() - c.outPos, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR) return;
+				reset(c);
+				return;
+			}
+			c.outPos += n;
+		}
+		c.out.clear();
+		c.outPos = 0;
+	}
+
+	void receive(Connection &c) {
+		char chunk[65536];
+		for (;;) {
+			ssize_t n = recv(c.fd, chunk, sizeof(chunk), 0);
+			if (n < 0 && (errno == EAGAIN || errno == EINTR)) break;
+			if (n <= 0) {
+				reset(c);
+				return;
+			}
+			if (measuring(Clock::now())) m_stats.bytes += n;
+			c.in.append(chunk, n);
+
+			for (;;) {
+				ResponseParser::Result res = c.parser.parse(c.in, c.inPos);
+				if (res == ResponseParser::Result::ERROR || (res == ResponseParser::Result::DONE && c.pending.empty())) {
+					reset(c);
+					return;
+				}
+				if (res == ResponseParser::Result::MORE) break;
+				if (!complete(c)) return;
+			}
+			if (c.inPos == c.in.size()) {
+				c.in.clear();
+				c.inPos = 0;
+			} else if (c.inPos > c.in.size() / 2) {
+				c.in.erase(0, c.inPos);
+				c.inPos = 0;
+			}
+		}
+	}
+
+	/// Accounts for the response just parsed. Returns false if the connection has been reset.
+	bool complete(Connection &c) {
+		Clock::time_point	now = Clock::now();
+		Connection::Pending p	= c.pending.front();
+		c.pending.pop_front();
+		if (measuring(p.sent) && now < m_end) {
+			m_stats.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(now - p.sent).count());
+			m_stats.status[std::clamp(c.parser.status / 100, 0, 5)]++;
+			m_stats.perType[p.type]++;
+		}
+		if (c.parser.close) {
+			reset(c);
+			return false;
+		}
+		if (closedLoop()) {
+			enqueue(c, now);
+			flush(c);
+		}
+		return c.fd >= 0;
+	}
+
+	const Options					&m_options;
+	const addrinfo					&m_target;
+	const std::vector<RequestType> &m_types;
+	std::vector<Connection>			m_connections;
+	uint64_t						m_rng;
+	uint64_t						m_totalWeight = 0;
+	Clock::duration					m_interval{0};
+	Clock::time_point				m_nextSend, m_measureFrom, m_end;
+	std::size_t						m_nextConnection = 0;
+	std::size_t						m_closed;	 // connections to open again, all of them at first
+	int								m_epoll			 = -1;
+	Stats							m_stats;
+};
 
-	return 0;
+static std::string request(const std::string &host, std::string_view method, std::string_view path,
+						   std::string_view headers = "", std::string_view body = "") {
+	std::string r = std::string(method) + " " + std::string(path) + " HTTP/1.1\r\nHost: " + host + "\r\n";
+	r += headers;
+	if (!body.empty() || method == "POST") r += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	r += "\r\n";
+	r += body;
+	return r;
+}
+
+/**
+ * @brief Parses a mix like "page:8,sort:1,/dir/:1": the named requests below, or GET of a path, each with an optional
+ * weight.
+ */
+static std::vector<RequestType> parseMix(const Options &options) {
+	std::string		   text;
+	std::string		   binary;
+	std::ostringstream numbers;
+	for (std::size_t i = 0; i < options.sortSize; ++i) {
+		int32_t x = rand() % options.sortSize;
+		numbers << (i ? " " : "") << x;
+		binary.append(reinterpret_cast<const char *>(&x), sizeof(x));
+	}
+	text = numbers.str() + "\n";
+
+	std::vector<RequestType> types;
+	std::stringstream		 mix(options.mix);
+	for (std::string item; std::getline(mix, item, ',');) {
+		RequestType type;
+		std::size_t colon = item.rfind(':');
+		if (colon != std::string::npos && colon + 1 < item.size() &&
+			item.find_first_not_of("0123456789", colon + 1) == std::string::npos) {
+			type.weight = std::stoul(item.substr(colon + 1));
+			item.resize(colon);
+		}
+		type.name = item;
+
+		if (item == "wait") type.request = request(options.host, "GET", "/wait");
+		else if (item == "page") type.request = request(options.host, "GET", "/");
+		else if (item == "sort") type.request = request(options.host, "POST", "/sort", "", text);
+		else if (item == "sort32") {
+			type.request = request(options.host, "POST", "/sort",
+								   "Content-Type: application/x-int32\r\nAccept: application/x-int32\r\n", binary);
+		} else if (item.starts_with("/")) type.request = request(options.host, "GET", item);
+		else throw std::invalid_argument("unknown request type: " + item);
+		if (type.weight) types.push_back(std::move(type));
+	}
+	if (types.empty()) throw std::invalid_argument("empty request mix");
+	return types;
+}
+
+static void usage(const char *name) {
+	std::cerr << "Usage: " << name << " [options]\n"
+				 "\t-a host         server to connect to, default ::1\n"
+				 "\t-p port         default 8080\n"
+				 "\t-t threads      default one per core\n"
+				 "\t-c connections  over all threads, default 64\n"
+				 "\t-d seconds      how long to measure, default 10. With 0 only the connection is checked\n"
+				 "\t-w seconds      warmup before measuring, default 2\n"
+				 "\t-r rate         open loop: requests per second over all connections. Without it the loop is\n"
+				 "\t                closed, every connection sends its next request once a response arrives\n"
+				 "\t-P depth        closed loop: requests pipelined on each connection, default 1\n"
+				 "\t-m mix          request types with optional weights, e.g. page:8,sort:1,/dir/:1, default page\n"
+				 "\t                  wait   - a request that takes a long time to be processed\n"
+				 "\t                  page   - the main page\n"
+				 "\t                  sort   - sort an array of numbers\n"
+				 "\t                  sort32 - sort the same array sent and received as binary int32\n"
+				 "\t                  /path  - GET of any other path\n"
+				 "\t-n numbers      size of the arrays to sort, default 10000\n";
+}
+
+static std::string formatLatency(uint64_t ns) {
+	std::ostringstream out;
+	out << std::fixed << std::setprecision(ns < 10'000'000 ? 3 : 1) << ns / 1e6 << " ms";
+	return out.str();
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	for (int opt; (opt = getopt(argc, argv, "a:p:t:c:d:w:r:P:m:n:h")) != -1;) {
+		try {
+			switch (opt) {
+				case 'a': options.host = optarg; break;
+				case 'p': options.port = optarg; break;
+				case 't': options.threads = std::stoul(optarg); break;
+				case 'c': options.connections = std::stoul(optarg); break;
+				case 'd': options.duration = std::stod(optarg); break;
+				case 'w': options.warmup = std::stod(optarg); break;
+				case 'r': options.rate = std::stod(optarg); break;
+				case 'P': options.pipeline = std::max(std::stoul(optarg), 1ul); break;
+				case 'm': options.mix = optarg; break;
+				case 'n': options.sortSize = std::stoul(optarg); break;
+				default: usage(argv[0]); return 1;
+			}
+		} catch (const std::exception &) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (options.duration < 0 || options.warmup < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	options.connections = std::max(options.connections, 1u);
+	options.threads		= std::clamp(options.threads, 1u, options.connections);
+
+	std::vector<RequestType> types;
+	try {
+		types = parseMix(options);
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+
+	std::string host = options.host;
+	if (host.starts_with("[") && host.ends_with("]")) host = host.substr(1, host.size() - 2);
+	addrinfo hints = {}, *addresses = nullptr;
+	hints.ai_socktype = SOCK_STREAM;
+	if (int err = getaddrinfo(host.c_str(), options.port.c_str(), &hints, &addresses)) {
+		std::cerr << "cannot resolve " << options.host << ": " << gai_strerror(err) << std::endl;
+		return 1;
+	}
+	// a name like localhost may resolve to addresses the server does not listen on, the first one accepting wins. If
+	// none does, the server is not up (yet), which scripts waiting for it rely on
+	addrinfo *target = nullptr;
+	for (addrinfo *a = addresses; a; a = a->ai_next) {
+		int	 fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		bool ok = fd >= 0 && !connect(fd, a->ai_addr, a->ai_addrlen);
+		if (fd >= 0) close(fd);
+		if (ok) {
+			target = a;
+			break;
+		}
+	}
+	if (!target) {
+		std::cerr << "cannot connect to " << options.host << ":" << options.port << std::endl;
+		freeaddrinfo(addresses);
+		return 1;
+	}
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	for (unsigned i = 0; i < options.threads; i++) {
+		unsigned connections = options.connections / options.threads + (i < options.connections % options.threads);
+		workers.emplace_back(std::make_unique<Worker>(options, *target, types, connections,
+													  options.rate * connections / options.connections, i + 1));
+	}
+
+	auto measureFrom = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+										   std::chrono::duration<double>(options.warmup));
+	auto end = measureFrom + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+	std::cout << "target " << options.host << ":" << options.port << ", " << options.threads << " threads, "
+			  << options.connections << " connections, ";
+	if (options.rate > 0) std::cout << "open loop at " << options.rate << " requests/s";
+	else std::cout << "closed loop with " << options.pipeline << " outstanding per connection";
+	std::cout << ", " << options.duration << " s after " << options.warmup << " s of warmup" << std::endl;
+
+	std::vector<std::thread> threads;
+	auto					 start = Clock::now();
+	for (auto &worker : workers) {
+		threads.emplace_back([&, w = worker.get()] { w->run(start, measureFrom, end); });
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	freeaddrinfo(addresses);
+
+	Stats total;
+	for (auto &worker : workers) {
+		total.merge(worker->stats());
+	}
+
+	const Histogram &latency = total.latency;
+	std::cout << "requests   " << latency.count() << std::fixed << std::setprecision(1);
+	// without a duration there are no rates, the run only checks that the server accepts connections
+	if (options.duration > 0) {
+		std::cout << " (" << latency.count() / options.duration << "/s), "
+				  << total.bytes / options.duration / (1 << 20) << " MiB/s received";
+	}
+	std::cout << std::endl;
+	std::cout << "mix       ";
+	for (std::size_t i = 0; i < types.size(); i++) {
+		std::cout << " " << types[i].name << " " << total.perType[i];
+	}
+	std::cout << std::endl;
+	std::cout << "latency    min " << formatLatency(latency.min()) << ", mean "
+			  << formatLatency(uint64_t(latency.mean())) << ", max " << formatLatency(latency.max()) << std::endl;
+	for (auto [name, p] : {std::pair{"p50  ", 50.0}, {"p90  ", 90.0}, {"p99  ", 99.0}, {"p99.9", 99.9}}) {
+		std::cout << "  " << name << "    " << formatLatency(latency.percentile(p)) << std::endl;
+	}
+	std::cout << "errors     connect " << total.connectErrors << ", socket " << total.socketErrors << ", status 4xx "
+			  << total.status[4] << ", 5xx " << total.status[5] << std::endl;
+	return total.connectErrors || total.socketErrors ? 2 : 0;
 }
@@ -6,6 +6,7 @@
 #include <csignal>
 #include <server.hpp>
 #include <socket.hpp>
+#include <sort_stream.hpp>
 #include <fcntl.h>
 #include <sstream>
 
@@ -27,55 +28,62 @@ int main(int argc, char **argv) {
 	    port = 8080;
 	} else port = std::stoi(argv[2]);
 
-	server = std::make_unique<HTTPServer>("::1", port, threads);
+	// "uring" serves through io_uring instead of epoll, which needs sharded mode
+	std::string mode	= argc >= 4 ? argv[3] : "";
+	bool		uring	= mode == "uring";
+	bool		sharded = uring || mode == "sharded";
 
+	server = std::make_unique<HTTPServer>("::1", port, threads, sharded);
+	if (uring) server->setBackend(TCPServer::Backend::IO_URING);
+
+	server->router.enableCache(64 * 1024 * 1024);
+	// listings under /dir/ are read again only after the directory changed
+	server->router.enableListingCache(16 * 1024 * 1024);
+	server->router.enableCompression();
 	server->router.serve("/", "/public");
 	server->router.serve("/dir/", "/");
+	server->router.precompress("/");
+	// counters and per-route latency histograms for Prometheus
+	server->enableMetrics();
+	// a line of JSON per request on stderr, written by the logger's background thread
+	server->enableAccessLog(STDERR_FILENO);
 	server->router.get("/asd", [&](SocketStream &ss, std::size_t) { server->router.renderStatus(ss, 500, "BAD"); });
 
-	server->router.get("/wait", [](SocketStream &ss, std::size_t) {
-		std::this_thread::sleep_for(std::chrono::seconds(2));
-		ss.send(200, "OK", "text/html", "DONT LOOK AT ME");
+	// a coroutine, the connection waits for the timer without occupying a worker
+	server->router.get("/wait", [](Request &, Response &response) -> Task<> {
+		co_await sleepFor(std::chrono::seconds(2));
+		response.send(200, "OK", "text/html", "DONT LOOK AT ME");
 	});
 
-	server->router.post("/sort", [](SocketStream &ss, std::size_t body_length) {
-
-		std::vector<int> v;
-		std::string data;
-		data.reserve(body_length);
-
-		while(data.size() < body_length) {
-			if(!ss) ss.getSocket().waitREAD(1000);
-			ss.clear();
-			while(ss && data.size() < body_length)
-				data += ss.get();
-		}
-
-		std::stringstream datastream(data);
-		ss.clear();
-
-		for (;;) {
-			int x;
-			datastream >> x;
-			if (datastream.fail()) {
-				ss.status(400, "BAD REQUEST");
-				return;
+	// a coroutine that reads the body a piece at a time while it arrives
+	server->router.addTaskStream(
+		Router::RequestType::POST, "/count",
+		[](Request &request, Response &response) -> Task<> {
+			std::size_t bytes = 0, lines = 0;
+			for (std::string_view chunk; !(chunk = co_await request.read()).empty();) {
+				bytes += chunk.size();
+				lines += std::ranges::count(chunk, '\n');
 			}
-			v.push_back(x);
-			if (datastream.eof()) { break; }
-		}
-
-		std::sort(v.begin(), v.end());
-		std::ostringstream json;
-		json << "[";
-		for (std::size_t i = 0; i < v.size(); i++) {
-			json << (i ? ", " : "") << v[i];
-		}
-		json << "]";
-
-		ss.clear();
-		ss.send(200, "OK", "application/json", json.str());
-	});
+			response.send(200, "OK", "text/plain",
+						  std::to_string(bytes) + " bytes, " + std::to_string(lines) + " lines");
+		},
+		{.maxSize = 1ul << 30});
+
+	// bodies above 1 MiB go to a temporary file instead of memory
+	server->router.post(
+		"/upload",
+		[](SocketStream &ss, Request &request) {
+			ss.send(200, "OK", "text/plain",
+					std::to_string(request.body.size()) + (request.body.spilled() ? " bytes on disk" : " bytes in memory"));
+		},
+		{.mode = BodyOptions::SPILL, .spillThreshold = 1024 * 1024, .maxSize = 4ul << 30});
+
+	// the numbers are parsed while the body arrives, see createSortStream() for the formats. Above 64 MiB per request
+	// they are sorted in runs on disk. The final sort runs on the compute pool
+	server->router.addAsyncStream(
+		Router::RequestType::POST, "/sort",
+		[](const HTTPRequest &request, const RouteParams &) { return createSortStream(request, 64 * 1024 * 1024); },
+		{.maxSize = 16ul << 30});
 
 	server->listen();
 
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief A growable byte buffer that, unlike std::string and std::vector, does not zero the bytes it grows by, so
+ * data can be received straight into it.
+ */
+class ByteBuffer {
+   public:
+	ByteBuffer() = default;
+	ByteBuffer(ByteBuffer &&other) noexcept { *this = std::move(other); }
+	ByteBuffer &operator=(ByteBuffer &&other) noexcept {
+		m_data	   = std::move(other.m_data);
+		m_size	   = std::exchange(other.m_size, 0);
+		m_capacity = std::exchange(other.m_capacity, 0);
+		return *this;
+	}
+
+	char	   *data() { return m_data.get(); }
+	const char *data() const { return m_data.get(); }
+	std::size_t size() const { return m_size; }
+	std::size_t capacity() const { return m_capacity; }
+	bool		empty() const { return !m_size; }
+	operator std::string_view() const { return std::string_view(m_data.get(), m_size); }
+
+	void reserve(std::size_t n) {
+		if (n <= m_capacity) return;
+		std::unique_ptr<char[]> data(new char[n]);
+		if (m_size) std::memcpy(data.get(), m_data.get(), m_size);
+		m_data	   = std::move(data);
+		m_capacity = n;
+	}
+
+	/// Changes the size, leaving new bytes uninitialized. Grows geometrically.
+	void resize(std::size_t n) {
+		if (n > m_capacity) reserve(std::max(n, m_capacity * 2));
+		m_size = n;
+	}
+
+	void append(std::string_view s) {
+		std::size_t old = m_size;
+		resize(m_size + s.size());
+		std::memcpy(m_data.get() + old, s.data(), s.size());
+	}
+
+	void clear() { m_size = 0; }
+
+   private:
+	std::unique_ptr<char[]> m_data;
+	std::size_t				m_size = 0, m_capacity = 0;
+};
+
+/**
+ * @brief Per-thread free lists of byte buffers, so that socket buffers and request bodies do not allocate (and fault
+ * in) fresh memory every time. Buffers are kept in power-of-two size classes, a buffer taken from the pool is at most
+ * twice as large as asked for. Buffers above a size limit are freed instead of pooled.
+ */
+class BufferPool {
+   public:
+	static constexpr std::size_t MAX_POOLED	  = 16;
+	static constexpr std::size_t MAX_CAPACITY = 16 * 1024 * 1024;
+	/// Small buffers are pooled up to this many bytes per size class and thread, so that a worker keeps enough of them
+	/// for all the connections it is serving at once.
+	static constexpr std::size_t POOLED_BYTES = 1024 * 1024;
+
+	/**
+	 * @brief Returns an empty buffer with room for at least capacity bytes.
+	 */
+	static ByteBuffer acquire(std::size_t capacity) {
+		ByteBuffer buffer;
+		if (capacity > MAX_CAPACITY) {
+			buffer.reserve(capacity);
+			return buffer;
+		}
+		unsigned int			 sizeClass = ceilLog2(std::max<std::size_t>(capacity, 1));
+		std::vector<ByteBuffer> &list	   = freeList(sizeClass);
+		if (!list.empty()) {
+			buffer = std::move(list.back());
+			list.pop_back();
+		} else {
+			buffer.reserve(std::size_t(1) << sizeClass);
+		}
+		return buffer;
+	}
+
+	static void release(ByteBuffer &&buffer) {
+		if (!buffer.capacity() || buffer.capacity() > MAX_CAPACITY) return;
+		// a buffer goes to the largest class it can serve
+		unsigned int			 sizeClass = ceilLog2(buffer.capacity() + 1) - 1;
+		std::vector<ByteBuffer> &list	   = freeList(sizeClass);
+		if (list.size() >= std::max(MAX_POOLED, POOLED_BYTES >> sizeClass)) return;
+		buffer.clear();
+		list.push_back(std::move(buffer));
+	}
+
+   private:
+	static constexpr unsigned int CLASSES = 25;	   // up to MAX_CAPACITY
+
+	static unsigned int ceilLog2(std::size_t n) { return n <= 1 ? 0 : 64 - __builtin_clzll(n - 1); }
+
+	static std::vector<ByteBuffer> &freeList(unsigned int sizeClass) {
+		thread_local std::array<std::vector<ByteBuffer>, CLASSES> lists;
+		return lists[sizeClass];
+	}
+};
+
+/**
+ * @brief Per-thread free list of objects that a connection only needs while it is handling a request, so that idle
+ * connections do not hold on to them.
+ */
+template <class T>
+class ObjectPool {
+   public:
+	static constexpr std::size_t MAX_POOLED = 256;
+
+	static std::unique_ptr<T> acquire() {
+		std::vector<std::unique_ptr<T>> &list = freeList();
+		if (list.empty()) return std::make_unique<T>();
+		std::unique_ptr<T> object = std::move(list.back());
+		list.pop_back();
+		return object;
+	}
+
+	/// The object is handed out again as it is, it has to be reset by the caller.
+	static void release(std::unique_ptr<T> &&object) {
+		std::vector<std::unique_ptr<T>> &list = freeList();
+		if (object && list.size() < MAX_POOLED) list.push_back(std::move(object));
+		object.reset();
+	}
+
+   private:
+	static std::vector<std::unique_ptr<T>> &freeList() {
+		thread_local std::vector<std::unique_ptr<T>> list;
+		return list;
+	}
+};
@@ -0,0 +1,88 @@
+#include "compute_pool.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "utils.hpp"
+
+// the pool and worker the current thread belongs to, so that jobs submitted by a job stay on its worker
+static thread_local const ComputePool *t_pool	= nullptr;
+static thread_local unsigned int	   t_worker = 0;
+
+ComputePool::ComputePool(unsigned int threads) {
+	if (!threads) threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	for (unsigned int i = 0; i < threads; i++) {
+		m_queues.emplace_back(std::make_unique<Queue>());
+	}
+	for (unsigned int i = 0; i < threads; i++) {
+		m_threads.emplace_back(&ComputePool::run, this, i);
+	}
+}
+
+ComputePool::~ComputePool() {
+	{
+		std::lock_guard lock(m_sleepMutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+	for (auto &thread : m_threads) {
+		thread.join();
+	}
+}
+
+void ComputePool::submit(Job job) {
+	unsigned int id = t_pool == this ? t_worker : m_next.fetch_add(1, std::memory_order_relaxed) % m_queues.size();
+
+	// counted first, so that a worker that takes the job right away never sees the count drop below zero
+	m_pending.fetch_add(1);
+	{
+		std::lock_guard lock(m_queues[id]->mutex);
+		m_queues[id]->jobs.push_back(std::move(job));
+	}
+	// a worker between checking m_pending and going to sleep holds the mutex, so it cannot miss the notification
+	{ std::lock_guard lock(m_sleepMutex); }
+	m_wake.notify_one();
+}
+
+bool ComputePool::take(unsigned int id, Job &job) {
+	for (std::size_t i = 0; i < m_queues.size(); i++) {
+		Queue &queue = *m_queues[(id + i) % m_queues.size()];
+		std::lock_guard lock(queue.mutex);
+		if (queue.jobs.empty()) continue;
+
+		// the newest job of the own queue is the one whose data is most likely still in cache, other workers are
+		// robbed of their oldest
+		if (!i) {
+			job = std::move(queue.jobs.back());
+			queue.jobs.pop_back();
+		} else {
+			job = std::move(queue.jobs.front());
+			queue.jobs.pop_front();
+		}
+		m_pending.fetch_sub(1);
+		return true;
+	}
+	return false;
+}
+
+void ComputePool::run(unsigned int id) {
+	t_pool	 = this;
+	t_worker = id;
+
+	for (;;) {
+		Job job;
+		if (take(id, job)) {
+			try {
+				job();
+			} catch (const std::exception &e) {
+				dbLog(dbg::LOG_ERROR, "compute job failed: ", e.what());
+			}
+			continue;
+		}
+
+		std::unique_lock lock(m_sleepMutex);
+		m_wake.wait(lock, [this] { return m_stopping || m_pending.load() > 0; });
+		if (m_stopping) return;
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A work-stealing thread pool for CPU-heavy handlers, kept apart from the epoll workers so that a long job never
+ * delays I/O.
+ *
+ * Every worker has its own deque. Jobs submitted from outside the pool are spread over the deques round robin, jobs
+ * submitted by a job go to the deque of the worker running it. A worker takes the newest job of its own deque and,
+ * once that is empty, steals the oldest job of another one.
+ */
+class ComputePool {
+   public:
+	using Job = std::function<void()>;
+
+	/**
+	 * @param threads number of workers, 0 for one per core
+	 */
+	explicit ComputePool(unsigned int threads = 0);
+	ComputePool(const ComputePool &)			= delete;
+	ComputePool &operator=(const ComputePool &) = delete;
+	/// Waits for the running jobs to finish. Jobs that have not started yet are dropped.
+	~ComputePool();
+
+	/**
+	 * @brief Queues a job. Safe to call from any thread, including the pool's own workers.
+	 */
+	void submit(Job job);
+
+	unsigned int size() const { return m_threads.size(); }
+	/// Jobs queued but not started yet.
+	std::size_t pending() const { return m_pending.load(std::memory_order_relaxed); }
+
+   private:
+	struct alignas(64) Queue {
+		std::mutex		mutex;
+		std::deque<Job> jobs;
+	};
+
+	void run(unsigned int id);
+	bool take(unsigned int id, Job &job);
+
+	std::vector<std::unique_ptr<Queue>> m_queues;
+	std::vector<std::thread>			m_threads;
+	std::atomic_size_t					m_pending = 0;
+	std::atomic_uint					m_next	  = 0;	  // queue of the next job submitted from outside the pool
+	std::mutex							m_sleepMutex;
+	std::condition_variable				m_wake;
+	bool								m_stopping = false;	   // guarded by m_sleepMutex
+};
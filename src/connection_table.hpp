@@ -0,0 +1,162 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+
+/**
+ * @brief Per-connection state indexed by file descriptor, with lookups that take neither a lock nor a reference count.
+ *
+ * Every descriptor owns a slot that is allocated in chunks on first use and never freed or moved before the table
+ * itself, so a pointer to a slot can be kept in epoll_event.data.ptr. Each slot has a single atomic state word: the
+ * upper half is a generation, odd while the slot holds a connection and bumped on open and on close, the lower half
+ * counts the events seen while the connection is being handled. Whoever raises the count from 0 owns the connection
+ * until it brings the count back to 0 or closes it, everyone else only leaves a note that there is more to do. A
+ * reference taken for a connection stops matching once it is closed, even if its descriptor is reused.
+ */
+template <class T>
+class ConnectionTable {
+   public:
+	class Slot {
+	   public:
+		Slot() = default;
+		Slot(const Slot &)			  = delete;
+		Slot &operator=(const Slot &) = delete;
+
+		/// Only valid for the owner of the connection.
+		T &operator*() { return *std::launder(reinterpret_cast<T *>(m_storage)); }
+		T *operator->() { return &**this; }
+
+		/// Events seen since the owner entered, the value to pass to leave().
+		uint32_t events() const { return uint32_t(m_state.load(std::memory_order_acquire)); }
+
+	   private:
+		friend class ConnectionTable;
+
+		std::atomic_uint64_t m_state = 0;
+		alignas(T) unsigned char m_storage[sizeof(T)];
+	};
+
+	/// Refers to one connection, stays safe to use after it has been closed.
+	struct Ref {
+		Slot	*slot		= nullptr;
+		uint32_t generation = 0;
+
+		explicit operator bool() const { return slot; }
+	};
+
+	/**
+	 * @param capacity one more than the highest descriptor that can be stored, by default the RLIMIT_NOFILE soft limit
+	 */
+	explicit ConnectionTable(std::size_t capacity = 0) {
+		if (!capacity) {
+			rlimit limit;
+			capacity = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY ? limit.rlim_cur : 0;
+			capacity = std::min<std::size_t>(std::max<std::size_t>(capacity, 1024), MAX_CAPACITY);
+		}
+		m_numChunks = (capacity + CHUNK - 1) / CHUNK;
+		m_chunks	= std::make_unique<std::atomic<Slot *>[]>(m_numChunks);
+	}
+	ConnectionTable(const ConnectionTable &)			= delete;
+	ConnectionTable &operator=(const ConnectionTable &) = delete;
+	/// Destroys the connections still open, none may be in use.
+	~ConnectionTable() {
+		for (std::size_t i = 0; i < m_numChunks; i++) {
+			Slot *chunk = m_chunks[i].load();
+			if (!chunk) continue;
+			for (std::size_t j = 0; j < CHUNK; j++) {
+				if (occupied(chunk[j])) (*chunk[j]).~T();
+			}
+			delete[] chunk;
+		}
+	}
+
+	std::size_t capacity() const { return m_numChunks * CHUNK; }
+
+	/**
+	 * @brief Constructs the connection for fd, owned by the caller as if it had entered it. The descriptor must not be
+	 * in use by another connection of the table.
+	 * @return a reference to the connection, empty if fd is beyond the capacity
+	 */
+	template <class... Args>
+	Ref open(int fd, Args &&...args) {
+		Slot *slot = this->slot(fd);
+		if (!slot) return {};
+
+		uint32_t generation = uint32_t(slot->m_state.load(std::memory_order_acquire) >> 32) + 1;
+		::new (slot->m_storage) T(std::forward<Args>(args)...);
+		slot->m_state.store(uint64_t(generation) << 32 | 1, std::memory_order_release);
+		return {slot, generation};
+	}
+
+	/**
+	 * @brief Counts an event for whatever connection the slot holds.
+	 * @return true if the caller now owns the connection and has to handle it
+	 */
+	static bool enter(Slot &slot) { return enter(slot, 0); }
+	/// Like enter(Slot &), but only for the referenced connection.
+	static bool enter(const Ref &ref) { return enter(*ref.slot, ref.generation); }
+
+	/**
+	 * @brief Gives up ownership unless more events have been seen than the given count, which is updated then.
+	 * @return true if the connection has been left
+	 */
+	static bool leave(Slot &slot, uint32_t &seen) {
+		uint64_t state = slot.m_state.load(std::memory_order_relaxed);
+		uint64_t held  = (state & ~uint64_t(UINT32_MAX)) | seen;
+		if (slot.m_state.compare_exchange_strong(held, state & ~uint64_t(UINT32_MAX), std::memory_order_acq_rel)) {
+			return true;
+		}
+		seen = uint32_t(held);
+		return false;
+	}
+
+	/**
+	 * @brief Destroys the connection of the slot, called by its owner. Events and references that arrive later are
+	 * ignored. The slot can be reused as soon as this returns.
+	 */
+	static void close(Slot &slot) {
+		uint64_t closed = ((slot.m_state.load(std::memory_order_relaxed) >> 32) + 1) << 32;
+		slot.m_state.store(closed, std::memory_order_release);
+		(*slot).~T();
+		// stored again for the destruction to happen before whatever open() constructs in the slot next
+		slot.m_state.store(closed, std::memory_order_release);
+	}
+
+	/// Whether the slot holds a connection.
+	static bool occupied(const Slot &slot) { return slot.m_state.load(std::memory_order_acquire) >> 32 & 1; }
+
+   private:
+	static constexpr std::size_t CHUNK		  = 64;
+	static constexpr std::size_t MAX_CAPACITY = std::size_t(1) << 24;
+
+	static bool enter(Slot &slot, uint32_t generation) {
+		uint64_t state = slot.m_state.load(std::memory_order_acquire);
+		do {
+			uint32_t current = uint32_t(state >> 32);
+			if (!(current & 1) || (generation && current != generation)) return false;
+		} while (!slot.m_state.compare_exchange_weak(state, state + 1, std::memory_order_acq_rel));
+		return uint32_t(state) == 0;
+	}
+
+	Slot *slot(int fd) {
+		if (fd < 0 || std::size_t(fd) >= capacity()) return nullptr;
+		std::atomic<Slot *> &entry = m_chunks[fd / CHUNK];
+		Slot				*chunk = entry.load(std::memory_order_acquire);
+		if (!chunk) {
+			// accepting workers of a shared table may race for a new chunk, the loser drops its own
+			Slot *fresh = new Slot[CHUNK];
+			if (entry.compare_exchange_strong(chunk, fresh, std::memory_order_acq_rel)) chunk = fresh;
+			else delete[] fresh;
+		}
+		return &chunk[fd % CHUNK];
+	}
+
+	std::unique_ptr<std::atomic<Slot *>[]> m_chunks;
+	std::size_t							   m_numChunks = 0;
+};
@@ -0,0 +1,290 @@
+#include <dir_listing.hpp>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <ctime>
+#include <mutex>
+
+// big enough for hundreds of entries per getdents64 call, small enough for the stack of a worker
+static constexpr std::size_t DIRENT_BUFFER = 32 * 1024;
+
+static void appendHTML(std::string &out, std::string_view text) {
+	for (char c : text) {
+		switch (c) {
+			case '&': out += "&amp;"; break;
+			case '<': out += "&lt;"; break;
+			case '>': out += "&gt;"; break;
+			case '"': out += "&quot;"; break;
+			case '\'': out += "&#39;"; break;
+			default: out += c;
+		}
+	}
+}
+
+/// Appends a name as a relative URL path segment, percent-encoding everything but the unreserved characters.
+static void appendURL(std::string &out, std::string_view name) {
+	static constexpr char HEX[] = "0123456789ABCDEF";
+	for (unsigned char c : name) {
+		bool unreserved = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' ||
+						  c == '.' || c == '_' || c == '~';
+		if (unreserved) {
+			out += char(c);
+		} else {
+			out += '%';
+			out += HEX[c >> 4];
+			out += HEX[c & 15];
+		}
+	}
+}
+
+static void appendJSON(std::string &out, std::string_view text) {
+	static constexpr char HEX[] = "0123456789abcdef";
+	for (unsigned char c : text) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += char(c);
+		} else if (c < 0x20) {
+			out += "\\u00";
+			out += HEX[c >> 4];
+			out += HEX[c & 15];
+		} else {
+			out += char(c);
+		}
+	}
+}
+
+static std::string_view typeName(uint8_t type) {
+	switch (type) {
+		case DT_DIR: return "dir";
+		case DT_REG: return "file";
+		case DT_LNK: return "link";
+		default: return "other";
+	}
+}
+
+static std::size_t parseNumber(std::string_view text, std::size_t fallback) {
+	std::size_t value;
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+	return error == std::errc() && end == text.data() + text.size() ? value : fallback;
+}
+
+DirListingCache::Query DirListingCache::Query::parse(std::string_view query) {
+	Query res;
+	while (!query.empty()) {
+		std::size_t		 end   = std::min(query.find('&'), query.size());
+		std::string_view param = query.substr(0, end);
+		query.remove_prefix(std::min(end + 1, query.size()));
+
+		std::size_t		 eq	   = std::min(param.find('='), param.size());
+		std::string_view name  = param.substr(0, eq);
+		std::string_view value = param.substr(std::min(eq + 1, param.size()));
+		if (name == "format") res.format = value == "json" ? JSON : HTML;
+		else if (name == "sort") res.sorted = value != "none";
+		else if (name == "offset") res.offset = parseNumber(value, 0);
+		else if (name == "limit") res.limit = parseNumber(value, SIZE_MAX);
+	}
+	return res;
+}
+
+std::size_t DirListingCache::Listing::bytes() const {
+	return names.size() + items.size() * sizeof(Item) + order.size() * sizeof(uint32_t) + body.size() + source.size();
+}
+
+int64_t DirListingCache::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+void DirListingCache::setBudget(std::size_t bytes) {
+	std::unique_lock lock(m_mutex);
+	m_budget = bytes;
+	evict();
+}
+
+DirListingCache::Listing_ptr DirListingCache::get(const std::string &path, Format format) {
+	if (!enabled()) return load(path, format);
+
+	Map		   &entries = m_entries[format];
+	Listing_ptr listing;
+	{
+		std::shared_lock lock(m_mutex);
+		auto			 it = entries.find(path);
+		if (it != entries.end()) listing = it->second;
+	}
+
+	if (listing && isFresh(*listing)) {
+		listing->referenced.store(true, std::memory_order_relaxed);
+		++m_hits;
+		return listing;
+	}
+
+	++m_misses;
+	listing = load(path, format);
+
+	std::unique_lock lock(m_mutex);
+	auto			 it = entries.find(path);
+	if (it != entries.end()) {
+		m_bytes -= it->second->bytes();
+		entries.erase(it);
+	}
+	if (listing && listing->bytes() <= m_budget) {
+		entries.emplace(path, listing);
+		m_bytes += listing->bytes();
+		evict();
+	}
+	return listing;
+}
+
+DirListingCache::Listing_ptr DirListingCache::load(const std::string &path, Format format) {
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	// the directory is looked at before it is read, a change while reading it changes the mtime seen next time
+	struct timespec started;
+	struct stat		statbuf;
+	clock_gettime(CLOCK_REALTIME, &started);
+	if (fstat(fd, &statbuf) < 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	auto listing	   = std::make_shared<Listing>();
+	listing->format	   = format;
+	listing->source	   = path;
+	listing->mtime	   = statbuf.st_mtim;
+	listing->inode	   = statbuf.st_ino;
+	listing->checkedAt = now();
+	// mtimes come from a clock that only ticks every few milliseconds, changes within the same tick as the one seen
+	// here would go unnoticed
+	listing->racy = statbuf.st_mtim.tv_sec >= started.tv_sec - 1;
+
+	alignas(struct dirent64) char buffer[DIRENT_BUFFER];
+	for (;;) {
+		long n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			close(fd);
+			return nullptr;
+		}
+		if (n == 0) break;
+
+		for (long offset = 0; offset < n;) {
+			auto *entry = reinterpret_cast<struct dirent64 *>(buffer + offset);
+			offset += entry->d_reclen;
+			std::string_view name = entry->d_name;
+			if (name == ".") continue;
+
+			uint8_t type = entry->d_type;
+			// some file systems do not report the type
+			if (type == DT_UNKNOWN && fstatat(fd, entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+				type = IFTODT(statbuf.st_mode);
+			}
+			listing->items.push_back({uint32_t(listing->names.size()), uint8_t(name.size()), type});
+			listing->names += name;
+		}
+	}
+	close(fd);
+
+	listing->order.resize(listing->items.size());
+	for (uint32_t i = 0; i < listing->order.size(); i++) listing->order[i] = i;
+	std::sort(listing->order.begin(), listing->order.end(), [&](uint32_t a, uint32_t b) {
+		const Item &x = listing->items[a], &y = listing->items[b];
+		if ((x.type == DT_DIR) != (y.type == DT_DIR)) return x.type == DT_DIR;
+		return listing->name(x) < listing->name(y);
+	});
+
+	listing->body = render(*listing, Query{.format = format});
+	return listing;
+}
+
+std::string DirListingCache::render(const Listing &listing, const Query &query) {
+	std::size_t total = listing.items.size();
+	std::size_t first = std::min(query.offset, total);
+	std::size_t last  = first + std::min(query.limit, total - first);
+
+	std::string out;
+	// roughly what the markup adds to every name
+	out.reserve(listing.format == JSON ? (last - first) * 48 : (last - first) * 64);
+	if (listing.format == JSON) {
+		out += "{\"total\":";
+		out += std::to_string(total);
+		out += ",\"offset\":";
+		out += std::to_string(first);
+		out += ",\"entries\":[";
+	}
+
+	for (std::size_t i = first; i < last; i++) {
+		const Item		&item = listing.items[query.sorted ? listing.order[i] : i];
+		std::string_view name = listing.name(item);
+		if (listing.format == JSON) {
+			if (i != first) out += ',';
+			out += "{\"name\":\"";
+			appendJSON(out, name);
+			out += "\",\"type\":\"";
+			out += typeName(item.type);
+			out += "\"}";
+		} else if (item.type == DT_DIR || item.type == DT_REG) {
+			out += "<a href=\"./";
+			appendURL(out, name);
+			out += item.type == DT_DIR ? "/\">" : "\">";
+			appendHTML(out, name);
+			out += item.type == DT_DIR ? "/</a><br>" : "</a><br>";
+		} else {
+			appendHTML(out, name);
+			out += "<br>";
+		}
+	}
+
+	if (listing.format == JSON) {
+		out += "]}";
+	} else if (last < total) {
+		out += "<a href=\"?offset=";
+		out += std::to_string(last);
+		out += "&amp;limit=";
+		out += std::to_string(query.limit);
+		if (!query.sorted) out += "&amp;sort=none";
+		out += "\">next</a><br>";
+	}
+	return out;
+}
+
+bool DirListingCache::isFresh(const Listing &listing) {
+	int64_t t		= now();
+	int64_t checked = listing.checkedAt.load(std::memory_order_relaxed);
+	if (t - checked < std::chrono::duration_cast<std::chrono::nanoseconds>(revalidateInterval).count()) return true;
+	// only one thread revalidates a listing, the others keep using it meanwhile
+	if (!listing.checkedAt.compare_exchange_strong(checked, t)) return true;
+	if (listing.racy) return false;
+
+	struct stat statbuf;
+	if (stat(listing.source.c_str(), &statbuf) < 0) return false;
+	return statbuf.st_ino == listing.inode && statbuf.st_mtim.tv_sec == listing.mtime.tv_sec &&
+		   statbuf.st_mtim.tv_nsec == listing.mtime.tv_nsec;
+}
+
+void DirListingCache::evict() {
+	// second chance: listings used since the last sweep get their bit cleared and survive one more round
+	while (m_bytes > m_budget && (!m_entries[HTML].empty() || !m_entries[JSON].empty())) {
+		for (Map &entries : m_entries) {
+			for (auto it = entries.begin(); it != entries.end() && m_bytes > m_budget;) {
+				if (it->second->referenced.exchange(false, std::memory_order_relaxed)) {
+					++it;
+					continue;
+				}
+				m_bytes -= it->second->bytes();
+				it = entries.erase(it);
+				++m_evictions;
+			}
+		}
+	}
+}
+
+DirListingCache::Stats DirListingCache::stats() const {
+	std::shared_lock lock(m_mutex);
+	return {m_hits, m_misses, m_evictions, m_entries[HTML].size() + m_entries[JSON].size(), m_bytes, m_budget};
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "utils.hpp"
+
+/**
+ * @brief Cache of directory listings keyed by the local path of the directory.
+ *
+ * A directory is read with getdents64 into a buffer of many entries per system call. Its entries are kept together
+ * with the listing of all of them, sorted and rendered in the requested format, which is sent without being copied.
+ * Other orders and pages are rendered from the kept entries, so a listing only reads the directory again after it
+ * changed. Entries are revalidated against the directory's mtime and inode at most once per revalidation interval.
+ * Like FileCache, the cache keeps to a memory budget by evicting listings not used since the last sweep.
+ *
+ * Lookups only take a shared lock.
+ */
+class DirListingCache {
+   public:
+	enum Format : uint8_t { HTML, JSON, FORMATS };
+
+	/// What a listing shows, taken from the query of the request.
+	struct Query {
+		Format		format = HTML;
+		/// directories first, then by name. Otherwise in the order the directory returns its entries
+		bool		sorted = true;
+		std::size_t offset = 0, limit = SIZE_MAX;
+
+		/// Whether the whole listing is asked for, which is kept rendered.
+		bool whole() const { return sorted && !offset && limit == SIZE_MAX; }
+
+		/**
+		 * @brief Reads "format=html|json", "sort=name|none", "offset=N" and "limit=N" from a query string. Anything
+		 * else is ignored.
+		 */
+		static Query parse(std::string_view query);
+	};
+
+	/// An entry of a directory, its name is in Listing::names.
+	struct Item {
+		uint32_t name;
+		uint8_t	 length;	// names are at most 255 bytes
+		uint8_t	 type;		// DT_DIR, DT_REG, ...
+	};
+
+	struct Listing {
+		std::string_view name(const Item &item) const { return std::string_view(names).substr(item.name, item.length); }
+		std::size_t		 bytes() const;
+
+		std::string		  names;
+		/// in directory order
+		std::vector<Item> items;
+		/// indices into items, directories first and then by name
+		std::vector<uint32_t> order;
+		/// the whole sorted listing
+		std::string body;
+		Format		format;
+
+		/// the directory the listing was made from and is revalidated against
+		std::string		source;
+		struct timespec mtime;
+		ino_t			inode;
+		/// the directory was modified so shortly before it was read that a later change may not change its mtime
+		bool						racy;
+		mutable std::atomic_int64_t checkedAt;	  // steady clock, nanoseconds
+		mutable std::atomic_bool	referenced = true;
+	};
+	using Listing_ptr = std::shared_ptr<const Listing>;
+
+	struct Stats {
+		uint64_t	hits, misses, evictions;
+		std::size_t entries, bytes, budget;
+	};
+
+	/**
+	 * @brief Sets the memory budget in bytes. A budget of 0 disables the cache, every listing reads the directory.
+	 */
+	void setBudget(std::size_t bytes);
+	bool enabled() const { return m_budget != 0; }
+
+	/**
+	 * @brief Returns the listing of a directory, reading it on a miss.
+	 *
+	 * @return nullptr if the directory cannot be opened
+	 */
+	Listing_ptr get(const std::string &path, Format format);
+
+	/**
+	 * @brief Reads a directory without caching it.
+	 */
+	static Listing_ptr load(const std::string &path, Format format);
+
+	/**
+	 * @brief Renders the part of a listing a query asks for, in the format of the listing.
+	 */
+	static std::string render(const Listing &listing, const Query &query);
+
+	static std::string_view contentType(Format format) {
+		return format == JSON ? "application/json" : "text/html; charset=utf-8";
+	}
+
+	Stats stats() const;
+
+	std::chrono::steady_clock::duration revalidateInterval = std::chrono::seconds(1);
+
+   private:
+	using Map = std::unordered_map<std::string, Listing_ptr, std::hash<std::string>, std::equal_to<>>;
+
+	bool isFresh(const Listing &listing);
+	void evict();
+
+	static int64_t now();
+
+	mutable std::shared_mutex m_mutex;
+	Map						  m_entries[FORMATS];
+	std::size_t				  m_bytes  = 0;
+	std::atomic_size_t		  m_budget = 0;
+
+	std::atomic_uint64_t m_hits = 0, m_misses = 0, m_evictions = 0;
+};
@@ -0,0 +1,284 @@
+#include <file_cache.hpp>
+#include <http_parser.hpp>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cstdio>
+#include <mutex>
+
+std::string fileResponseHead(int status, std::string_view msg, std::string_view path, std::size_t size,
+							 std::string_view etag, std::string_view lastModified, std::string_view encoding,
+							 bool vary) {
+	ResponseHead head(status, msg);
+	head.header(ResponseHead::CONTENT_TYPE, mimeType(path).contentType).header(ResponseHead::CONTENT_LENGTH, size);
+	if (!encoding.empty()) head.header(ResponseHead::CONTENT_ENCODING, encoding);
+	if (vary) head.header(ResponseHead::VARY, "Accept-Encoding");
+	if (!etag.empty()) head.header(ResponseHead::ETAG, etag);
+	if (!lastModified.empty()) head.header(ResponseHead::LAST_MODIFIED, lastModified);
+	if (!etag.empty()) head.header(ResponseHead::ACCEPT_RANGES, "bytes");
+	return std::string(head.view());
+}
+
+/**
+ * @brief Compresses data into the gzip format.
+ *
+ * @return false if zlib failed
+ */
+static bool gzipCompress(std::string_view data, std::string &out) {
+	z_stream stream = {};
+	// 15 window bits + 16 selects the gzip wrapper instead of zlib's
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+	out.resize(deflateBound(&stream, data.size()));
+	stream.next_in	 = (Bytef *)data.data();
+	stream.avail_in	 = data.size();
+	stream.next_out	 = (Bytef *)out.data();
+	stream.avail_out = out.size();
+
+	int res = deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return res == Z_STREAM_END;
+}
+
+FileCache::Entry::~Entry() {
+	if (fd >= 0) close(fd);
+}
+
+int64_t FileCache::now() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+		.count();
+}
+
+void FileCache::setBudget(std::size_t bytes) {
+	std::unique_lock lock(m_mutex);
+	m_budget = bytes;
+	evict();
+}
+
+FileCache::Entry_ptr FileCache::get(const std::string &path, int status, std::string_view msg, Encoding encoding) {
+	Map		 &entries = m_entries[encoding];
+	Entry_ptr entry;
+	{
+		std::shared_lock lock(m_mutex);
+		auto			 it = entries.find(path);
+		if (it != entries.end()) entry = it->second;
+	}
+
+	if (entry && entry->status == status && isFresh(*entry)) {
+		entry->referenced.store(true, std::memory_order_relaxed);
+		++m_hits;
+		return entry->missing ? nullptr : entry;
+	}
+
+	++m_misses;
+	entry = load(path, status, msg, encoding);
+
+	std::unique_lock lock(m_mutex);
+	auto			 it = entries.find(path);
+	if (it != entries.end()) {
+		uncharge(*it->second);
+		entries.erase(it);
+	}
+	if (entry && entry->response.size() <= m_budget) {
+		entries.emplace(path, entry);
+		m_bytes += entry->response.size();
+		if (entry->fd >= 0) ++m_openFiles;
+		evict();
+	}
+	return entry && !entry->missing ? entry : nullptr;
+}
+
+FileCache::Entry_ptr FileCache::open(const std::string &path, int status, std::string_view msg, Encoding encoding) {
+	if (encoding == GZIP) return loadFile(path + ".gz", path, status, msg, GZIP, 0, true);
+	return loadFile(path, path, status, msg, IDENTITY, 0, hasVariant(path));
+}
+
+std::size_t FileCache::warm(const std::string &dir) {
+	DIR *d = opendir(dir.c_str());
+	if (!d) return 0;
+
+	std::size_t	   compressed = 0;
+	struct dirent *file;
+	while ((file = readdir(d)) != NULL) {
+		std::string_view name = file->d_name;
+		if (name.starts_with('.')) continue;
+
+		std::string path = dir + "/" + file->d_name;
+		if (file->d_type == DT_DIR) {
+			compressed += warm(path);
+		} else if (file->d_type == DT_REG && !name.ends_with(".gz")) {
+			get(path, 200, "OK");
+			if (get(path, 200, "OK", GZIP)) ++compressed;
+		}
+	}
+	closedir(d);
+	return compressed;
+}
+
+void FileCache::setValidators(Entry &entry, Encoding encoding) {
+	// the variants of a file need different tags, otherwise a cached gzip body could be validated for a client that
+	// asked for the identity one
+	char etag[80];
+	int	 n = snprintf(etag, sizeof(etag), "\"%lx-%zx-%lx%09lx%s\"", (unsigned long)entry.inode, entry.sourceSize,
+					  (unsigned long)entry.mtime.tv_sec, (unsigned long)entry.mtime.tv_nsec,
+					  encoding == GZIP ? "-gzip" : "");
+	entry.etag		   = std::string(etag, n);
+	entry.lastModified = formatHTTPDate(entry.mtime.tv_sec);
+}
+
+FileCache::Entry_ptr FileCache::load(const std::string &path, int status, std::string_view msg,
+									 Encoding encoding) const {
+	if (encoding == IDENTITY) {
+		return loadFile(path, path, status, msg, IDENTITY, smallFileLimit, hasVariant(path));
+	}
+
+	Entry_ptr entry = loadFile(path + ".gz", path, status, msg, GZIP, smallFileLimit, true);
+	if (!entry && compress) entry = compressFile(path, status, msg);
+	if (entry) return entry;
+
+	// remember that there is no variant until the file changes
+	struct stat statbuf;
+	if (stat(path.c_str(), &statbuf) < 0 || S_ISDIR(statbuf.st_mode)) return nullptr;
+	auto missing		= std::make_shared<Entry>();
+	missing->missing	= true;
+	missing->source		= path;
+	missing->sourceSize = statbuf.st_size;
+	missing->status		= status;
+	missing->mtime		= statbuf.st_mtim;
+	missing->inode		= statbuf.st_ino;
+	missing->checkedAt	= now();
+	return missing;
+}
+
+FileCache::Entry_ptr FileCache::loadFile(const std::string &source, const std::string &path, int status,
+										 std::string_view msg, Encoding encoding, std::size_t memoryLimit,
+										 bool vary) {
+	int fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return nullptr;
+
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) < 0 || S_ISDIR(statbuf.st_mode)) {
+		close(fd);
+		return nullptr;
+	}
+
+	auto entry		  = std::make_shared<Entry>();
+	entry->size		  = statbuf.st_size;
+	entry->source	  = source;
+	entry->sourceSize = statbuf.st_size;
+	entry->status	  = status;
+	entry->mtime	  = statbuf.st_mtim;
+	entry->inode	  = statbuf.st_ino;
+	entry->checkedAt  = now();
+	// error pages are not meant to be revalidated by clients
+	if (status == 200) setValidators(*entry, encoding);
+	entry->vary		= vary;
+	entry->response = fileResponseHead(status, msg, path, entry->size, entry->etag, entry->lastModified,
+									   encoding == GZIP ? "gzip" : "", vary);
+	entry->headSize = entry->response.size();
+
+	if (entry->size > memoryLimit) {
+		entry->fd = fd;
+		return entry;
+	}
+
+	entry->response.resize(entry->headSize + entry->size);
+	std::size_t done = 0;
+	while (done < entry->size) {
+		ssize_t res = pread(fd, entry->response.data() + entry->headSize + done, entry->size - done, done);
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) {
+			close(fd);
+			return nullptr;
+		}
+		done += res;
+	}
+	close(fd);
+	return entry;
+}
+
+FileCache::Entry_ptr FileCache::compressFile(const std::string &path, int status, std::string_view msg) const {
+	if (!mimeType(path).compressible) return nullptr;
+
+	Entry_ptr original = loadFile(path, path, status, msg, IDENTITY, compressLimit, true);
+	if (!original || original->fd >= 0) return nullptr;
+
+	std::string compressed;
+	// not worth a Content-Encoding header if it does not get smaller
+	if (!gzipCompress(original->body(), compressed) || compressed.size() >= original->size) return nullptr;
+
+	auto entry		  = std::make_shared<Entry>();
+	entry->size		  = compressed.size();
+	entry->source	  = path;
+	entry->sourceSize = original->size;
+	entry->status	  = status;
+	entry->mtime	  = original->mtime;
+	entry->inode	  = original->inode;
+	entry->checkedAt  = now();
+	entry->vary		  = true;
+	if (status == 200) setValidators(*entry, GZIP);
+	entry->response = fileResponseHead(status, msg, path, entry->size, entry->etag, entry->lastModified, "gzip", true);
+	entry->headSize = entry->response.size();
+	entry->response += compressed;
+	return entry;
+}
+
+bool FileCache::hasVariant(const std::string &path) {
+	// compressible files are assumed to have one, whether it is compressed depends on the cache and the client
+	return mimeType(path).compressible || access((path + ".gz").c_str(), F_OK) == 0;
+}
+
+bool FileCache::isFresh(const Entry &entry) {
+	int64_t t		= now();
+	int64_t checked = entry.checkedAt.load(std::memory_order_relaxed);
+	if (t - checked < std::chrono::duration_cast<std::chrono::nanoseconds>(revalidateInterval).count()) return true;
+	// only one thread revalidates an entry, the others keep using it meanwhile
+	if (!entry.checkedAt.compare_exchange_strong(checked, t)) return true;
+
+	struct stat statbuf;
+	if (stat(entry.source.c_str(), &statbuf) < 0) return false;
+	return statbuf.st_ino == entry.inode && std::size_t(statbuf.st_size) == entry.sourceSize &&
+		   statbuf.st_mtim.tv_sec == entry.mtime.tv_sec && statbuf.st_mtim.tv_nsec == entry.mtime.tv_nsec;
+}
+
+void FileCache::uncharge(const Entry &entry) {
+	m_bytes -= entry.response.size();
+	if (entry.fd >= 0) --m_openFiles;
+}
+
+void FileCache::evict() {
+	auto over = [&] { return m_bytes > m_budget || m_openFiles > maxOpenFiles; };
+	// second chance: entries used since the last sweep get their bit cleared and survive one more round
+	while (over() && (!m_entries[IDENTITY].empty() || !m_entries[GZIP].empty())) {
+		for (Map &entries : m_entries) {
+			for (auto it = entries.begin(); it != entries.end() && over();) {
+				// within the byte budget only entries holding a descriptor have to go
+				bool needed = m_bytes > m_budget || it->second->fd >= 0;
+				if (!needed || it->second->referenced.exchange(false, std::memory_order_relaxed)) {
+					++it;
+					continue;
+				}
+				uncharge(*it->second);
+				it = entries.erase(it);
+				++m_evictions;
+			}
+		}
+	}
+}
+
+std::size_t FileCache::defaultMaxOpenFiles() {
+	// leaves most descriptors to the connections
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY) return 1024;
+	return std::max<std::size_t>(limit.rlim_cur / 4, 1);
+}
+
+FileCache::Stats FileCache::stats() const {
+	std::shared_lock lock(m_mutex);
+	return {m_hits, m_misses, m_evictions, m_entries[IDENTITY].size() + m_entries[GZIP].size(),
+			m_bytes, m_budget, m_openFiles};
+}
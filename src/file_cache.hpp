@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#include "response.hpp"
+#include "utils.hpp"
+
+/**
+ * @brief Status line and headers of a response that sends a whole file. The validators and the content coding are
+ * only sent if not empty.
+ */
+std::string fileResponseHead(int status, std::string_view msg, std::string_view path, std::size_t size,
+							 std::string_view etag = {}, std::string_view lastModified = {},
+							 std::string_view encoding = {}, bool vary = false);
+
+/**
+ * @brief Cache of static file responses keyed by the local path of the file.
+ *
+ * Small files are kept as a complete pre-serialized response. Larger ones keep an open file descriptor together with
+ * the serialized headers and are sent with sendfile. Entries are revalidated against the file's mtime, size and inode
+ * at most once per revalidation interval. When the cached bytes exceed the memory budget, or the entries holding a
+ * descriptor exceed maxOpenFiles, entries that have not been used since the last sweep are evicted (CLOCK / second
+ * chance).
+ *
+ * Every file can also have a gzip variant. It is taken from a precompressed ".gz" sibling if there is one, or, with
+ * compression enabled, compressed once with zlib and kept in memory.
+ *
+ * Lookups only take a shared lock.
+ */
+class FileCache {
+   public:
+	enum Encoding { IDENTITY, GZIP };
+
+	struct Entry {
+		Entry()						   = default;
+		Entry(const Entry &)		   = delete;
+		Entry &operator=(const Entry &) = delete;
+		~Entry();
+
+		/// status line, headers and, for small files, the body
+		std::string response;
+		std::size_t headSize = 0;
+		/// open descriptor of a file whose body is not kept in memory, -1 otherwise
+		int			fd = -1;
+		std::size_t size;
+
+		/// body of a small file kept in memory
+		std::string_view body() const { return std::string_view(response).substr(headSize); }
+
+		/// the file the entry was made from and is revalidated against
+		std::string		  source;
+		std::size_t		  sourceSize;
+		/// set for a variant that does not exist, so that it is not looked for on every request
+		bool			  missing = false;
+		/// the file has or may have a gzip variant, responses for it carry "Vary: Accept-Encoding"
+		bool			  vary = false;
+		int				  status;
+		struct timespec	  mtime;
+		ino_t			  inode;
+		std::string		  etag, lastModified;
+		mutable std::atomic_int64_t checkedAt;	   // steady clock, nanoseconds
+		mutable std::atomic_bool	referenced = true;
+	};
+	using Entry_ptr = std::shared_ptr<const Entry>;
+
+	struct Stats {
+		uint64_t	hits, misses, evictions;
+		std::size_t entries, bytes, budget;
+		/// descriptors held by entries of large files
+		std::size_t openFiles;
+	};
+
+	/**
+	 * @brief Sets the memory budget in bytes. A budget of 0 disables the cache.
+	 */
+	void setBudget(std::size_t bytes);
+	bool enabled() const { return m_budget != 0; }
+
+	/**
+	 * @brief Returns the cached response for a file, loading it on a miss.
+	 *
+	 * @return nullptr if the file cannot be opened, is a directory or has no variant with that encoding
+	 */
+	Entry_ptr get(const std::string &path, int status, std::string_view msg, Encoding encoding = IDENTITY);
+
+	/**
+	 * @brief Opens a file (or its ".gz" sibling) without caching it. The body is always left on disk.
+	 */
+	static Entry_ptr open(const std::string &path, int status, std::string_view msg, Encoding encoding = IDENTITY);
+
+	/**
+	 * @brief Loads the regular files of a directory and, with compression enabled, their gzip variants.
+	 *
+	 * @return the number of gzip variants available afterwards
+	 */
+	std::size_t warm(const std::string &dir);
+
+	Stats stats() const;
+
+	/// Files up to this size are kept in memory together with their headers.
+	std::size_t						 smallFileLimit		 = 64 * 1024;
+	/// Entries of larger files that may hold an open descriptor, a quarter of RLIMIT_NOFILE by default.
+	std::size_t maxOpenFiles = defaultMaxOpenFiles();
+	std::chrono::steady_clock::duration revalidateInterval = std::chrono::seconds(1);
+	/// Compress compressible files without a ".gz" sibling in memory.
+	bool		compress	  = false;
+	std::size_t compressLimit = 4 * 1024 * 1024;
+
+   private:
+	using Map = std::unordered_map<std::string, Entry_ptr, std::hash<std::string>, std::equal_to<>>;
+
+	Entry_ptr		 load(const std::string &path, int status, std::string_view msg, Encoding encoding) const;
+	static Entry_ptr loadFile(const std::string &source, const std::string &path, int status, std::string_view msg,
+							  Encoding encoding, std::size_t memoryLimit, bool vary);
+	Entry_ptr		 compressFile(const std::string &path, int status, std::string_view msg) const;
+	static bool		 hasVariant(const std::string &path);
+	bool			 isFresh(const Entry &entry);
+	void			 evict();
+	void			 uncharge(const Entry &entry);
+
+	static std::size_t defaultMaxOpenFiles();
+
+	static int64_t now();
+	static void	   setValidators(Entry &entry, Encoding encoding);
+
+	mutable std::shared_mutex m_mutex;
+	Map						  m_entries[2];	  // indexed by Encoding
+	std::size_t				  m_bytes	  = 0;
+	std::size_t				  m_openFiles = 0;
+	std::atomic_size_t		  m_budget	  = 0;
+
+	std::atomic_uint64_t m_hits = 0, m_misses = 0, m_evictions = 0;
+};
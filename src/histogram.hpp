@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A log-linear histogram in the manner of HdrHistogram: values below 128 are counted exactly, larger ones in
+ * buckets of 64 per power of two, so that every percentile is reported within 1.6% of the recorded value. Recording is
+ * O(1) and the buckets take a fixed 30 KiB, whatever the range of the values.
+ */
+class Histogram {
+   public:
+	void record(uint64_t value, uint64_t count = 1) {
+		m_counts[index(value)] += count;
+		m_total += count;
+		m_sum += value * count;
+		m_min = std::min(m_min, value);
+		m_max = std::max(m_max, value);
+	}
+
+	void merge(const Histogram &other) {
+		for (std::size_t i = 0; i < BUCKETS; i++) {
+			m_counts[i] += other.m_counts[i];
+		}
+		m_total += other.m_total;
+		m_sum += other.m_sum;
+		m_min = std::min(m_min, other.m_min);
+		m_max = std::max(m_max, other.m_max);
+	}
+
+	void reset() { *this = Histogram(); }
+
+	uint64_t count() const { return m_total; }
+	uint64_t min() const { return m_total ? m_min : 0; }
+	uint64_t max() const { return m_max; }
+	double	 mean() const { return m_total ? double(m_sum) / m_total : 0; }
+
+	/**
+	 * @brief The value below or at which the given percentage of the recorded values lie, reported as the highest
+	 * value of its bucket but never above the largest value recorded.
+	 * @param percentile 0 to 100
+	 */
+	uint64_t percentile(double percentile) const {
+		if (!m_total) return 0;
+		uint64_t rank = uint64_t(percentile / 100 * m_total + 0.5);
+		rank		  = std::clamp<uint64_t>(rank, 1, m_total);
+
+		uint64_t seen = 0;
+		for (std::size_t i = 0; i < BUCKETS; i++) {
+			seen += m_counts[i];
+			if (seen >= rank) return std::clamp(highest(i), min(), m_max);
+		}
+		return m_max;
+	}
+
+   private:
+	static constexpr unsigned int SUB_BITS = 7;
+	static constexpr uint64_t	  SUB	   = uint64_t(1) << SUB_BITS;	 // values counted exactly
+	static constexpr uint64_t	  HALF	   = SUB / 2;					 // buckets per power of two above
+	static constexpr std::size_t  BUCKETS  = SUB + (64 - SUB_BITS) * HALF;
+
+	static std::size_t index(uint64_t value) {
+		if (value < SUB) return value;
+		unsigned int shift = std::bit_width(value) - SUB_BITS;
+		return SUB + (shift - 1) * HALF + ((value >> shift) - HALF);
+	}
+	static uint64_t highest(std::size_t index) {
+		if (index < SUB) return index;
+		unsigned int shift = (index - SUB) / HALF + 1;
+		uint64_t	 top   = (index - SUB) % HALF + HALF;
+		return ((top + 1) << shift) - 1;
+	}
+
+	std::array<uint64_t, BUCKETS> m_counts = {};
+	uint64_t					  m_total  = 0;
+	uint64_t					  m_sum	   = 0;
+	uint64_t					  m_min	   = UINT64_MAX;
+	uint64_t					  m_max	   = 0;
+};
@@ -0,0 +1,367 @@
+#include <http_parser.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+
+static bool iequals(std::string_view a, std::string_view b) {
+	if (a.size() != b.size()) return false;
+	for (std::size_t i = 0; i < a.size(); i++) {
+		if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+	}
+	return true;
+}
+
+static bool isTokenChar(char c) {
+	if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return true;
+	return c && std::strchr("!#$%&'*+-.^_`|~", c);
+}
+
+static bool isToken(std::string_view s) {
+	if (s.empty()) return false;
+	for (char c : s) {
+		if (!isTokenChar(c)) return false;
+	}
+	return true;
+}
+
+static std::string_view trim(std::string_view s) {
+	while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+	while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) s.remove_suffix(1);
+	return s;
+}
+
+std::string_view HTTPRequest::header(std::string_view name) const {
+	for (std::size_t i = 0; i < numHeaders; i++) {
+		if (iequals(headers[i].name, name)) return headers[i].value;
+	}
+	return {};
+}
+
+void HTTPParser::reset() {
+	m_state			   = State::REQUEST_LINE;
+	m_pos			   = 0;
+	m_error			   = 0;
+	m_hasContentLength = false;
+	m_close = m_keepAlive = false;
+	request.numHeaders	  = 0;
+	request.contentLength = 0;
+	request.chunked		  = false;
+	request.keepAlive	  = true;
+}
+
+HTTPParser::Result HTTPParser::parse(std::string_view input) {
+	if (m_state == State::DONE) {
+		// the input may have been moved since the head was parsed
+		materialize(input);
+		return Result::DONE;
+	}
+	if (m_state == State::FAILED) return Result::ERROR;
+
+	while (m_pos < input.size()) {
+		const char *nl = (const char *)std::memchr(input.data() + m_pos, '\n', input.size() - m_pos);
+		if (!nl) return Result::INCOMPLETE;
+
+		std::size_t begin = m_pos, end = nl - input.data();
+		m_pos			  = end + 1;
+		if (end > begin && input[end - 1] == '\r') --end;
+
+		Result res;
+		if (m_state == State::REQUEST_LINE) {
+			// empty lines before a request are allowed (RFC 9112 2.2)
+			if (begin == end) continue;
+			res = parseRequestLine(input, begin, end);
+		} else {
+			if (begin == end) {
+				// a message with both could be framed differently by another server on the way (RFC 9112 6.3)
+				if (request.chunked && m_hasContentLength) return fail(400);
+				// persistence is the default since HTTP/1.1 (RFC 9112 9.3)
+				bool persistent	  = input[m_version.begin + 7] != '0';
+				request.keepAlive = !m_close && (persistent || m_keepAlive);
+				m_state			  = State::DONE;
+				materialize(input);
+				return Result::DONE;
+			}
+			res = parseHeader(input, begin, end);
+		}
+		if (res == Result::ERROR) return res;
+	}
+	return Result::INCOMPLETE;
+}
+
+HTTPParser::Result HTTPParser::parseRequestLine(std::string_view input, std::size_t begin, std::size_t end) {
+	std::string_view line = input.substr(begin, end - begin);
+
+	std::size_t sp1 = line.find(' ');
+	if (sp1 == std::string_view::npos) return fail(400);
+	std::size_t sp2 = line.find(' ', sp1 + 1);
+	if (sp2 == std::string_view::npos || line.find(' ', sp2 + 1) != std::string_view::npos) return fail(400);
+
+	std::string_view method = line.substr(0, sp1), target = line.substr(sp1 + 1, sp2 - sp1 - 1),
+					 version = line.substr(sp2 + 1);
+	if (!isToken(method) || target.empty()) return fail(400);
+	if (version.size() != 8 || !version.starts_with("HTTP/1.")) return fail(505);
+
+	m_method  = {uint32_t(begin), uint32_t(sp1)};
+	m_target  = {uint32_t(begin + sp1 + 1), uint32_t(target.size())};
+	m_version = {uint32_t(begin + sp2 + 1), uint32_t(version.size())};
+	m_state	  = State::HEADERS;
+	return Result::INCOMPLETE;
+}
+
+HTTPParser::Result HTTPParser::parseHeader(std::string_view input, std::size_t begin, std::size_t end) {
+	std::string_view line = input.substr(begin, end - begin);
+
+	// obsolete line folding is rejected (RFC 9112 5.2)
+	if (line.front() == ' ' || line.front() == '\t') return fail(400);
+
+	std::size_t colon = line.find(':');
+	if (colon == std::string_view::npos || !isToken(line.substr(0, colon))) return fail(400);
+	if (request.numHeaders == HTTPRequest::MAX_HEADERS) return fail(431);
+
+	std::string_view name = line.substr(0, colon), value = trim(line.substr(colon + 1));
+	std::size_t		 valueBegin = value.empty() ? end : value.data() - input.data();
+
+	if (iequals(name, "Content-Length")) {
+		std::size_t length;
+		auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), length);
+		if (ec != std::errc() || ptr != value.data() + value.size()) return fail(400);
+		if (m_hasContentLength && length != request.contentLength) return fail(400);
+		m_hasContentLength	  = true;
+		request.contentLength = length;
+	} else if (iequals(name, "Transfer-Encoding")) {
+		// chunked is the only transfer coding supported, it has to be the last one applied (RFC 9112 6.1)
+		if (!iequals(value, "chunked") || request.chunked) return fail(501);
+		request.chunked = true;
+	} else if (iequals(name, "Connection")) {
+		// a comma-separated list of options, close wins over keep-alive
+		for (std::string_view rest = value; !rest.empty();) {
+			std::size_t		 comma = rest.find(',');
+			std::string_view token = trim(rest.substr(0, comma));
+			rest				   = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+			if (iequals(token, "close")) m_close = true;
+			else if (iequals(token, "keep-alive")) m_keepAlive = true;
+		}
+	}
+
+	m_headers[request.numHeaders++] = {{uint32_t(begin), uint32_t(colon)},
+									   {uint32_t(valueBegin), uint32_t(value.size())}};
+	return Result::INCOMPLETE;
+}
+
+void HTTPParser::materialize(std::string_view input) {
+	request.method	= m_method.view(input);
+	request.target	= m_target.view(input);
+	request.version = m_version.view(input);
+
+	std::size_t q = request.target.find('?');
+	request.path  = request.target.substr(0, q);
+	request.query = q == std::string_view::npos ? std::string_view() : request.target.substr(q + 1);
+
+	for (std::size_t i = 0; i < request.numHeaders; i++) {
+		request.headers[i] = {m_headers[i].first.view(input), m_headers[i].second.view(input)};
+	}
+}
+
+void ChunkedDecoder::reset() {
+	m_state		= State::SIZE;
+	m_remaining = 0;
+}
+
+ChunkedDecoder::Result ChunkedDecoder::decode(std::string_view input, std::size_t &consumed, std::string_view &data) {
+	consumed = 0;
+	while (m_state != State::DONE && m_state != State::FAILED) {
+		std::string_view rest = input.substr(consumed);
+
+		if (m_state == State::DATA) {
+			if (rest.empty()) return Result::INCOMPLETE;
+			data = rest.substr(0, m_remaining);
+			consumed += data.size();
+			m_remaining -= data.size();
+			if (!m_remaining) m_state = State::DATA_END;
+			return Result::DATA;
+		}
+
+		std::size_t nl = rest.find('\n');
+		if (nl == std::string_view::npos) {
+			if (rest.size() <= MAX_LINE) return Result::INCOMPLETE;
+			m_state = State::FAILED;
+			break;
+		}
+		std::string_view line = rest.substr(0, nl);
+		if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+		consumed += nl + 1;
+
+		if (m_state == State::SIZE) {
+			// chunk-size [ chunk-ext ]
+			auto [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), m_remaining, 16);
+			if (ec != std::errc() || (ptr != line.data() + line.size() && *ptr != ';' && *ptr != ' ' && *ptr != '\t')) {
+				m_state = State::FAILED;
+				break;
+			}
+			m_state = m_remaining ? State::DATA : State::TRAILER;
+		} else if (m_state == State::DATA_END) {
+			if (!line.empty()) m_state = State::FAILED;
+			else m_state = State::SIZE;
+		} else if (line.empty()) {
+			// the empty line after the trailer fields
+			m_state = State::DONE;
+		}
+	}
+	return m_state == State::DONE ? Result::DONE : Result::ERROR;
+}
+
+std::string formatHTTPDate(time_t t) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	char buf[32];
+	std::size_t n = strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return std::string(buf, n);
+}
+
+bool parseHTTPDate(std::string_view s, time_t &t) {
+	char buf[32];
+	if (s.size() >= sizeof(buf)) return false;
+	s.copy(buf, s.size());
+	buf[s.size()] = 0;
+
+	struct tm	tm = {};
+	const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end) return false;
+	t = timegm(&tm);
+	return true;
+}
+
+bool etagMatches(std::string_view list, std::string_view etag) {
+	if (etag.starts_with("W/")) etag.remove_prefix(2);
+	while (!list.empty()) {
+		std::size_t		 comma = list.find(',');
+		std::string_view tag   = trim(list.substr(0, comma));
+		list				   = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+		if (tag == "*") return true;
+		if (tag.starts_with("W/")) tag.remove_prefix(2);
+		if (tag == etag) return true;
+	}
+	return false;
+}
+
+bool acceptsEncoding(std::string_view header, std::string_view coding) {
+	bool wildcard = false;
+	while (!header.empty()) {
+		std::size_t		 comma = header.find(',');
+		std::string_view item  = header.substr(0, comma);
+		header				   = comma == std::string_view::npos ? std::string_view() : header.substr(comma + 1);
+
+		std::size_t		 semicolon = item.find(';');
+		std::string_view name	   = trim(item.substr(0, semicolon));
+		bool			 allowed   = true;
+		if (semicolon != std::string_view::npos) {
+			std::string_view q = trim(item.substr(semicolon + 1));
+			// q=0, q=0.0, q=0.00 ... forbid the coding
+			if (q.starts_with("q=") || q.starts_with("Q=")) allowed = q.find_first_not_of("0.", 2) != std::string_view::npos;
+		}
+
+		if (iequals(name, coding)) return allowed;
+		if (name == "*") wildcard = allowed;
+	}
+	return wildcard;
+}
+
+bool hasMediaType(std::string_view contentType, std::string_view type) {
+	return iequals(trim(contentType.substr(0, contentType.find(';'))), type);
+}
+
+/**
+ * @brief The q parameter among the parameters of an Accept item, in thousandths.
+ */
+static int quality(std::string_view params) {
+	while (!params.empty()) {
+		std::size_t		 semicolon = params.find(';');
+		std::string_view param	   = trim(params.substr(0, semicolon));
+		params					   = semicolon == std::string_view::npos ? std::string_view() : params.substr(semicolon + 1);
+		if (!param.starts_with("q=") && !param.starts_with("Q=")) continue;
+
+		// 0, 0.5, 1.000 ...
+		int			q = 0, scale = 1000;
+		std::size_t i = 2;
+		if (i < param.size() && param[i] >= '0' && param[i] <= '1') q = (param[i++] - '0') * 1000;
+		if (i < param.size() && param[i] == '.') {
+			for (i++; i < param.size() && param[i] >= '0' && param[i] <= '9' && scale > 1; i++) {
+				scale /= 10;
+				q += (param[i] - '0') * scale;
+			}
+		}
+		return std::min(q, 1000);
+	}
+	return 1000;
+}
+
+int negotiateMediaType(std::string_view accept, std::span<const std::string_view> offered) {
+	if (trim(accept).empty()) return offered.empty() ? -1 : 0;
+
+	int best = -1, bestQuality = 0;
+	for (std::size_t i = 0; i < offered.size(); i++) {
+		std::string_view type = offered[i], major = type.substr(0, type.find('/'));
+
+		int				 q = 0, specificity = -1;
+		std::string_view list = accept;
+		while (!list.empty()) {
+			std::size_t		 comma = list.find(',');
+			std::string_view item  = list.substr(0, comma);
+			list				   = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+			std::size_t		 semicolon = item.find(';');
+			std::string_view range	   = trim(item.substr(0, semicolon));
+			int				 s;
+			if (iequals(range, type)) s = 2;
+			else if (range.size() == major.size() + 2 && range.ends_with("/*") && iequals(range.substr(0, major.size()), major))
+				s = 1;
+			else if (range == "*/*") s = 0;
+			else continue;
+
+			if (s > specificity) {
+				specificity = s;
+				q			= semicolon == std::string_view::npos ? 1000 : quality(item.substr(semicolon + 1));
+			}
+		}
+		if (q > bestQuality) {
+			best		= int(i);
+			bestQuality = q;
+		}
+	}
+	return best;
+}
+
+ByteRange::Result ByteRange::parse(std::string_view header, std::size_t size, ByteRange &range) {
+	if (!header.starts_with("bytes=")) return NONE;
+	header = trim(header.substr(6));
+	if (header.find(',') != std::string_view::npos) return NONE;
+
+	std::size_t dash = header.find('-');
+	if (dash == std::string_view::npos) return NONE;
+	std::string_view firstS = trim(header.substr(0, dash)), lastS = trim(header.substr(dash + 1));
+
+	auto number = [](std::string_view s, std::size_t &n) {
+		auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+		return !s.empty() && ec == std::errc() && ptr == s.data() + s.size();
+	};
+
+	std::size_t first, last;
+	if (firstS.empty()) {
+		// suffix range: the last n bytes
+		std::size_t n;
+		if (!number(lastS, n)) return NONE;
+		if (!n || !size) return UNSATISFIABLE;
+		range = {size - std::min(n, size), size - 1};
+		return SATISFIABLE;
+	}
+
+	if (!number(firstS, first)) return NONE;
+	if (lastS.empty()) last = size - 1;
+	else if (!number(lastS, last) || last < first) return NONE;
+
+	if (first >= size) return UNSATISFIABLE;
+	range = {first, std::min(last, size - 1)};
+	return SATISFIABLE;
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ctime>
+#include <span>
+#include <string>
+#include <string_view>
+
+/**
+ * @brief A parsed HTTP/1.x request head. All views point into the buffer that was given to the parser and are only
+ * valid as long as those bytes are.
+ */
+struct HTTPRequest {
+	struct Header {
+		std::string_view name, value;
+	};
+
+	static constexpr std::size_t MAX_HEADERS = 64;
+
+	std::string_view method, target, path, query, version;
+	std::array<Header, MAX_HEADERS> headers;
+	std::size_t						numHeaders	  = 0;
+	std::size_t						contentLength = 0;
+	/// the body uses the chunked transfer coding, contentLength is 0 then
+	bool chunked = false;
+	/// the client wants the connection kept open after the response: HTTP/1.1 unless it sent "Connection: close",
+	/// HTTP/1.0 only if it sent "Connection: keep-alive"
+	bool keepAlive = true;
+
+	/**
+	 * @brief Case-insensitive lookup of a header value.
+	 *
+	 * @return the value of the first header with that name or an empty view
+	 */
+	std::string_view header(std::string_view name) const;
+};
+
+/**
+ * @brief Incremental HTTP/1.x request head parser.
+ *
+ * The parser works directly on the received bytes and never copies them. It can be fed the same (possibly relocated
+ * and extended) input several times while a request is still arriving and resumes from the last complete line it saw.
+ * Only offsets are kept between calls, so the input may be moved in memory as long as the request starts at its
+ * beginning.
+ */
+class HTTPParser {
+   public:
+	enum class Result { INCOMPLETE, DONE, ERROR };
+
+	/**
+	 * @param input bytes starting at the beginning of the request. Once the head is complete, calling parse() again
+	 * with the same (possibly moved) bytes refreshes the views in request.
+	 */
+	Result parse(std::string_view input);
+	void   reset();
+
+	/// Number of bytes taken by the request head, valid after parse() returned DONE.
+	std::size_t consumed() const { return m_pos; }
+	/// HTTP status code to answer with, valid after parse() returned ERROR.
+	int errorStatus() const { return m_error; }
+
+	HTTPRequest request;
+
+   private:
+	struct Span {
+		uint32_t begin, length;
+		std::string_view view(std::string_view input) const { return input.substr(begin, length); }
+	};
+
+	Result fail(int status) {
+		m_error = status;
+		m_state = State::FAILED;
+		return Result::ERROR;
+	}
+	Result parseRequestLine(std::string_view input, std::size_t begin, std::size_t end);
+	Result parseHeader(std::string_view input, std::size_t begin, std::size_t end);
+	void   materialize(std::string_view input);
+
+	enum class State : uint8_t { REQUEST_LINE, HEADERS, DONE, FAILED };
+
+	State		m_state = State::REQUEST_LINE;
+	std::size_t m_pos	= 0;	 // start of the first line that has not been parsed yet
+	int			m_error = 0;
+	bool		m_hasContentLength = false;
+	bool		m_close = false, m_keepAlive = false;	 // tokens of the Connection header
+
+	Span								   m_method, m_target, m_version;
+	std::array<std::pair<Span, Span>, HTTPRequest::MAX_HEADERS> m_headers;
+};
+
+/**
+ * @brief Incremental decoder of the chunked transfer coding (RFC 9112 7.1). Chunk extensions and trailer fields are
+ * skipped.
+ *
+ * Like HTTPParser it works on the received bytes directly. Incomplete lines are left unconsumed until more input
+ * arrives; chunk data is handed out as soon as any of it is there.
+ */
+class ChunkedDecoder {
+   public:
+	enum class Result { INCOMPLETE, DATA, DONE, ERROR };
+
+	/**
+	 * @brief Decodes from the start of input until it produced a piece of chunk data, reached the end of the body or
+	 * needs more input.
+	 *
+	 * @param consumed receives the number of input bytes that were used
+	 * @param data receives the chunk data if DATA is returned, it points into input
+	 */
+	Result decode(std::string_view input, std::size_t &consumed, std::string_view &data);
+	void   reset();
+
+   private:
+	/// Longest chunk size or trailer line accepted.
+	static constexpr std::size_t MAX_LINE = 4096;
+
+	enum class State : uint8_t { SIZE, DATA, DATA_END, TRAILER, DONE, FAILED };
+
+	State		m_state		= State::SIZE;
+	std::size_t m_remaining = 0;	 // bytes left in the current chunk
+};
+
+/**
+ * @brief Formats a time as an HTTP-date (RFC 9110 5.6.7), e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+ */
+std::string formatHTTPDate(time_t t);
+/**
+ * @return false if s is not an IMF-fixdate
+ */
+bool parseHTTPDate(std::string_view s, time_t &t);
+
+/**
+ * @brief Whether an If-None-Match / If-Match style list contains the entity tag (weak comparison).
+ */
+bool etagMatches(std::string_view list, std::string_view etag);
+
+/**
+ * @brief Whether an Accept-Encoding header value allows the given content coding (with a non-zero quality).
+ */
+bool acceptsEncoding(std::string_view header, std::string_view coding);
+
+/**
+ * @brief Whether a Content-Type header value names the given media type, ignoring its parameters.
+ */
+bool hasMediaType(std::string_view contentType, std::string_view type);
+
+/**
+ * @brief Picks the media type the client prefers from offered by the quality values in an Accept header, the most
+ * specific matching range deciding each type's quality. Ties go to the earlier offer. An empty header accepts anything.
+ *
+ * @return the index in offered, -1 if the client accepts none of them
+ */
+int negotiateMediaType(std::string_view accept, std::span<const std::string_view> offered);
+
+/**
+ * @brief A single byte range of a representation, both ends inclusive.
+ */
+struct ByteRange {
+	enum Result { NONE, SATISFIABLE, UNSATISFIABLE };
+
+	std::size_t first = 0, last = 0;
+
+	/**
+	 * @brief Parses a Range header value for a representation of the given size. Only single ranges are supported,
+	 * anything else is reported as NONE so that the whole representation is sent.
+	 */
+	static Result parse(std::string_view header, std::size_t size, ByteRange &range);
+
+	std::size_t length() const { return last - first + 1; }
+};
@@ -0,0 +1,445 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <io_uring.hpp>
+
+static int ioUringSetup(unsigned int entries, io_uring_params &params) {
+	return int(syscall(__NR_io_uring_setup, entries, &params));
+}
+
+static int ioUringEnter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+	return int(syscall(__NR_io_uring_enter, fd, submit, wait, flags, nullptr, 0));
+}
+
+static int ioUringRegister(int fd, unsigned int opcode, void *arg, unsigned int count) {
+	return int(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+IOUring::IOUring(unsigned int entries, unsigned int numBuffers, std::size_t bufferSize) {
+	// the destructor does not run for a constructor that throws
+	auto fail = [this](const char *what) {
+		std::string message = std::string("io_uring: ") + what + ": " + strerror(errno);
+		release();
+		throw std::runtime_error(message);
+	};
+
+	io_uring_params params = {};
+	params.flags		   = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+					IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = entries * 8;
+	m_fd			  = ioUringSetup(entries, params);
+	if (m_fd < 0 && errno == EINVAL) {
+		// kernels before 6.1 lack some of the flags, which only save work
+		params		 = {};
+		params.flags = IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+		params.cq_entries = entries * 8;
+		m_fd			  = ioUringSetup(entries, params);
+	}
+	if (m_fd < 0) fail("cannot set up ring");
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+		errno = ENOSYS;
+		fail("kernel too old");
+	}
+
+	m_ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+						  params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	m_ring	   = mmap(nullptr, m_ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+	if (m_ring == MAP_FAILED) {
+		m_ring = nullptr;
+		fail("cannot map rings");
+	}
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqes = mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) fail("cannot map submission queue entries");
+	m_sqes = static_cast<io_uring_sqe *>(sqes);
+
+	char *ring	= static_cast<char *>(m_ring);
+	m_sqHead	= reinterpret_cast<unsigned int *>(ring + params.sq_off.head);
+	m_sqTail	= reinterpret_cast<unsigned int *>(ring + params.sq_off.tail);
+	m_sqArray	= reinterpret_cast<unsigned int *>(ring + params.sq_off.array);
+	m_sqMask	= *reinterpret_cast<unsigned int *>(ring + params.sq_off.ring_mask);
+	m_sqEntries = params.sq_entries;
+	m_cqHead	= reinterpret_cast<unsigned int *>(ring + params.cq_off.head);
+	m_cqTail	= reinterpret_cast<unsigned int *>(ring + params.cq_off.tail);
+	m_cqMask	= *reinterpret_cast<unsigned int *>(ring + params.cq_off.ring_mask);
+	m_cqes		= reinterpret_cast<io_uring_cqe *>(ring + params.cq_off.cqes);
+	// entries are always used in order, so the indirection array is the identity
+	for (unsigned int i = 0; i < m_sqEntries; i++) {
+		m_sqArray[i] = i;
+	}
+	m_sqeTail = m_submitted = *m_sqTail;
+
+	m_numBuffers  = numBuffers;
+	m_bufferSize  = bufferSize;
+	m_bufRingSize = numBuffers * sizeof(io_uring_buf);
+	void *bufRing = mmap(nullptr, m_bufRingSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (bufRing == MAP_FAILED) fail("cannot map buffer ring");
+	m_bufRing = static_cast<io_uring_buf_ring *>(bufRing);
+
+	io_uring_buf_reg reg = {};
+	reg.ring_addr		 = reinterpret_cast<uint64_t>(m_bufRing);
+	reg.ring_entries	 = numBuffers;
+	reg.bgid			 = BUFFER_GROUP;
+	// kernels before 5.19 only take buffers with IORING_OP_PROVIDE_BUFFERS
+	m_useRing = ioUringRegister(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+	if (!m_useRing && errno != EINVAL) fail("cannot register buffer ring");
+
+	m_buffers = std::make_unique<char[]>(std::size_t(numBuffers) * bufferSize);
+	if (m_useRing) {
+		for (unsigned int i = 0; i < numBuffers; i++) {
+			recycle(uint16_t(i));
+		}
+	}
+}
+
+IOUring::~IOUring() { release(); }
+
+void IOUring::release() {
+	if (m_bufRing) munmap(m_bufRing, m_bufRingSize);
+	if (m_sqes) munmap(m_sqes, m_sqesSize);
+	if (m_ring) munmap(m_ring, m_ringSize);
+	if (m_fd >= 0) ::close(m_fd);
+	m_bufRing = nullptr;
+	m_sqes	  = nullptr;
+	m_ring	  = nullptr;
+	m_fd	  = -1;
+}
+
+bool IOUring::enable() {
+	if (ioUringRegister(m_fd, IORING_REGISTER_ENABLE_RINGS, nullptr, 0) < 0) return false;
+	if (m_useRing && !probeRing()) {
+		io_uring_buf_reg reg = {};
+		reg.bgid			 = BUFFER_GROUP;
+		if (ioUringRegister(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0) return false;
+		m_useRing = false;
+	}
+	if (!m_useRing) {
+		io_uring_sqe *sqe = this->sqe();
+		sqe->opcode		  = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd			  = int(m_numBuffers);
+		sqe->addr		  = reinterpret_cast<uint64_t>(m_buffers.get());
+		sqe->len		  = uint32_t(m_bufferSize);
+		sqe->buf_group	  = BUFFER_GROUP;
+		sqe->flags		  = IOSQE_CQE_SKIP_SUCCESS;
+	}
+	return true;
+}
+
+bool IOUring::probeRing() {
+	// some kernels accept the registration of a buffer ring but never take a buffer from it
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) return false;
+	int received = -ENOBUFS;
+	if (::write(pair[1], "", 1) == 1) {
+		io_uring_sqe *sqe = this->sqe();
+		sqe->opcode		  = IORING_OP_RECV;
+		sqe->fd			  = pair[0];
+		sqe->flags		  = IOSQE_BUFFER_SELECT;
+		sqe->buf_group	  = BUFFER_GROUP;
+		sqe->user_data	  = PROBE;
+		if (submit(1)) {
+			unsigned int head = *m_cqHead;
+			const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+			received = cqe.res;
+			if (received > 0) recycle(uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+			std::atomic_ref<unsigned int>(*m_cqHead).store(head + 1, std::memory_order_release);
+		}
+	}
+	::close(pair[0]);
+	::close(pair[1]);
+	return received > 0;
+}
+
+io_uring_sqe *IOUring::sqe() {
+	while (m_sqeTail - std::atomic_ref<unsigned int>(*m_sqHead).load(std::memory_order_acquire) >= m_sqEntries) {
+		if (!submit() && errno != EAGAIN && errno != EBUSY && errno != EINTR) break;
+	}
+	io_uring_sqe *entry = &m_sqes[m_sqeTail & m_sqMask];
+	std::memset(entry, 0, sizeof(*entry));
+	// published right away, the kernel only looks at entries it is told about by io_uring_enter
+	std::atomic_ref<unsigned int>(*m_sqTail).store(++m_sqeTail, std::memory_order_release);
+	return entry;
+}
+
+bool IOUring::submit(unsigned int wait) {
+	unsigned int toSubmit = m_sqeTail - m_submitted;
+	if (!toSubmit && !wait) return true;
+	int res = ioUringEnter(m_fd, toSubmit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+	if (res < 0) return false;
+	m_submitted += res;
+	return true;
+}
+
+void IOUring::recycle(uint16_t id) {
+	if (!m_useRing) {
+		io_uring_sqe *sqe = this->sqe();
+		sqe->opcode		  = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd			  = 1;
+		sqe->addr		  = reinterpret_cast<uint64_t>(m_buffers.get() + std::size_t(id) * m_bufferSize);
+		sqe->len		  = uint32_t(m_bufferSize);
+		sqe->off		  = id;
+		sqe->buf_group	  = BUFFER_GROUP;
+		sqe->flags		  = IOSQE_CQE_SKIP_SUCCESS;
+		return;
+	}
+	io_uring_buf &buf = m_bufRing->bufs[m_bufTail & (m_numBuffers - 1)];
+	buf.addr		  = reinterpret_cast<uint64_t>(m_buffers.get() + std::size_t(id) * m_bufferSize);
+	buf.len			  = uint32_t(m_bufferSize);
+	buf.bid			  = id;
+	std::atomic_ref<uint16_t>(m_bufRing->tail).store(++m_bufTail, std::memory_order_release);
+}
+
+UringSocket::~UringSocket() {
+	BufferPool::release(std::move(m_input));
+	BufferPool::release(std::move(m_copy));
+	for (int fd : {m_pipe[0], m_pipe[1], m_file}) {
+		if (fd >= 0) ::close(fd);
+	}
+	if (m_closing) ::close(m_fd);
+}
+
+void UringSocket::arm() {
+	if (m_receiving || m_paused || m_eof || m_error || m_closing) return;
+	io_uring_sqe *sqe = m_ring.sqe();
+	sqe->opcode		  = IORING_OP_RECV;
+	sqe->fd			  = m_fd;
+	sqe->ioprio		  = IORING_RECV_MULTISHOT;
+	sqe->flags		  = IOSQE_BUFFER_SELECT;
+	sqe->buf_group	  = IOUring::BUFFER_GROUP;
+	sqe->user_data	  = userData(RECV);
+	m_receiving		  = true;
+	m_pending++;
+}
+
+void UringSocket::stage(std::string_view data) {
+	std::size_t staged = m_input.size() - m_head;
+	if (!staged) {
+		m_input.clear();
+		m_head = 0;
+	}
+	if (!m_input.capacity()) m_input = BufferPool::acquire(std::max(data.size(), SocketBuffer::DEFAULT_SIZE));
+	else if (m_input.size() + data.size() > m_input.capacity() && m_head) {
+		// make room by moving what is left to the front before growing
+		std::memmove(m_input.data(), m_input.data() + m_head, staged);
+		m_input.resize(staged);
+		m_head = 0;
+	}
+	m_input.append(data);
+}
+
+ssize_t UringSocket::receive(char *dst, std::size_t n) {
+	std::size_t staged = m_input.size() - m_head;
+	if (staged) {
+		std::size_t taken = std::min(n, staged);
+		std::memcpy(dst, m_input.data() + m_head, taken);
+		m_head += taken;
+		if (m_head == m_input.size()) {
+			BufferPool::release(std::move(m_input));
+			m_input = ByteBuffer();
+			m_head	= 0;
+		}
+		if (m_paused && m_input.size() - m_head < STAGE_LIMIT / 2) {
+			m_paused = false;
+			arm();
+		}
+		return ssize_t(taken);
+	}
+	if (m_error) {
+		errno = m_error;
+		return -1;
+	}
+	if (m_eof) return 0;
+	errno = EAGAIN;
+	return -1;
+}
+
+int UringSocket::send(OutputQueue &output) {
+	// whatever the connection still writes while it is being destroyed has nowhere to go
+	if (m_closing) return 0;
+	m_output = &output;
+	if (m_sending) return 1;
+
+	OutputQueue::Chunk chunk;
+	if (!m_inPipe) {
+		if (!output.next(chunk)) return -1;
+		if (output.empty()) return 0;
+	}
+	if (m_error) {
+		errno = m_error;
+		return -1;
+	}
+	if (m_inPipe) spliceOut(m_inPipe);
+	else if (!(chunk.fd >= 0 ? spliceFile(chunk) : sendMemory(chunk))) return -1;
+	m_sending = true;
+	return 1;
+}
+
+bool UringSocket::sendMemory(const OutputQueue::Chunk &chunk) {
+	// the pieces that have to be copied, up to COPY_LIMIT, go into a single buffer taken in one go
+	std::size_t count = 0, copied = 0;
+	for (; count < chunk.count; count++) {
+		if (*chunk.owners[count]) continue;
+		if (copied == COPY_LIMIT) break;
+		copied += std::min(chunk.iov[count].iov_len, COPY_LIMIT - copied);
+	}
+	if (copied) m_copy = BufferPool::acquire(copied);
+
+	for (std::size_t i = 0; i < count; i++) {
+		if (*chunk.owners[i]) {
+			m_pinned.push_back(*chunk.owners[i]);
+			m_iov[i] = chunk.iov[i];
+			continue;
+		}
+		std::size_t length = std::min(chunk.iov[i].iov_len, m_copy.capacity() - m_copy.size());
+		char	   *dst	   = m_copy.data() + m_copy.size();
+		m_copy.append(std::string_view(static_cast<const char *>(chunk.iov[i].iov_base), length));
+		m_iov[i] = {dst, length};
+		// a piece cut short ends the message
+		if (length < chunk.iov[i].iov_len) count = i + 1;
+	}
+
+	m_msg			  = {};
+	m_msg.msg_iov	  = m_iov;
+	m_msg.msg_iovlen  = count;
+	io_uring_sqe *sqe = m_ring.sqe();
+	sqe->opcode		  = IORING_OP_SENDMSG;
+	sqe->fd			  = m_fd;
+	sqe->addr		  = reinterpret_cast<uint64_t>(&m_msg);
+	sqe->msg_flags	  = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data	  = userData(SEND);
+	m_pending++;
+	return true;
+}
+
+bool UringSocket::spliceFile(const OutputQueue::Chunk &chunk) {
+	if (m_pipe[0] < 0) {
+		if (pipe2(m_pipe, O_CLOEXEC) < 0) return false;
+		fcntl(m_pipe[1], F_SETPIPE_SZ, int(PIPE_SIZE));
+	}
+	int fd = chunk.fd;
+	if (*chunk.owners[0]) m_pinned.push_back(*chunk.owners[0]);
+	else {
+		// the queue closes its descriptor as soon as the range has been sent, possibly before the splice has opened it
+		m_file = fcntl(chunk.fd, F_DUPFD_CLOEXEC, 0);
+		if (m_file < 0) return false;
+		fd = m_file;
+	}
+	int pipeSize = fcntl(m_pipe[1], F_GETPIPE_SZ);
+	if (pipeSize <= 0) return false;
+	std::size_t n = std::min<std::size_t>(chunk.length, pipeSize);
+
+	io_uring_sqe *sqe	= m_ring.sqe();
+	sqe->opcode			= IORING_OP_SPLICE;
+	sqe->fd				= m_pipe[1];
+	sqe->off			= uint64_t(-1);
+	sqe->splice_fd_in	= fd;
+	sqe->splice_off_in	= uint64_t(chunk.offset);
+	sqe->len			= uint32_t(n);
+	sqe->flags			= IOSQE_IO_LINK;
+	sqe->user_data		= userData(SPLICE_IN);
+	m_pending++;
+	spliceOut(n);
+	return true;
+}
+
+void UringSocket::spliceOut(std::size_t n) {
+	// the socket is non-blocking, so the splice only goes ahead once it is writable
+	io_uring_sqe *sqe  = m_ring.sqe();
+	sqe->opcode		   = IORING_OP_POLL_ADD;
+	sqe->fd			   = m_fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->flags		   = IOSQE_IO_LINK;
+	sqe->user_data	   = userData(POLL);
+
+	sqe				   = m_ring.sqe();
+	sqe->opcode		   = IORING_OP_SPLICE;
+	sqe->fd			   = m_fd;
+	sqe->off		   = uint64_t(-1);
+	sqe->splice_fd_in  = m_pipe[0];
+	sqe->splice_off_in = uint64_t(-1);
+	sqe->len		   = uint32_t(n);
+	sqe->user_data	   = userData(SPLICE_OUT);
+	m_pending += 2;
+	m_sending = true;
+}
+
+void UringSocket::sent() {
+	m_sending = false;
+	m_pinned.clear();
+	BufferPool::release(std::move(m_copy));
+	m_copy = ByteBuffer();
+	if (m_file >= 0) ::close(m_file);
+	m_file = -1;
+}
+
+bool UringSocket::complete(const io_uring_cqe &cqe) {
+	int res = cqe.res;
+	switch (Op(cqe.user_data & TAGS)) {
+		case RECV: {
+			if (!(cqe.flags & IORING_CQE_F_MORE)) {
+				m_receiving = false;
+				m_pending--;
+			}
+			if (res > 0) {
+				uint16_t id = uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+				if (!m_closing) stage(m_ring.buffer(id, res));
+				m_ring.recycle(id);
+				if (m_receiving && !m_paused && m_input.size() - m_head >= STAGE_LIMIT) {
+					io_uring_sqe *sqe = m_ring.sqe();
+					sqe->opcode		  = IORING_OP_ASYNC_CANCEL;
+					sqe->addr		  = userData(RECV);
+					sqe->user_data	  = userData(CANCEL);
+					m_paused		  = true;
+					m_pending++;
+				}
+			} else if (res == 0) m_eof = true;
+			// out of provided buffers or paused, nothing is lost
+			else if (res != -ENOBUFS && res != -ECANCELED) m_error = -res;
+			arm();
+			return !m_closing && res != -ENOBUFS && res != -ECANCELED;
+		}
+		case CANCEL: m_pending--; return false;
+		case SEND:
+			m_pending--;
+			sent();
+			if (m_closing) return false;
+			if (res < 0) m_error = -res;
+			else m_output->advance(res);
+			return true;
+		case SPLICE_IN:
+			m_pending--;
+			if (m_closing) return false;
+			if (res > 0) m_inPipe += res;
+			// the file got shorter since the response headers were written
+			else if (res == 0) m_error = EPIPE;
+			else if (res != -ECANCELED) m_error = -res;
+			if (m_file >= 0) ::close(m_file);
+			m_file = -1;
+			return false;
+		case POLL: m_pending--; return false;
+		case SPLICE_OUT:
+			m_pending--;
+			sent();
+			if (m_closing) return false;
+			if (res > 0) {
+				m_inPipe -= res;
+				m_output->advance(res);
+			} else if (res < 0 && res != -ECANCELED && res != -EAGAIN) m_error = -res;
+			return true;
+	}
+	return false;
+}
+
+void UringSocket::close(int fd) {
+	m_closing = true;
+	m_fd	  = fd;
+	if (m_pending) shutdown(fd, SHUT_RDWR);
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include <buffer_pool.hpp>
+#include <output_queue.hpp>
+#include <socket.hpp>
+
+/**
+ * @brief An io_uring instance driven through the raw system calls, with provided buffers that multishot receives pick
+ * their buffers from: a buffer ring shared with the kernel, or buffers handed over by IORING_OP_PROVIDE_BUFFERS where
+ * the ring is not available. Submissions are queued in the shared ring and only handed to the kernel by
+ * submit(), so a worker submits everything a batch of completions caused with a single system call. Only the thread
+ * that called enable() may use it.
+ */
+class IOUring {
+   public:
+	/// Buffer group of the provided buffers, for IOSQE_BUFFER_SELECT.
+	static constexpr uint16_t BUFFER_GROUP = 0;
+	/// user_data reserved for the ring's own operations, whose completions complete() skips.
+	static constexpr uint64_t INTERNAL = 0;
+
+	/**
+	 * @param entries size of the submission queue, the completion queue is eight times as large
+	 * @param numBuffers number of provided buffers, a power of two
+	 * @param bufferSize size of each provided buffer
+	 * @throws std::runtime_error if io_uring or one of the features it is used with is not available
+	 */
+	IOUring(unsigned int entries, unsigned int numBuffers, std::size_t bufferSize);
+	~IOUring();
+	IOUring(const IOUring &)			= delete;
+	IOUring &operator=(const IOUring &) = delete;
+
+	/**
+	 * @brief Enables the ring, which is created disabled so that the calling thread becomes its only submitter, and
+	 * hands the buffers to the kernel.
+	 * @return false on error, errno is set
+	 */
+	bool enable();
+
+	/**
+	 * @brief A cleared submission queue entry to fill in. It is queued right away and handed to the kernel with the
+	 * next submit(), earlier if the submission queue is full.
+	 */
+	io_uring_sqe *sqe();
+
+	/**
+	 * @brief Hands the queued entries to the kernel and waits until at least wait completions are available.
+	 * @return false on error, errno is set
+	 */
+	bool submit(unsigned int wait = 0);
+
+	/**
+	 * @brief Calls fn with every completion available.
+	 * @return the number of completions
+	 */
+	template <class F>
+	unsigned int complete(F &&fn) {
+		unsigned int head = *m_cqHead;
+		unsigned int tail = std::atomic_ref<unsigned int>(*m_cqTail).load(std::memory_order_acquire);
+		for (unsigned int i = head; i != tail; i++) {
+			const io_uring_cqe &cqe = m_cqes[i & m_cqMask];
+			if (cqe.user_data != INTERNAL) fn(cqe);
+		}
+		// the kernel may reuse the entries from here on
+		std::atomic_ref<unsigned int>(*m_cqHead).store(tail, std::memory_order_release);
+		return tail - head;
+	}
+
+	/// The data a completion with IORING_CQE_F_BUFFER received into the provided buffer id.
+	std::string_view buffer(uint16_t id, std::size_t length) const {
+		return std::string_view(m_buffers.get() + std::size_t(id) * m_bufferSize, length);
+	}
+	/// Gives a provided buffer back to the kernel once its data has been taken.
+	void recycle(uint16_t id);
+
+   private:
+	static constexpr uint64_t PROBE = 1;
+
+	void release();
+	bool probeRing();
+
+	int m_fd = -1;
+
+	void		 *m_ring	 = nullptr;	   // the submission and completion queue rings, mapped together
+	std::size_t	  m_ringSize = 0;
+	io_uring_sqe *m_sqes	 = nullptr;
+	std::size_t	  m_sqesSize = 0;
+
+	unsigned int *m_sqHead = nullptr, *m_sqTail = nullptr, *m_sqArray = nullptr;
+	unsigned int  m_sqMask = 0, m_sqEntries = 0;
+	unsigned int  m_sqeTail	  = 0;	  // entries handed out by sqe()
+	unsigned int  m_submitted = 0;	  // entries the kernel has consumed
+
+	unsigned int	*m_cqHead = nullptr, *m_cqTail = nullptr;
+	unsigned int	 m_cqMask = 0;
+	io_uring_cqe	*m_cqes	  = nullptr;
+
+	bool					m_useRing	  = false;	  // the buffers are in m_bufRing, not provided one by one
+	io_uring_buf_ring	   *m_bufRing	  = nullptr;
+	std::size_t				m_bufRingSize = 0;
+	unsigned int			m_numBuffers  = 0;
+	uint16_t				m_bufTail	  = 0;
+	std::size_t				m_bufferSize  = 0;
+	std::unique_ptr<char[]> m_buffers;
+};
+
+/**
+ * @brief The reads and writes of a socket performed by io_uring operations and finished by the completions the worker
+ * passes to complete().
+ *
+ * Data arrives through a multishot receive into the provided buffers of the ring and is copied into a staging buffer
+ * from the BufferPool right away, so the ring never runs short while a connection is not reading. The receive is
+ * cancelled while the staged data exceeds STAGE_LIMIT and armed again once it has been read.
+ *
+ * A single send is in flight at a time: the memory at the front of the output queue is sent with one SENDMSG, segments
+ * kept alive by their owner without copying them, a range of a file is spliced into a pipe and from there into the
+ * socket by linked operations. What has been sent is removed from the queue when the completion arrives.
+ *
+ * The descriptor and the object stay alive until the last operation has completed after close(), so that a linked
+ * operation can never pick up a descriptor that has been reused meanwhile.
+ */
+class UringSocket : public SocketIO {
+   public:
+	/// Staged input above which the connection stops receiving.
+	static constexpr std::size_t STAGE_LIMIT = 256 * 1024;
+
+	UringSocket(IOUring &ring, int fd) : m_ring(ring), m_fd(fd) {}
+	~UringSocket() override;
+	UringSocket(const UringSocket &)			= delete;
+	UringSocket &operator=(const UringSocket &) = delete;
+
+	/// The socket whose operation a completion belongs to.
+	static UringSocket *owner(uint64_t userData) { return reinterpret_cast<UringSocket *>(userData & ~uint64_t(TAGS)); }
+	/// Whether userData belongs to an operation of a socket rather than one of the worker's own.
+	static bool owns(uint64_t userData) { return userData > TAGS; }
+
+	/// Starts receiving.
+	void start() { arm(); }
+
+	ssize_t receive(char *dst, std::size_t n) override;
+	int		send(OutputQueue &output) override;
+	bool	sending() const override { return m_sending; }
+
+	/**
+	 * @brief Finishes an operation.
+	 * @return whether the connection may be able to make progress now
+	 */
+	bool complete(const io_uring_cqe &cqe);
+
+	/**
+	 * @brief Takes over the descriptor of the closed connection, shuts it down so that pending operations finish soon
+	 * and closes it once the last one has.
+	 */
+	void close(int fd);
+	/// Whether the socket has been closed and nothing refers to it any more, it may be deleted.
+	bool finished() const { return m_closing && !m_pending; }
+
+   private:
+	enum Op : unsigned int { RECV = 1, CANCEL, SEND, SPLICE_IN, POLL, SPLICE_OUT };
+	static constexpr uint64_t	 TAGS		= 7;
+	static constexpr std::size_t PIPE_SIZE	= 1024 * 1024;
+	static constexpr std::size_t COPY_LIMIT = 256 * 1024;
+
+	uint64_t userData(Op op) const { return reinterpret_cast<uint64_t>(this) | op; }
+	void	 arm();
+	void	 stage(std::string_view data);
+	bool	 sendMemory(const OutputQueue::Chunk &chunk);
+	bool	 spliceFile(const OutputQueue::Chunk &chunk);
+	void	 spliceOut(std::size_t n);
+	void	 sent();
+
+	IOUring &m_ring;
+	int		 m_fd;
+	bool	 m_closing = false;
+	int		 m_error   = 0;
+	/// operations whose last completion has not arrived
+	unsigned int m_pending = 0;
+
+	ByteBuffer	m_input;	// staged input, consumed from m_head
+	std::size_t m_head		= 0;
+	bool		m_receiving = false;
+	bool		m_paused	= false;	// cancelled because of STAGE_LIMIT
+	bool		m_eof		= false;
+
+	OutputQueue *m_output  = nullptr;	 // the queue being sent
+	bool		 m_sending = false;
+	msghdr		 m_msg	   = {};
+	iovec		 m_iov[OutputQueue::IOV_COUNT];
+	ByteBuffer	 m_copy;	// the pieces of the message not kept alive by an owner
+	std::vector<std::shared_ptr<const void>> m_pinned;
+
+	int			m_pipe[2] = {-1, -1};
+	std::size_t m_inPipe  = 0;	   // spliced from the file but not into the socket yet
+	int			m_file	  = -1;	   // a duplicate of a file descriptor the queue owns, closed once it is sent
+};
@@ -0,0 +1,206 @@
+#include <logger.hpp>
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+namespace dbg {
+
+// how long the flusher sleeps when it found nothing to write, records wait at most this long
+static constexpr std::chrono::milliseconds FLUSH_INTERVAL(10);
+
+static void writeAll(int fd, std::string_view data) {
+	while (!data.empty()) {
+		ssize_t n = ::write(fd, data.data(), data.size());
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		data.remove_prefix(n);
+	}
+}
+
+Logger &Logger::instance() {
+	// never destroyed, threads may still log while static objects are destroyed at exit
+	static Logger *logger = [] {
+		Logger *l = new Logger();
+		std::atexit([] {
+			Logger &l = instance();
+			l.flush();
+			l.m_synchronous.store(true);
+			// whatever was logged while the flag was being set
+			l.flush();
+		});
+		return l;
+	}();
+	return *logger;
+}
+
+Logger::Logger() { m_thread = std::thread(&Logger::run, this); }
+
+Logger::LocalRing::~LocalRing() {
+	t_exited = true;
+	if (ring) ring->closed.store(true, std::memory_order_release);
+}
+
+void Logger::attach() {
+	t_ring.ring = new Ring(m_ringSize.load());
+	std::lock_guard lock(m_mutex);
+	m_rings.push_back(t_ring.ring);
+}
+
+bool Logger::full(Ring &ring, bool mayBlock) {
+	if (!mayBlock || overflow() == Overflow::DROP) {
+		ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return false;
+	}
+	m_wake.notify_one();
+	std::this_thread::sleep_for(std::chrono::microseconds(50));
+	return true;
+}
+
+bool Logger::writeNow(int fd, const Arg *args, std::size_t count) {
+	std::string out;
+	for (std::size_t i = 0; i < count; i++) {
+		args[i].format(out, static_cast<const char *>(args[i].bytes()), args[i].size);
+	}
+	writeAll(fd, out);
+	return true;
+}
+
+void Logger::flush() {
+	std::unique_lock lock(m_mutex);
+	uint64_t		 target = ++m_requested;
+	m_wake.notify_one();
+	m_done.wait(lock, [&] { return m_completed >= target; });
+}
+
+uint64_t Logger::dropped() const {
+	std::lock_guard lock(m_mutex);
+	uint64_t		total = m_droppedClosed;
+	for (const Ring *ring : m_rings) total += ring->dropped.load(std::memory_order_relaxed);
+	return total;
+}
+
+void Logger::formatJson(std::string &out, const char *data, std::size_t size) {
+	static constexpr char HEX[] = "0123456789abcdef";
+	for (std::size_t i = 0; i < size; i++) {
+		unsigned char c = data[i];
+		switch (c) {
+			case '"': out += "\\\""; break;
+			case '\\': out += "\\\\"; break;
+			case '\n': out += "\\n"; break;
+			case '\r': out += "\\r"; break;
+			case '\t': out += "\\t"; break;
+			default:
+				if (c < 0x20) {
+					out += "\\u00";
+					out += HEX[c >> 4];
+					out += HEX[c & 15];
+				} else {
+					out += char(c);
+				}
+		}
+	}
+}
+
+void Logger::formatTime(std::string &out, const char *data, std::size_t) {
+	std::chrono::system_clock::time_point time;
+	std::memcpy(&time, data, sizeof(time));
+	auto   us	   = std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+	time_t seconds = us / 1000000;
+	tm	   utc;
+	gmtime_r(&seconds, &utc);
+	char buffer[40];
+	std::size_t n = strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+	snprintf(buffer + n, sizeof(buffer) - n, ".%06lldZ", (long long)(us % 1000000));
+	out += buffer;
+}
+
+void Logger::run() {
+	struct Entry {
+		int64_t		time;
+		const char *record;
+	};
+	std::vector<Entry>							entries;
+	std::vector<std::pair<int, std::string>>	outputs;
+	std::vector<Ring *>							rings;
+	std::vector<uint64_t>						tails;
+	std::vector<char>							closed;
+	uint64_t									reportedDrops = 0;
+
+	for (;;) {
+		uint64_t requested;
+		{
+			std::lock_guard lock(m_mutex);
+			requested = m_requested;
+			rings	  = m_rings;
+		}
+
+		// takes the records of every ring up to where its owner has got by now
+		entries.clear();
+		tails.resize(rings.size());
+		closed.resize(rings.size());
+		for (std::size_t r = 0; r < rings.size(); r++) {
+			Ring &ring = *rings[r];
+			closed[r]  = ring.closed.load(std::memory_order_acquire);
+			uint64_t pos = ring.head.load(std::memory_order_relaxed);
+			tails[r]	 = ring.tail.load(std::memory_order_acquire);
+			while (pos < tails[r]) {
+				std::size_t offset = pos & (ring.capacity - 1);
+				if (ring.capacity - offset < HEADER) {
+					pos += ring.capacity - offset;
+					continue;
+				}
+				Header header;
+				std::memcpy(&header, ring.data.get() + offset, HEADER);
+				if (header.fd != SKIP) entries.push_back({header.time, ring.data.get() + offset});
+				pos += header.size;
+			}
+		}
+
+		// the records of one thread are in order already, those of different threads are interleaved by their time
+		std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.time < b.time; });
+		for (auto &[fd, text] : outputs) text.clear();
+		for (const Entry &entry : entries) {
+			Header header;
+			std::memcpy(&header, entry.record, HEADER);
+			auto it = std::find_if(outputs.begin(), outputs.end(), [&](const auto &o) { return o.first == header.fd; });
+			if (it == outputs.end()) it = outputs.insert(outputs.end(), {header.fd, std::string()});
+
+			const char *p = entry.record + HEADER, *end = entry.record + header.size;
+			while (end - p >= std::ptrdiff_t(ARG_HEADER)) {
+				Format	 format;
+				uint32_t length;
+				std::memcpy(&format, p, sizeof(Format));
+				std::memcpy(&length, p + sizeof(Format), sizeof(length));
+				format(it->second, p + ARG_HEADER, length);
+				p += ARG_HEADER + length;
+			}
+		}
+		for (const auto &[fd, text] : outputs) writeAll(fd, text);
+
+		// the owners may reuse the space from here on
+		for (std::size_t r = 0; r < rings.size(); r++) rings[r]->head.store(tails[r], std::memory_order_release);
+
+		uint64_t drops = dropped();
+		if (drops > reportedDrops) {
+			writeAll(2, "[log] " + std::to_string(drops - reportedDrops) + " records dropped, the ring buffer was full\n");
+			reportedDrops = drops;
+		}
+
+		std::unique_lock lock(m_mutex);
+		for (std::size_t r = 0; r < rings.size(); r++) {
+			// a closed ring has been drained above, its owner logged nothing after closing it
+			if (!closed[r]) continue;
+			m_droppedClosed += rings[r]->dropped.load(std::memory_order_relaxed);
+			m_rings.erase(std::find(m_rings.begin(), m_rings.end(), rings[r]));
+			delete rings[r];
+		}
+		m_completed = requested;
+		m_done.notify_all();
+		if (entries.empty() && m_requested == requested) m_wake.wait_for(lock, FLUSH_INTERVAL);
+	}
+}
+
+}	 // namespace dbg
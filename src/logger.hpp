@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace dbg {
+
+/**
+ * @brief An asynchronous logger whose callers never take a lock or format anything.
+ *
+ * Every thread appends its records to a ring buffer of its own, which only it writes and only the flusher thread reads.
+ * A record holds the arguments as they are: numbers and trivially copyable types as their bytes, strings copied, each
+ * together with the function that formats it. The flusher formats the records of all threads in the order they were
+ * logged and writes them with a single write() per descriptor and pass, so logging costs a clock read and a few copies.
+ *
+ * When the ring of a thread is full, its records are dropped and counted, or the thread waits for the flusher,
+ * depending on setOverflow(). Whatever has been logged is written at exit.
+ */
+class Logger {
+   public:
+	/// What a thread does when its ring buffer is full.
+	enum class Overflow {
+		DROP,	 ///< the record is dropped and counted, see dropped()
+		BLOCK	 ///< the thread waits until the flusher has made room
+	};
+
+	/// A string written escaped for use inside a JSON string.
+	struct Json {
+		std::string_view text;
+	};
+	/// A point in time, written as an ISO 8601 date and time in UTC with microseconds.
+	struct Time {
+		std::chrono::system_clock::time_point time;
+	};
+
+	static Logger &instance();
+
+	void	 setOverflow(Overflow overflow) { m_overflow.store(overflow, std::memory_order_relaxed); }
+	Overflow overflow() const { return m_overflow.load(std::memory_order_relaxed); }
+	/**
+	 * @brief Sets the size of the ring buffers of the threads that log for the first time from now on.
+	 * @param bytes rounded up to a power of two
+	 */
+	void setRingSize(std::size_t bytes) { m_ringSize.store(std::bit_ceil(std::max<std::size_t>(bytes, 4096))); }
+
+	/**
+	 * @brief Appends a record to be written to fd, made of the arguments formatted like operator<< would.
+	 * @return false if the record has been dropped
+	 */
+	template <class... Args>
+	bool log(int fd, const Args &...args) {
+		Arg encoded[] = {encode(args)...};
+		if (t_exited || m_synchronous.load(std::memory_order_relaxed)) [[unlikely]] {
+			return writeNow(fd, encoded, sizeof...(Args));
+		}
+
+		std::size_t size = HEADER;
+		for (const Arg &arg : encoded) size += ARG_HEADER + arg.size;
+		size = (size + 7) & ~std::size_t(7);
+
+		Ring &ring = local();
+		char *p	   = reserve(ring, size);
+		if (!p) return false;
+
+		Header header{uint32_t(size), fd, std::chrono::steady_clock::now().time_since_epoch().count()};
+		std::memcpy(p, &header, HEADER);
+		p += HEADER;
+		for (const Arg &arg : encoded) {
+			uint32_t length = arg.size;
+			std::memcpy(p, &arg.format, sizeof(Format));
+			std::memcpy(p + sizeof(Format), &length, sizeof(length));
+			std::memcpy(p + ARG_HEADER, arg.bytes(), arg.size);
+			p += ARG_HEADER + arg.size;
+		}
+		ring.tail.store(ring.tail.load(std::memory_order_relaxed) + size, std::memory_order_release);
+		return true;
+	}
+
+	/// Waits until everything logged before has been written.
+	void flush();
+	/// Records dropped so far because a ring buffer was full.
+	uint64_t dropped() const;
+
+   private:
+	/// formats the bytes of an argument, appending them to out
+	using Format = void (*)(std::string &out, const char *data, std::size_t size);
+
+	struct Arg {
+		Format		format;
+		const void *data;
+		std::size_t size;
+		std::string text;	 // an argument that could only be formatted right away, data is null then
+
+		const void *bytes() const { return data ? data : text.data(); }
+	};
+
+	struct Header {
+		uint32_t size;	  // including the header and the padding to 8 bytes
+		int32_t	 fd;	  // SKIP for the unused end of the ring
+		int64_t	 time;	  // steady clock, to put the records of all threads in order
+	};
+	static constexpr std::size_t HEADER		= sizeof(Header);
+	static constexpr std::size_t ARG_HEADER = sizeof(Format) + sizeof(uint32_t);
+	static constexpr int32_t	 SKIP		= -1;
+
+	/**
+	 * @brief The records of one thread, a single-producer single-consumer ring of bytes. A record never wraps around,
+	 * the producer skips the end of the ring instead.
+	 */
+	struct Ring {
+		explicit Ring(std::size_t capacity) : data(std::make_unique<char[]>(capacity)), capacity(capacity) {}
+
+		alignas(64) std::atomic_uint64_t head = 0;	  // written by the flusher
+		alignas(64) std::atomic_uint64_t tail = 0;	  // written by the owning thread
+		uint64_t				cachedHead	  = 0;	  // the owner's last look at head
+		std::atomic_uint64_t	dropped		  = 0;
+		std::atomic_bool		closed		  = false;	  // the thread has exited, the ring goes once it is drained
+		std::unique_ptr<char[]> data;
+		std::size_t				capacity;
+	};
+
+	/// Marks the ring of a thread closed when the thread exits.
+	struct LocalRing {
+		Ring *ring = nullptr;
+		~LocalRing();
+	};
+
+	Logger();
+
+	template <class T>
+	static Arg encode(const T &value) {
+		using U = std::decay_t<T>;
+		if constexpr (std::is_same_v<std::remove_cv_t<T>, const char *> || std::is_same_v<std::remove_cv_t<T>, char *>) {
+			std::string_view text = value ? std::string_view(value) : std::string_view("(null)");
+			return {formatText, text.data(), text.size(), {}};
+		} else if constexpr (std::is_convertible_v<const T &, std::string_view>) {
+			std::string_view text = value;
+			return {formatText, text.data(), text.size(), {}};
+		} else if constexpr (std::is_same_v<U, char> || std::is_same_v<U, signed char> ||
+							 std::is_same_v<U, unsigned char>) {
+			return {formatText, &value, 1, {}};
+		} else if constexpr (std::is_same_v<U, Json>) {
+			return {formatJson, value.text.data(), value.text.size(), {}};
+		} else if constexpr (std::is_same_v<U, Time>) {
+			return {formatTime, &value.time, sizeof(value.time), {}};
+		} else if constexpr (std::is_enum_v<U>) {
+			return {formatInteger<std::underlying_type_t<U>>, &value, sizeof(value), {}};
+		} else if constexpr (std::is_integral_v<U>) {
+			return {formatInteger<U>, &value, sizeof(value), {}};
+		} else if constexpr (std::is_floating_point_v<U>) {
+			return {formatFloat<U>, &value, sizeof(value), {}};
+		} else if constexpr (std::is_trivially_copyable_v<U>) {
+			// e.g. a socket address, copied now and streamed by the flusher
+			return {formatStreamed<U>, &value, sizeof(value), {}};
+		} else {
+			std::ostringstream out;
+			out << value;
+			std::string text = out.str();
+			std::size_t size = text.size();
+			return {formatText, nullptr, size, std::move(text)};
+		}
+	}
+
+	static void formatText(std::string &out, const char *data, std::size_t size) { out.append(data, size); }
+	static void formatJson(std::string &out, const char *data, std::size_t size);
+	static void formatTime(std::string &out, const char *data, std::size_t size);
+
+	template <class T>
+	static void formatInteger(std::string &out, const char *data, std::size_t) {
+		T value;
+		std::memcpy(&value, data, sizeof(T));
+		char buffer[24];
+		if constexpr (std::is_same_v<T, bool>) {
+			out += value ? '1' : '0';
+		} else {
+			out.append(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr);
+		}
+	}
+
+	template <class T>
+	static void formatFloat(std::string &out, const char *data, std::size_t) {
+		T value;
+		std::memcpy(&value, data, sizeof(T));
+		std::ostringstream s;
+		s << value;
+		out += s.str();
+	}
+
+	template <class T>
+	static void formatStreamed(std::string &out, const char *data, std::size_t) {
+		std::array<char, sizeof(T)> bytes;
+		std::memcpy(bytes.data(), data, sizeof(T));
+		std::ostringstream s;
+		s << std::bit_cast<T>(bytes);
+		out += s.str();
+	}
+
+	Ring &local() {
+		if (!t_ring.ring) [[unlikely]] attach();
+		return *t_ring.ring;
+	}
+
+	char *reserve(Ring &ring, std::size_t size) {
+		// a record that could never fit is dropped whatever the policy
+		if (size > ring.capacity / 2) [[unlikely]] {
+			full(ring, false);
+			return nullptr;
+		}
+		for (;;) {
+			uint64_t	tail	   = ring.tail.load(std::memory_order_relaxed);
+			std::size_t offset	   = tail & (ring.capacity - 1);
+			std::size_t contiguous = ring.capacity - offset;
+			std::size_t skip	   = contiguous < size ? contiguous : 0;
+			if (tail + skip + size - ring.cachedHead > ring.capacity) {
+				ring.cachedHead = ring.head.load(std::memory_order_acquire);
+				if (tail + skip + size - ring.cachedHead > ring.capacity) {
+					if (!full(ring, true)) return nullptr;
+					continue;
+				}
+			}
+			if (!skip) return ring.data.get() + offset;
+
+			// too short for a header, the flusher skips it without one
+			if (skip >= HEADER) {
+				Header header{uint32_t(skip), SKIP, 0};
+				std::memcpy(ring.data.get() + offset, &header, HEADER);
+			}
+			ring.tail.store(tail + skip, std::memory_order_release);
+		}
+	}
+
+	void attach();
+	/// Called when a record does not fit, returns whether to try again.
+	bool full(Ring &ring, bool mayBlock);
+	bool writeNow(int fd, const Arg *args, std::size_t count);
+	void run();
+
+	static thread_local LocalRing	t_ring;
+	static inline thread_local bool t_exited = false;	 // t_ring has been destroyed
+
+	std::atomic<Overflow>	 m_overflow	   = Overflow::DROP;
+	std::atomic_size_t		 m_ringSize	   = 1 << 20;
+	std::atomic_bool		 m_synchronous = false;	   // set at exit, records are written by the caller then
+
+	mutable std::mutex		m_mutex;	// guards everything below
+	std::vector<Ring *>		m_rings;
+	uint64_t				m_droppedClosed = 0;	// by the rings that have been deleted
+	uint64_t				m_requested = 0, m_completed = 0;	 // flushes
+	std::condition_variable m_wake, m_done;
+	std::thread				m_thread;
+};
+
+inline thread_local Logger::LocalRing Logger::t_ring;
+
+}	 // namespace dbg
@@ -0,0 +1,91 @@
+#include <metrics.hpp>
+
+#include <cstdio>
+
+// the bucket boundaries written as "le" labels, 1 µs to 34 s, the buckets below and above them are merged in
+static constexpr std::size_t FIRST_BUCKET = 10;
+static constexpr std::size_t LAST_BUCKET  = 35;
+
+static const char *PHASE_NAMES[Metrics::PHASES] = {"parse", "handler", "write"};
+
+void Metrics::setRoutes(std::vector<std::string> names) {
+	m_routes = std::move(names);
+	m_routes.push_back("none");
+}
+
+void Metrics::attach() {
+	std::lock_guard lock(m_mutex);
+	// a thread that records for several instances comes back to the block it has
+	auto it = std::find_if(m_blocks.begin(), m_blocks.end(),
+						   [](const auto &block) { return block->thread == std::this_thread::get_id(); });
+	if (it == m_blocks.end()) it = m_blocks.insert(m_blocks.end(), std::make_unique<Block>(m_routes.size()));
+	t_block = it->get();
+	t_owner = m_id;
+}
+
+std::string Metrics::label(std::string_view value) {
+	std::string res;
+	for (char c : value) {
+		if (c == '\\' || c == '"') res += '\\';
+		if (c == '\n') {
+			res += "\\n";
+			continue;
+		}
+		res += c;
+	}
+	return res;
+}
+
+void Metrics::write(std::ostream &out) const {
+	constexpr std::size_t SLOTS = LatencyHistogram::BUCKETS + 1;	// the counts and the sum
+
+	std::vector<uint64_t> totals(m_routes.size() * PHASES * SLOTS);
+	uint64_t			  rejected[REJECTIONS] = {};
+	{
+		std::lock_guard lock(m_mutex);
+		for (const auto &block : m_blocks) {
+			for (std::size_t h = 0; h < m_routes.size() * PHASES; h++) {
+				const LatencyHistogram &histogram = block->latency[h];
+				for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+					totals[h * SLOTS + i] += histogram.counts[i].load(std::memory_order_relaxed);
+				}
+				totals[h * SLOTS + LatencyHistogram::BUCKETS] += histogram.sum.load(std::memory_order_relaxed);
+			}
+			for (std::size_t i = 0; i < REJECTIONS; i++) {
+				rejected[i] += block->rejected[i].load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	out << "# HELP http_request_duration_seconds Time spent in each phase of a request.\n"
+		   "# TYPE http_request_duration_seconds histogram\n";
+	char number[32];
+	for (std::size_t route = 0; route < m_routes.size(); route++) {
+		std::string name = label(m_routes[route]);
+		for (std::size_t phase = 0; phase < PHASES; phase++) {
+			const uint64_t *counts = &totals[(route * PHASES + phase) * SLOTS];
+			uint64_t		count  = 0;
+			for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; i++) count += counts[i];
+			// series appear once something has been recorded for them
+			if (!count) continue;
+
+			std::string labels = "{route=\"" + name + "\",phase=\"" + PHASE_NAMES[phase] + "\"";
+			uint64_t	seen   = 0;
+			for (std::size_t i = 0; i < LatencyHistogram::BUCKETS; i++) {
+				seen += counts[i];
+				if (i < FIRST_BUCKET || i > LAST_BUCKET) continue;
+				snprintf(number, sizeof(number), "%.9g", double(uint64_t(1) << i) * 1e-9);
+				out << "http_request_duration_seconds_bucket" << labels << ",le=\"" << number << "\"} " << seen << '\n';
+			}
+			snprintf(number, sizeof(number), "%.12g", double(counts[LatencyHistogram::BUCKETS]) * 1e-9);
+			out << "http_request_duration_seconds_bucket" << labels << ",le=\"+Inf\"} " << count << '\n'
+				<< "http_request_duration_seconds_sum" << labels << "} " << number << '\n'
+				<< "http_request_duration_seconds_count" << labels << "} " << count << '\n';
+		}
+	}
+
+	out << "# HELP http_requests_rejected_total Error responses the server sent in place of a handler.\n"
+		   "# TYPE http_requests_rejected_total counter\n"
+		   "http_requests_rejected_total{class=\"4xx\"} "
+		<< rejected[CLIENT_ERROR] << "\nhttp_requests_rejected_total{class=\"5xx\"} " << rejected[SERVER_ERROR] << '\n';
+}
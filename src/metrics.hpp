@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Adds to a counter that only the calling thread writes. A relaxed load and store instead of fetch_add, which
+ * would be a locked instruction, while readers on other threads still see whole values.
+ */
+inline void addRelaxed(std::atomic_uint64_t &counter, uint64_t n = 1) {
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Latency histograms per route and phase of a request, cheap enough to stay on in production.
+ *
+ * Every thread that records gets a block of histograms of its own, registered the first time it records and written
+ * with relaxed stores only, so recording takes a clock read and two stores into cache lines no other thread writes.
+ * The blocks are summed up only when the metrics are written, e.g. by a scrape of the /metrics route.
+ */
+class Metrics {
+   public:
+	/// The phases of a request whose durations are recorded.
+	enum Phase : uint8_t {
+		PARSE,		///< from the first byte of the request until its head and body have been read
+		HANDLER,	///< the handler, including the time an async or coroutine handler waits
+		WRITE,		///< from the end of the handler until the last of the response has been handed to the socket
+		PHASES
+	};
+
+	/**
+	 * @brief Durations in buckets of powers of two nanoseconds: bucket i counts those below 2^i ns and at least half
+	 * of that. Only written by the thread that owns it.
+	 */
+	struct alignas(64) LatencyHistogram {
+		static constexpr std::size_t BUCKETS = 48;
+
+		std::atomic_uint64_t counts[BUCKETS];
+		std::atomic_uint64_t sum;	 // ns
+
+		void record(uint64_t ns) {
+			addRelaxed(counts[std::min<std::size_t>(std::bit_width(ns), BUCKETS - 1)]);
+			addRelaxed(sum, ns);
+		}
+	};
+
+	/// Categories of the error responses the server sends by itself, before or instead of a handler.
+	enum Rejection : uint8_t { CLIENT_ERROR, SERVER_ERROR, REJECTIONS };
+
+	Metrics() : m_id(s_nextId.fetch_add(1, std::memory_order_relaxed)) {}
+	Metrics(const Metrics &)			= delete;
+	Metrics &operator=(const Metrics &) = delete;
+
+	/**
+	 * @brief Sets the names of the routes that durations are recorded for, the route with the index names.size()
+	 * stands for requests that did not match one. Must be called before the first record().
+	 */
+	void setRoutes(std::vector<std::string> names);
+	/// The route index for requests without a route.
+	std::size_t unmatched() const { return m_routes.size() - 1; }
+
+	void record(std::size_t route, Phase phase, std::chrono::steady_clock::duration duration) {
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+		local().latency[route * PHASES + phase].record(uint64_t(std::max<int64_t>(ns, 0)));
+	}
+	/// Counts an error response to a request, by its status.
+	void reject(int status) { addRelaxed(local().rejected[status >= 500 ? SERVER_ERROR : CLIENT_ERROR]); }
+
+	/// Writes the sums over all threads in the Prometheus text format.
+	void write(std::ostream &out) const;
+
+	/// Escapes a Prometheus label value.
+	static std::string label(std::string_view value);
+
+   private:
+	struct alignas(64) Block {
+		explicit Block(std::size_t routes) : latency(std::make_unique<LatencyHistogram[]>(routes * PHASES)) {}
+
+		std::thread::id						thread = std::this_thread::get_id();
+		std::unique_ptr<LatencyHistogram[]> latency;
+		std::atomic_uint64_t				rejected[REJECTIONS] = {};
+	};
+
+	/// the block of the calling thread, only looked up once per thread and instance
+	Block &local() {
+		if (t_owner != m_id) [[unlikely]] attach();
+		return *t_block;
+	}
+	void attach();
+
+	static inline std::atomic_uint64_t s_nextId = 1;
+	static inline thread_local uint64_t t_owner = 0;	// id of the instance t_block belongs to
+	static inline thread_local Block   *t_block = nullptr;
+
+	const uint64_t			 m_id;
+	std::vector<std::string> m_routes;
+
+	mutable std::mutex				    m_mutex;	// guards m_blocks, taken to attach a thread and to write
+	std::vector<std::unique_ptr<Block>> m_blocks;
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief Produces a response piece by piece while the socket drains, so that it never has to be in memory at once.
+ */
+class OutputSource {
+   public:
+	virtual ~OutputSource() = default;
+
+	/**
+	 * @brief The next bytes of the response, valid until the next call. An empty view ends the response.
+	 *
+	 * @return false on error, the connection is then closed
+	 */
+	virtual bool next(std::string_view &data) = 0;
+};
+
+/**
+ * @brief Response data waiting to be written to a socket. Memory segments are sent together with writev and file
+ * ranges with sendfile, so a response that does not fit into the socket buffer is continued later instead of blocking.
+ */
+class OutputQueue {
+   public:
+	OutputQueue() = default;
+	OutputQueue(const OutputQueue &)			= delete;
+	OutputQueue &operator=(const OutputQueue &) = delete;
+	~OutputQueue() { clear(); }
+
+	bool		empty() const { return head == segments.size(); }
+	std::size_t size() const { return bytes; }
+	/// Bytes the socket has taken so far.
+	uint64_t written() const { return total; }
+
+	/**
+	 * @brief Queues a copy of the given bytes. Small writes are appended to the previous segment if it owns its memory.
+	 */
+	void push(std::string_view data) {
+		if (data.empty()) return;
+		if (!empty() && segments.back().owned && segments.back().owned->size() < COALESCE_LIMIT) {
+			Segment &last = segments.back();
+			// keep the views of the segment valid when the string reallocates
+			std::size_t sent = last.data.data() - last.owned->data();
+			last.owned->append(data);
+			last.data = std::string_view(*last.owned).substr(sent);
+		} else {
+			Segment &s = segments.emplace_back();
+			s.owned	   = std::make_unique<std::string>(data);
+			s.data	   = *s.owned;
+		}
+		bytes += data.size();
+	}
+
+	void push(std::string &&data) {
+		if (data.empty()) return;
+		Segment &s = segments.emplace_back();
+		s.owned	   = std::make_unique<std::string>(std::move(data));
+		s.data	   = *s.owned;
+		bytes += s.data.size();
+	}
+
+	/**
+	 * @brief Queues bytes owned by someone else without copying them. keepAlive holds them until they are sent.
+	 */
+	void push(std::string_view data, std::shared_ptr<const void> keepAlive) {
+		if (data.empty()) return;
+		Segment &s	= segments.emplace_back();
+		s.keepAlive = std::move(keepAlive);
+		s.data		= data;
+		bytes += data.size();
+	}
+
+	/**
+	 * @brief Queues a range of a file. Without keepAlive the queue takes ownership of fd, otherwise keepAlive is
+	 * expected to keep fd open until the range is sent.
+	 */
+	void pushFile(int fd, off_t offset, std::size_t length, std::shared_ptr<const void> keepAlive = nullptr) {
+		bool closeFD = !keepAlive;
+		if (!length) {
+			if (closeFD) close(fd);
+			return;
+		}
+		Segment &s	= segments.emplace_back();
+		s.keepAlive = std::move(keepAlive);
+		s.fd		= fd;
+		s.closeFD	= closeFD;
+		s.offset   = offset;
+		s.length   = length;
+		bytes += length;
+	}
+
+	/**
+	 * @brief Queues a response part that is produced only when everything before it has been sent.
+	 */
+	void pushSource(std::unique_ptr<OutputSource> source) {
+		Segment &s = segments.emplace_back();
+		s.source   = std::move(source);
+	}
+
+	/**
+	 * @brief Moves everything queued in other behind the segments of this queue.
+	 */
+	void append(OutputQueue &&other) {
+		for (std::size_t i = other.head; i < other.segments.size(); i++) {
+			segments.push_back(std::move(other.segments[i]));
+		}
+		bytes += other.bytes;
+		other.segments.clear();
+		other.head	= 0;
+		other.bytes = 0;
+	}
+
+	static constexpr std::size_t IOV_COUNT = 64;
+
+	/**
+	 * @brief The data at the front of the queue: either memory segments or a range of a file.
+	 */
+	struct Chunk {
+		iovec		iov[IOV_COUNT];
+		std::size_t count  = 0;
+		int			fd	   = -1;	// the file to send from instead of memory
+		off_t		offset = 0;
+		std::size_t length = 0;
+		/// what keeps each piece of memory, or the file, alive, empty for memory owned by the queue
+		const std::shared_ptr<const void> *owners[IOV_COUNT];
+	};
+
+	/**
+	 * @brief Gathers what to send next without removing it from the queue, that is up to advance(). Sources at the
+	 * front are asked for their next bytes first.
+	 *
+	 * @return false with errno set if a source failed. The chunk is empty if the queue has become empty.
+	 */
+	bool next(Chunk &chunk) {
+		chunk.count = 0;
+		chunk.fd	= -1;
+		while (!empty()) {
+			Segment &front = segments[head];
+			if (front.source && front.data.empty()) {
+				if (!front.source->next(front.data)) {
+					errno = EIO;
+					return false;
+				}
+				if (front.data.empty()) {
+					pop();
+					continue;
+				}
+				bytes += front.data.size();
+			}
+
+			if (front.fd >= 0) {
+				chunk.fd		= front.fd;
+				chunk.offset	= front.offset;
+				chunk.length	= front.length;
+				chunk.owners[0] = &front.keepAlive;
+				return true;
+			}
+			for (auto it = segments.begin() + head; it != segments.end() && it->fd < 0 && chunk.count < IOV_COUNT; ++it) {
+				// whatever a source produces next has to be sent before the segments after it
+				if (it->source && it->data.empty()) break;
+				chunk.owners[chunk.count] = &it->keepAlive;
+				chunk.iov[chunk.count++]  = {(void *)it->data.data(), it->data.size()};
+				if (it->source) break;
+			}
+			return true;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Removes n bytes that have been sent from the front of the queue.
+	 */
+	void advance(std::size_t n) {
+		bytes -= n;
+		total += n;
+		while (n) {
+			Segment &front = segments[head];
+			if (front.fd >= 0) {
+				std::size_t taken = std::min(n, front.length);
+				front.offset += taken;
+				front.length -= taken;
+				n -= taken;
+				if (!front.length) pop();
+				continue;
+			}
+			std::size_t taken = std::min(n, front.data.size());
+			front.data.remove_prefix(taken);
+			n -= taken;
+			// a source stays until it has nothing more to send
+			if (front.data.empty() && !front.source) pop();
+		}
+	}
+
+	/**
+	 * @brief Writes as much as the socket accepts.
+	 *
+	 * @return 0 if everything was sent, 1 if the socket is full and -1 with errno set on error
+	 */
+	int flush(int socket) {
+		Chunk chunk;
+		for (;;) {
+			if (!next(chunk)) return -1;
+			if (empty()) return 0;
+
+			ssize_t res;
+			if (chunk.fd >= 0) {
+				res = sendfile(socket, chunk.fd, &chunk.offset, std::min<std::size_t>(chunk.length, SSIZE_MAX));
+				if (res == 0) {
+					// the file got shorter since the response headers were written
+					errno = EPIPE;
+					return -1;
+				}
+			} else {
+				res = writev(socket, chunk.iov, chunk.count);
+			}
+
+			if (res < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+				return -1;
+			}
+			advance(res);
+		}
+	}
+
+	void clear() {
+		while (!empty()) {
+			pop();
+		}
+		bytes = 0;
+	}
+
+	/// Frees the memory kept for segments, for a queue that stays empty for a while.
+	void shrink() {
+		if (empty()) std::vector<Segment>().swap(segments);
+	}
+
+   private:
+	static constexpr std::size_t COALESCE_LIMIT = 64 * 1024;
+
+	struct Segment {
+		std::unique_ptr<std::string>  owned;
+		std::shared_ptr<const void>	  keepAlive;
+		std::unique_ptr<OutputSource> source;
+		std::string_view			  data;
+
+		int			fd		= -1;
+		bool		closeFD = false;
+		off_t		offset	= 0;
+		std::size_t length	= 0;
+	};
+
+	void pop() {
+		Segment &front = segments[head];
+		if (front.fd >= 0 && front.closeFD) close(front.fd);
+		front = Segment();
+		// the slots are reused once everything queued has been sent, or once most of them are behind a queue that
+		// never drains completely
+		if (++head == segments.size()) {
+			segments.clear();
+			head = 0;
+		} else if (head >= 64 && head * 2 >= segments.size()) {
+			segments.erase(segments.begin(), segments.begin() + head);
+			head = 0;
+		}
+	}
+
+	std::vector<Segment> segments;
+	std::size_t			 head  = 0;	   // first segment that has not been sent yet
+	std::size_t			 bytes = 0;
+	uint64_t			 total = 0;
+};
@@ -0,0 +1,87 @@
+#include <request_body.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+int createTempFile() {
+	const char *dir = getenv("TMPDIR");
+	if (!dir || !*dir) dir = "/tmp";
+
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) return fd;
+
+	// the file system does not support O_TMPFILE
+	std::string path = std::string(dir) + "/body-XXXXXX";
+	fd				 = mkostemp(path.data(), O_CLOEXEC);
+	if (fd >= 0) unlink(path.c_str());
+	return fd;
+}
+
+void RequestBody::begin(const BodyOptions &options, std::size_t expected) {
+	reset();
+	m_threshold = options.mode == BodyOptions::SPILL ? options.spillThreshold : SIZE_MAX;
+	// a body that is going to be spilled only needs room for the write-behind buffer
+	m_buffer = BufferPool::acquire(expected > m_threshold ? SPILL_CHUNK : expected);
+}
+
+std::span<char> RequestBody::prepare(std::size_t max) {
+	if (!spilled() && m_size + max > m_threshold && !spill()) return {};
+	if (spilled() && m_buffer.size() >= SPILL_CHUNK && !flushSpilled()) return {};
+
+	std::size_t used = m_buffer.size();
+	if (spilled()) max = std::min(max, SPILL_CHUNK - used);
+	if (used + max > m_buffer.capacity()) m_buffer.reserve(std::max(used + max, m_buffer.capacity() * 2));
+	return std::span<char>(m_buffer.data() + used, max);
+}
+
+void RequestBody::commit(std::size_t n) {
+	m_buffer.resize(m_buffer.size() + n);
+	m_size += n;
+}
+
+bool RequestBody::append(std::string_view data) {
+	while (!data.empty()) {
+		std::span<char> space = prepare(data.size());
+		if (space.empty()) return false;
+		std::size_t n = std::min(space.size(), data.size());
+		std::memcpy(space.data(), data.data(), n);
+		commit(n);
+		data.remove_prefix(n);
+	}
+	return true;
+}
+
+bool RequestBody::finish() { return !spilled() || flushSpilled(); }
+
+void RequestBody::reset() {
+	if (m_fd >= 0) close(m_fd);
+	m_fd   = -1;
+	m_size = 0;
+	BufferPool::release(std::move(m_buffer));
+	m_buffer = ByteBuffer();
+}
+
+bool RequestBody::spill() {
+	m_fd = createTempFile();
+	if (m_fd < 0) return false;
+	// from now on the buffer only holds what has not been written to the file yet
+	return flushSpilled();
+}
+
+bool RequestBody::flushSpilled() {
+	std::string_view pending = m_buffer;
+	while (!pending.empty()) {
+		ssize_t res = ::write(m_fd, pending.data(), pending.size());
+		if (res < 0 && errno == EINTR) continue;
+		if (res <= 0) return false;
+		pending.remove_prefix(res);
+	}
+	m_buffer.clear();
+	return true;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include "buffer_pool.hpp"
+
+class SocketStream;
+
+/**
+ * @brief Creates a temporary file in TMPDIR (or /tmp) that has no name, so that it disappears with its last
+ * descriptor.
+ *
+ * @return the descriptor or -1 with errno set
+ */
+int createTempFile();
+
+/**
+ * @brief How a route receives the body of its requests.
+ */
+struct BodyOptions {
+	enum Mode {
+		/// the whole body is read into a pooled memory buffer before the handler runs
+		BUFFER,
+		/// like BUFFER, but a body larger than spillThreshold is written to an unnamed temporary file instead
+		SPILL,
+		/// the body is passed to a BodyStream piece by piece as it arrives
+		STREAM,
+	};
+
+	Mode		mode		   = BUFFER;
+	std::size_t spillThreshold = 1024 * 1024;
+	/// larger bodies are refused with 413, BUFFER routes are also limited by the server's maxBodySize
+	std::size_t maxSize = SIZE_MAX;
+};
+
+/**
+ * @brief Thrown when the rest of a body a coroutine handler reads is refused, too large or malformed. A handler that
+ * lets it escape before writing its response has the error response sent for it.
+ */
+class BodyError : public std::runtime_error {
+   public:
+	BodyError(int status, const std::string &msg) : std::runtime_error(msg), status(status) {}
+
+	int status;
+};
+
+/**
+ * @brief Receives the body of a request to a STREAM route while it arrives.
+ */
+class BodyStream {
+   public:
+	virtual ~BodyStream() = default;
+
+	/**
+	 * @brief Called before the body is read. A stream that cannot take the body writes the response and returns
+	 * false, the body is then not read and the connection is closed after the response.
+	 */
+	virtual bool begin(SocketStream &) { return true; }
+
+	/**
+	 * @brief Called with each decoded piece of the body, in order. The view is only valid during the call.
+	 *
+	 * @return false to stop reading the body, end() is called next and the connection is closed after the response
+	 */
+	virtual bool data(std::string_view chunk) = 0;
+
+	/**
+	 * @brief Called once the whole body has arrived (or data() refused more). Writes the response.
+	 */
+	virtual void end(SocketStream &s) = 0;
+};
+
+/**
+ * @brief The body of a request to a BUFFER or SPILL route. It is either in memory or, once spilled, in an unnamed
+ * temporary file.
+ */
+class RequestBody {
+   public:
+	RequestBody() = default;
+	RequestBody(const RequestBody &)			= delete;
+	RequestBody &operator=(const RequestBody &) = delete;
+	~RequestBody() { reset(); }
+
+	std::size_t size() const { return m_size; }
+	bool		spilled() const { return m_fd >= 0; }
+	/// the whole body, empty if it has been spilled
+	std::string_view data() const { return spilled() ? std::string_view() : std::string_view(m_buffer); }
+	/// the temporary file holding the body if it has been spilled, -1 otherwise
+	int fd() const { return m_fd; }
+
+	/**
+	 * @brief Prepares for a new body.
+	 *
+	 * @param expected size of the body if it is known in advance, 0 otherwise
+	 */
+	void begin(const BodyOptions &options, std::size_t expected);
+
+	/**
+	 * @brief Space for the next bytes of the body, at most max bytes, so that they can be received straight into it.
+	 * Pass the number of bytes actually written to commit().
+	 *
+	 * @return an empty span if the temporary file could not be written
+	 */
+	std::span<char> prepare(std::size_t max);
+	void			commit(std::size_t n);
+
+	/// Appends decoded body bytes. Returns false if the temporary file could not be written.
+	bool append(std::string_view data);
+
+	/// Writes out what is still buffered for the temporary file. Returns false on error.
+	bool finish();
+
+	/// Frees the body, returning its buffer to the pool and closing the temporary file.
+	void reset();
+
+   private:
+	/// The write-behind buffer of a spilled body is written out whenever it reaches this size.
+	static constexpr std::size_t SPILL_CHUNK = 256 * 1024;
+
+	bool spill();
+	bool flushSpilled();
+
+	ByteBuffer	m_buffer;
+	int			m_fd		= -1;
+	std::size_t m_size		= 0;
+	std::size_t m_threshold = SIZE_MAX;
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+/// A status code with its complete status line.
+struct StatusLine {
+	int				 status;
+	std::string_view line;
+};
+
+/// The status lines of the registered codes a server sends (RFC 9110 15), sorted by code.
+inline constexpr StatusLine STATUS_LINES[] = {
+	{100, "HTTP/1.1 100 Continue\r\n"},
+	{101, "HTTP/1.1 101 Switching Protocols\r\n"},
+	{200, "HTTP/1.1 200 OK\r\n"},
+	{201, "HTTP/1.1 201 Created\r\n"},
+	{202, "HTTP/1.1 202 Accepted\r\n"},
+	{204, "HTTP/1.1 204 No Content\r\n"},
+	{206, "HTTP/1.1 206 Partial Content\r\n"},
+	{301, "HTTP/1.1 301 Moved Permanently\r\n"},
+	{302, "HTTP/1.1 302 Found\r\n"},
+	{303, "HTTP/1.1 303 See Other\r\n"},
+	{304, "HTTP/1.1 304 Not Modified\r\n"},
+	{307, "HTTP/1.1 307 Temporary Redirect\r\n"},
+	{308, "HTTP/1.1 308 Permanent Redirect\r\n"},
+	{400, "HTTP/1.1 400 Bad Request\r\n"},
+	{401, "HTTP/1.1 401 Unauthorized\r\n"},
+	{403, "HTTP/1.1 403 Forbidden\r\n"},
+	{404, "HTTP/1.1 404 Not Found\r\n"},
+	{405, "HTTP/1.1 405 Method Not Allowed\r\n"},
+	{406, "HTTP/1.1 406 Not Acceptable\r\n"},
+	{408, "HTTP/1.1 408 Request Timeout\r\n"},
+	{409, "HTTP/1.1 409 Conflict\r\n"},
+	{410, "HTTP/1.1 410 Gone\r\n"},
+	{411, "HTTP/1.1 411 Length Required\r\n"},
+	{412, "HTTP/1.1 412 Precondition Failed\r\n"},
+	{413, "HTTP/1.1 413 Content Too Large\r\n"},
+	{414, "HTTP/1.1 414 URI Too Long\r\n"},
+	{415, "HTTP/1.1 415 Unsupported Media Type\r\n"},
+	{416, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
+	{417, "HTTP/1.1 417 Expectation Failed\r\n"},
+	{421, "HTTP/1.1 421 Misdirected Request\r\n"},
+	{422, "HTTP/1.1 422 Unprocessable Content\r\n"},
+	{426, "HTTP/1.1 426 Upgrade Required\r\n"},
+	{428, "HTTP/1.1 428 Precondition Required\r\n"},
+	{429, "HTTP/1.1 429 Too Many Requests\r\n"},
+	{431, "HTTP/1.1 431 Request Header Fields Too Large\r\n"},
+	{500, "HTTP/1.1 500 Internal Server Error\r\n"},
+	{501, "HTTP/1.1 501 Not Implemented\r\n"},
+	{502, "HTTP/1.1 502 Bad Gateway\r\n"},
+	{503, "HTTP/1.1 503 Service Unavailable\r\n"},
+	{504, "HTTP/1.1 504 Gateway Timeout\r\n"},
+	{505, "HTTP/1.1 505 HTTP Version Not Supported\r\n"},
+};
+static_assert(std::ranges::is_sorted(STATUS_LINES, {}, &StatusLine::status));
+
+/**
+ * @brief The status line of a registered code including its CRLF, "HTTP/1.1 404 Not Found\r\n". Empty for others.
+ */
+constexpr std::string_view statusLine(int status) {
+	auto it = std::ranges::lower_bound(STATUS_LINES, status, {}, &StatusLine::status);
+	return it != std::end(STATUS_LINES) && it->status == status ? it->line : std::string_view();
+}
+
+/// The media type files with an extension are served as.
+struct MimeType {
+	std::string_view extension;
+	/// the value of the Content-Type header, with the charset for text
+	std::string_view contentType;
+	/// whether responses of this type are worth compressing, most image and media formats are compressed already
+	bool compressible;
+};
+
+/// The known file extensions, sorted.
+inline constexpr MimeType MIME_TYPES[] = {
+	{"css", "text/css; charset=utf-8", true},
+	{"csv", "text/csv; charset=utf-8", true},
+	{"gif", "image/gif", false},
+	{"htm", "text/html; charset=utf-8", true},
+	{"html", "text/html; charset=utf-8", true},
+	{"ico", "image/x-icon", true},
+	{"jpeg", "image/jpeg", false},
+	{"jpg", "image/jpeg", false},
+	{"js", "text/javascript; charset=utf-8", true},
+	{"json", "application/json", true},
+	{"md", "text/markdown; charset=utf-8", true},
+	{"mjs", "text/javascript; charset=utf-8", true},
+	{"mp4", "video/mp4", false},
+	{"pdf", "application/pdf", false},
+	{"png", "image/png", false},
+	{"svg", "image/svg+xml", true},
+	{"txt", "text/plain; charset=utf-8", true},
+	{"wasm", "application/wasm", true},
+	{"webp", "image/webp", false},
+	{"woff2", "font/woff2", false},
+	{"xml", "application/xml", true},
+};
+static_assert(std::ranges::is_sorted(MIME_TYPES, {}, &MimeType::extension));
+
+/// What files with an unknown extension are served as.
+inline constexpr MimeType DEFAULT_MIME_TYPE = {"", "text/plain; charset=utf-8", true};
+
+/**
+ * @brief The media type of a file based on its extension, a binary search in MIME_TYPES.
+ */
+constexpr const MimeType &mimeType(std::string_view path) {
+	std::size_t dot = path.rfind('.');
+	if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos) return DEFAULT_MIME_TYPE;
+	std::string_view extension = path.substr(dot + 1);
+	auto			 it		   = std::ranges::lower_bound(MIME_TYPES, extension, {}, &MimeType::extension);
+	return it != std::end(MIME_TYPES) && it->extension == extension ? *it : DEFAULT_MIME_TYPE;
+}
+static_assert(mimeType("/public/index.html").contentType == "text/html; charset=utf-8");
+static_assert(mimeType("./a.b/README").extension.empty());
+
+/**
+ * @brief The status line and headers of a response, serialized while they are added.
+ *
+ * Status lines of registered codes and the names of the common headers are constants that are copied, numbers are
+ * written with std::to_chars. The head is kept in an inline buffer, so building one allocates nothing unless it
+ * outgrows INLINE_SIZE. It always ends in the empty line, view() is a complete head at any time.
+ *
+ *     ResponseHead head(200);
+ *     head.header(ResponseHead::CONTENT_TYPE, "text/plain").header(ResponseHead::CONTENT_LENGTH, body.size());
+ *     stream.send(head, body);
+ */
+class ResponseHead {
+   public:
+	/// Headers whose names are interned.
+	enum Field : uint8_t {
+		ACCEPT_RANGES,
+		ALLOW,
+		CACHE_CONTROL,
+		CONTENT_ENCODING,
+		CONTENT_LENGTH,
+		CONTENT_RANGE,
+		CONTENT_TYPE,
+		ETAG,
+		LAST_MODIFIED,
+		LOCATION,
+		TRANSFER_ENCODING,
+		VARY,
+		FIELDS
+	};
+
+	static constexpr std::size_t INLINE_SIZE = 480;
+
+	/**
+	 * @param reason the reason phrase, the registered one if empty. A status line is only formatted for other codes
+	 * and phrases.
+	 */
+	explicit ResponseHead(int status, std::string_view reason = {}) {
+		// the status code is read back as three digits, see SocketBuffer::status()
+		if (status < 100 || status > 999) throw std::runtime_error("invalid status code");
+		std::string_view line = statusLine(status);
+		// "HTTP/1.1 200 " comes before the reason phrase, CRLF after it
+		if (!line.empty() && (reason.empty() || line.substr(13, line.size() - 15) == reason)) {
+			append(line);
+		} else {
+			append("HTTP/1.1 ", status, ' ', reason, "\r\n");
+		}
+		append("\r\n");
+	}
+
+	/**
+	 * @brief Adds a header whose value is made of the given parts, strings and characters copied and integers
+	 * written in decimal, e.g. header(CONTENT_RANGE, "bytes ", first, '-', last, '/', size).
+	 */
+	template <class... Parts>
+	ResponseHead &header(Field name, const Parts &...value) {
+		return header(FIELD_NAMES[name], value...);
+	}
+	/// Adds a header with any name. Neither the name nor the value may contain CR or LF.
+	template <class... Parts>
+	ResponseHead &header(std::string_view name, const Parts &...value) {
+		// the header goes where the empty line was, which is added again after it
+		m_size -= 2;
+		if (m_heap) m_heap->resize(m_size);
+		append(name, ": ", value..., "\r\n\r\n");
+		return *this;
+	}
+
+	/// The status line, the headers and the empty line after them.
+	std::string_view view() const { return m_heap ? std::string_view(*m_heap) : std::string_view(m_inline, m_size); }
+
+   private:
+	static constexpr std::string_view FIELD_NAMES[FIELDS] = {
+		"Accept-Ranges", "Allow",		  "Cache-Control", "Content-Encoding",  "Content-Length", "Content-Range",
+		"Content-Type",	 "ETag",		  "Last-Modified", "Location",			"Transfer-Encoding", "Vary",
+	};
+
+	template <class... Parts>
+	void append(const Parts &...parts) {
+		(appendPart(parts), ...);
+	}
+
+	template <class T>
+	void appendPart(const T &part) {
+		if constexpr (std::is_same_v<T, char>) {
+			appendBytes(&part, 1);
+		} else if constexpr (std::is_integral_v<T>) {
+			char buffer[24];
+			appendBytes(buffer, std::to_chars(buffer, buffer + sizeof(buffer), part).ptr - buffer);
+		} else {
+			std::string_view text = part;
+			appendBytes(text.data(), text.size());
+		}
+	}
+
+	void appendBytes(const char *data, std::size_t size) {
+		if (!m_heap && m_size + size > INLINE_SIZE) [[unlikely]] {
+			// only for heads with unusually long headers
+			m_heap = std::string(m_inline, m_size);
+		}
+		if (m_heap) m_heap->append(data, size);
+		else std::memcpy(m_inline + m_size, data, size);
+		m_size += size;
+	}
+
+	std::size_t				   m_size = 0;
+	char					   m_inline[INLINE_SIZE];
+	std::optional<std::string> m_heap;	  // the head once it outgrew m_inline
+};
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Values of the ":name" and "*name" segments of a matched route. They point into the request path.
+ */
+struct RouteParams {
+	static constexpr std::size_t MAX_PARAMS = 8;
+
+	std::array<std::pair<std::string_view, std::string_view>, MAX_PARAMS> items;
+	std::size_t															   size = 0;
+
+	/**
+	 * @brief Value of a parameter, empty if the route has no such parameter.
+	 */
+	std::string_view operator[](std::string_view name) const {
+		for (std::size_t i = 0; i < size; i++) {
+			if (items[i].first == name) return items[i].second;
+		}
+		return {};
+	}
+};
+
+/**
+ * @brief Compressed prefix tree mapping path patterns and methods to values.
+ *
+ * A pattern consists of static text, ":name" segments that match one non-empty path segment and a trailing "*name"
+ * that matches the rest of the path, including nothing. Static edges take precedence over parameters and parameters
+ * over wildcards; the walk backtracks when a more specific branch does not lead to a value for the method.
+ *
+ * Routes are inserted at startup and then compiled into a flat array of nodes, where the children of a node are
+ * adjacent and all strings share one buffer, so a lookup touches few cache lines. Lookups do not modify the tree or
+ * allocate, so any number of threads can match concurrently as long as nothing is inserted meanwhile.
+ */
+template <class T, std::size_t METHODS = 16>
+class RouteTree {
+   public:
+	RouteTree() : m_root(std::make_unique<Node>()) {}
+
+	/**
+	 * @brief Adds a route. Throws std::invalid_argument if the pattern is malformed or the route already exists.
+	 */
+	void insert(std::size_t method, std::string_view pattern, T value) {
+		if (method >= METHODS) throw std::invalid_argument("unknown method");
+
+		Node *node = m_root.get();
+		while (!pattern.empty()) {
+			if (pattern[0] == ':' || pattern[0] == '*') {
+				bool			 wildcard = pattern[0] == '*';
+				std::size_t		 end	  = wildcard ? pattern.size() : std::min(pattern.find('/'), pattern.size());
+				std::string_view name	  = pattern.substr(1, end - 1);
+				if (wildcard && name.find('/') != std::string_view::npos) {
+					throw std::invalid_argument("a wildcard must be the last segment of a route");
+				}
+
+				std::unique_ptr<Node> &child = wildcard ? node->wildcard : node->param;
+				if (!child) {
+					child		= std::make_unique<Node>();
+					child->name = name;
+				} else if (child->name != name) {
+					throw std::invalid_argument("conflicting parameter names in route " + std::string(pattern));
+				}
+				node = child.get();
+				pattern.remove_prefix(end);
+				continue;
+			}
+
+			// parameters only start at a segment boundary, anywhere else ':' and '*' are literal
+			std::size_t end = 0;
+			do {
+				end = std::min(pattern.find('/', end), pattern.size());
+				if (end < pattern.size()) ++end;
+			} while (end < pattern.size() && pattern[end] != ':' && pattern[end] != '*');
+			node = insertStatic(node, pattern.substr(0, end));
+			pattern.remove_prefix(end);
+		}
+
+		if (node->values[method] >= 0) throw std::invalid_argument("duplicate route");
+		node->values[method] = m_values.size();
+		m_values.push_back(std::move(value));
+		m_nodes.clear();
+	}
+
+	/**
+	 * @brief Builds the lookup structure. Has to be called after the last insert and before find.
+	 */
+	void compile() {
+		m_nodes.clear();
+		m_text.clear();
+		m_methodValues.clear();
+
+		// breadth first, so that the children of a node get consecutive indices
+		std::vector<const Node *> order = {m_root.get()};
+		for (std::size_t i = 0; i < order.size(); i++) {
+			const Node &node = *order[i];
+			FlatNode	flat;
+			flat.name		 = addText(node.name);
+			flat.prefixSize	 = node.prefix.size();
+			flat.numChildren = node.children.size();
+			// the prefix is followed by the first bytes of the children, inline if they fit
+			std::string edge = node.prefix + node.indices;
+			if (edge.size() <= sizeof(flat.bytes)) edge.copy(flat.bytes, edge.size());
+			else flat.textOffset = addText(edge).offset;
+			flat.firstChild = order.size();
+			for (const auto &child : node.children) {
+				order.push_back(child.get());
+			}
+			if (node.param) {
+				flat.param = order.size();
+				order.push_back(node.param.get());
+			}
+			if (node.wildcard) {
+				flat.wildcard = order.size();
+				order.push_back(node.wildcard.get());
+			}
+
+			for (std::size_t m = 0; m < METHODS; m++) {
+				if (node.values[m] < 0) continue;
+				flat.values = m_methodValues.size();
+				m_methodValues.insert(m_methodValues.end(), node.values.begin(), node.values.end());
+				break;
+			}
+			m_nodes.push_back(flat);
+		}
+	}
+
+	/**
+	 * @brief Finds the value for a method and path.
+	 *
+	 * @param allowed if no value is found, receives a bit for each method the path has a value for
+	 * @return nullptr if there is no matching route for the method
+	 */
+	const T *find(std::size_t method, std::string_view path, RouteParams &params, uint32_t &allowed) const {
+		if (m_nodes.empty()) throw std::logic_error("the routes have not been compiled");
+		params.size = 0;
+		allowed		= 0;
+		int index	= match(m_nodes[0], path, method, params, allowed);
+		return index < 0 ? nullptr : &m_values[index];
+	}
+
+	std::size_t size() const { return m_values.size(); }
+
+   private:
+	struct Node {
+		Node() { values.fill(-1); }
+
+		/// static text of the edge leading to the node, empty for parameters
+		std::string prefix;
+		/// first bytes of the static children, for a single memchr instead of comparing each child
+		std::string						   indices;
+		std::vector<std::unique_ptr<Node>> children;
+		std::unique_ptr<Node>			   param, wildcard;
+		/// name of the parameter a ":" or "*" node captures
+		std::string name;
+
+		std::array<int32_t, METHODS> values;
+	};
+
+	static Node *insertStatic(Node *node, std::string_view s) {
+		while (!s.empty()) {
+			std::size_t i = node->indices.find(s[0]);
+			if (i == std::string::npos) {
+				auto child	  = std::make_unique<Node>();
+				child->prefix = s;
+				node->indices += s[0];
+				node = node->children.emplace_back(std::move(child)).get();
+				return node;
+			}
+
+			std::unique_ptr<Node> &child  = node->children[i];
+			std::size_t			   common = 0;
+			while (common < s.size() && common < child->prefix.size() && s[common] == child->prefix[common]) ++common;
+
+			if (common < child->prefix.size()) {
+				// split the edge at the first difference
+				auto middle	   = std::make_unique<Node>();
+				middle->prefix = child->prefix.substr(0, common);
+				child->prefix.erase(0, common);
+				middle->indices += child->prefix[0];
+				middle->children.push_back(std::move(child));
+				child = std::move(middle);
+			}
+			node = child.get();
+			s.remove_prefix(common);
+		}
+		return node;
+	}
+
+	/// a string in m_text
+	struct Text {
+		uint32_t offset = 0, size = 0;
+	};
+
+	/// a node of the compiled tree, one cache line each
+	struct alignas(64) FlatNode {
+		uint32_t firstChild = 0;
+		int32_t	 param = -1, wildcard = -1;
+		/// offset of the node's METHODS values in m_methodValues, -1 if it has none
+		int32_t	 values = -1;
+		Text	 name;
+		uint32_t textOffset = 0;
+		uint16_t prefixSize = 0;
+		uint16_t numChildren = 0;
+		char	 bytes[32];
+
+		bool inlined() const { return prefixSize + numChildren <= sizeof(bytes); }
+	};
+
+	Text addText(std::string_view s) {
+		Text t = {uint32_t(m_text.size()), uint32_t(s.size())};
+		m_text += s;
+		return t;
+	}
+
+	std::string_view text(Text t) const { return std::string_view(m_text.data() + t.offset, t.size); }
+
+	/// the prefix of a node, followed by the first bytes of its children
+	const char *bytes(const FlatNode &node) const {
+		return node.inlined() ? node.bytes : m_text.data() + node.textOffset;
+	}
+
+	int value(const FlatNode &node, std::size_t method) const {
+		return node.values < 0 ? -1 : m_methodValues[node.values + method];
+	}
+
+	uint32_t methodMask(const FlatNode &node) const {
+		uint32_t mask = 0;
+		for (std::size_t m = 0; m < METHODS; m++) {
+			if (value(node, m) >= 0) mask |= 1u << m;
+		}
+		return mask;
+	}
+
+	int match(const FlatNode &node, std::string_view path, std::size_t method, RouteParams &params,
+			  uint32_t &allowed) const {
+		if (path.empty()) {
+			int res = value(node, method);
+			if (res >= 0) return res;
+			allowed |= methodMask(node);
+		} else {
+			// most nodes have a handful of children, a plain loop beats calling memchr
+			const char *indices = bytes(node) + node.prefixSize;
+			std::size_t i		= 0;
+			while (i < node.numChildren && indices[i] != path[0]) ++i;
+			if (i < node.numChildren) {
+				const FlatNode	&child	= m_nodes[node.firstChild + i];
+				std::string_view prefix(bytes(child), child.prefixSize);
+				// the first byte is known to match
+				if (path.size() >= prefix.size() &&
+					std::memcmp(path.data() + 1, prefix.data() + 1, prefix.size() - 1) == 0) {
+					int res = match(child, path.substr(prefix.size()), method, params, allowed);
+					if (res >= 0) return res;
+				}
+			}
+
+			if (node.param >= 0 && path[0] != '/' && params.size < RouteParams::MAX_PARAMS) {
+				const FlatNode &param		= m_nodes[node.param];
+				std::size_t		end			= std::min(path.find('/'), path.size());
+				params.items[params.size++] = {text(param.name), path.substr(0, end)};
+				int res						= match(param, path.substr(end), method, params, allowed);
+				if (res >= 0) return res;
+				--params.size;
+			}
+		}
+
+		if (node.wildcard >= 0 && params.size < RouteParams::MAX_PARAMS) {
+			const FlatNode &wildcard = m_nodes[node.wildcard];
+			int				res		 = value(wildcard, method);
+			if (res >= 0) {
+				params.items[params.size++] = {text(wildcard.name), path};
+				return res;
+			}
+			allowed |= methodMask(wildcard);
+		}
+		return -1;
+	}
+
+	std::unique_ptr<Node> m_root;
+	std::vector<T>		  m_values;
+
+	std::vector<FlatNode> m_nodes;
+	std::string			  m_text;
+	std::vector<int32_t>  m_methodValues;
+};
@@ -1,7 +1,6 @@
 #pragma once
 
 #include <functional>
-#include <sstream>
 #include <string>
 #include <socket.hpp>
 #include <unordered_map>
@@ -9,14 +8,71 @@
 #include <fcntl.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
-#include <dirent.h>
 #include <stdio.h>
 
+#include "dir_listing.hpp"
+#include "file_cache.hpp"
+#include "http_parser.hpp"
+#include "request_body.hpp"
+#include "route_tree.hpp"
+#include "task.hpp"
 #include "utils.hpp"
 
+/**
+ * @brief What a route handler gets to know about the request it answers.
+ */
+struct Request {
+	const HTTPRequest &http;
+	const RouteParams &params;
+	RequestBody		  &body;
+	/// the body of a request to a coroutine STREAM route, which is read with read()
+	BodyReader *reader = nullptr;
+
+	/**
+	 * @brief The next piece of the body, see ReadAwaitable. The head is moved while the body is read, views into http
+	 * taken before a read are not valid after it.
+	 */
+	ReadAwaitable read() { return ReadAwaitable(*reader); }
+};
+
+/**
+ * @brief Where a coroutine handler writes its response. Writes are queued and sent as far as the socket takes them
+ * without blocking, co_await flush() waits for the rest.
+ */
+struct Response {
+	SocketStream &stream;
+
+	void status(int status, std::string_view msg) { stream.status(status, msg); }
+	void send(int status, std::string_view msg, std::string_view content_type, std::string_view content) {
+		stream.send(status, msg, content_type, content);
+	}
+	void send(const ResponseHead &head, std::string_view content = {}) { stream.send(head, content); }
+	DrainAwaitable flush() {
+		stream.flush();
+		return {};
+	}
+};
+
 class Router {
    public:
-	using Handler = std::function<void(SocketStream &, std::size_t)>;
+	/// reads the body of the given length from the stream itself
+	using Handler	   = std::function<void(SocketStream &, std::size_t)>;
+	using RouteHandler = std::function<void(SocketStream &, Request &)>;
+	/// creates the receiver of the body of a request to a STREAM route, before any of the body has been read
+	using StreamHandler = std::function<std::unique_ptr<BodyStream>(const HTTPRequest &, const RouteParams &)>;
+	/// a coroutine that runs on the I/O workers and suspends the connection, not the worker, while it waits
+	using TaskHandler = std::function<Task<>(Request &, Response &)>;
+
+	struct Route {
+		RouteHandler  handler;
+		StreamHandler stream;
+		BodyOptions	  body;
+		/// the handler, or the end of the body stream, runs on the server's compute pool
+		bool		async = false;
+		TaskHandler task;
+		/// index of the route in names(), set when it is added
+		std::size_t id = 0;
+	};
 
 	class RequestType {
 	   public:
@@ -24,12 +80,12 @@ class Router {
 
 		RequestType() = default;
 		RequestType(Value v) : value(v) {}
-		RequestType(const std::string &s) : value(fromString(s)) {}
+		RequestType(std::string_view s) : value(fromString(s)) {}
 		operator Value() const { return value; }
 
 		std::string toString() const { return toString(*this); }
 
-		static RequestType fromString(const std::string &s) {
+		static RequestType fromString(std::string_view s) {
 			if (s == "GET") return GET;
 			if (s == "HEAD") return HEAD;
 			if (s == "POST") return POST;
@@ -61,135 +117,336 @@ class Router {
 		Value value;
 	};
 
-	void addRoute(RequestType t, const std::string &path, const Handler &h) { map.insert({{path, t}, h}); }
+	/**
+	 * @brief Adds a route. A path may contain ":name" segments and end with a "*name" segment, their values are
+	 * passed to handlers that take a Request. Routes have to be added before the server starts listening.
+	 */
+	void addRoute(RequestType t, const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		insert(t, path, Route{h, nullptr, body, false, nullptr});
+	}
+	void addRoute(RequestType t, const std::string &path, const Handler &h) {
+		addRoute(t, path, [h](SocketStream &s, Request &request) {
+			s.getBuffer().beginMessage(request.body.data());
+			h(s, request.body.size());
+			s.getBuffer().endMessage();
+		});
+	}
+
+	/**
+	 * @brief Adds a route that receives its request bodies while they arrive.
+	 */
+	void addStream(RequestType t, const std::string &path, const StreamHandler &h, BodyOptions body = {}) {
+		body.mode = BodyOptions::STREAM;
+		insert(t, path, Route{nullptr, h, body, false, nullptr});
+	}
+
+	/**
+	 * @brief Adds a route whose handler runs on the server's compute pool instead of an I/O worker, for handlers that
+	 * keep a core busy for a while. The connection waits meanwhile. The handler writes to a stream that is not
+	 * connected to the socket, its output is sent once the handler has returned.
+	 */
+	void addAsync(RequestType t, const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		insert(t, path, Route{h, nullptr, body, true, nullptr});
+	}
+
+	/**
+	 * @brief Like addStream(), but BodyStream::end() runs on the compute pool like the handler of an addAsync() route.
+	 * The body is still passed to the stream on the I/O worker while it arrives.
+	 */
+	void addAsyncStream(RequestType t, const std::string &path, const StreamHandler &h, BodyOptions body = {}) {
+		body.mode = BodyOptions::STREAM;
+		insert(t, path, Route{nullptr, h, body, true, nullptr});
+	}
+
+	/**
+	 * @brief Adds a route whose handler is a coroutine. The request body is read before it starts, like for
+	 * addRoute(). Whenever it co_awaits a timer (sleepFor()), a job on the compute pool (offload()) or the socket
+	 * (Response::flush()), the connection is parked and the worker moves on to other connections.
+	 */
+	void addTask(RequestType t, const std::string &path, const TaskHandler &h, const BodyOptions &body = {}) {
+		insert(t, path, Route{nullptr, nullptr, body, false, h});
+	}
+
+	/**
+	 * @brief Like addTask(), but the handler starts once the head has arrived and reads the body itself with
+	 * co_await request.read(), a piece at a time while it arrives. The body is not received faster than it is read.
+	 */
+	void addTaskStream(RequestType t, const std::string &path, const TaskHandler &h, BodyOptions body = {}) {
+		body.mode = BodyOptions::STREAM;
+		insert(t, path, Route{nullptr, nullptr, body, false, h});
+	}
 
 	void get(const std::string &path, const Handler &h) { addRoute(RequestType::GET, path, h); }
 	void post(const std::string &path, const Handler &h) { addRoute(RequestType::POST, path, h); }
 	void put(const std::string &path, const Handler &h) { addRoute(RequestType::PUT, path, h); }
 	void del(const std::string &path, const Handler &h) { addRoute(RequestType::DELETE, path, h); }
 
-	void serve(const std::string &web_path, const std::string &path) { served.insert({web_path, path}); }
+	void get(const std::string &path, const RouteHandler &h) { addRoute(RequestType::GET, path, h); }
+	void post(const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		addRoute(RequestType::POST, path, h, body);
+	}
+	void put(const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		addRoute(RequestType::PUT, path, h, body);
+	}
+	void del(const std::string &path, const RouteHandler &h) { addRoute(RequestType::DELETE, path, h); }
 
-	void handleRequest(RequestType t, std::string &path, SocketStream &s, std::size_t body_length) {
-		std::size_t i = path.size() - 1;
+	void get(const std::string &path, const TaskHandler &h) { addTask(RequestType::GET, path, h); }
+	void post(const std::string &path, const TaskHandler &h, const BodyOptions &body = {}) {
+		addTask(RequestType::POST, path, h, body);
+	}
+	void put(const std::string &path, const TaskHandler &h, const BodyOptions &body = {}) {
+		addTask(RequestType::PUT, path, h, body);
+	}
+	void del(const std::string &path, const TaskHandler &h) { addTask(RequestType::DELETE, path, h); }
 
-		auto handler = map.find({path, t});
-		if (handler != map.end()) {
-			handler->second(s, body_length);
-			return;
-		}
+	void get_async(const std::string &path, const RouteHandler &h) { addAsync(RequestType::GET, path, h); }
+	void post_async(const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		addAsync(RequestType::POST, path, h, body);
+	}
+	void put_async(const std::string &path, const RouteHandler &h, const BodyOptions &body = {}) {
+		addAsync(RequestType::PUT, path, h, body);
+	}
 
-		bool match = false;
+	/**
+	 * @brief Serves the files of a local directory (relative to the working directory) under web_path. If web_path
+	 * does not end with '/', only that exact path is served.
+	 */
+	void serve(const std::string &web_path, const std::string &path) {
+		served.insert({web_path, path});
+
+		std::string	 pattern = web_path.ends_with('/') ? web_path + "*file" : web_path;
+		RouteHandler handler = [this, path](SocketStream &s, Request &request) {
+			handleFileRequest(s, path, std::string(request.params["file"]), request.http);
+		};
+		addRoute(RequestType::GET, pattern, handler);
+		addRoute(RequestType::HEAD, pattern, handler);
+	}
 
-		do {
-			std::string_view v = std::string_view(path).substr(0, i + 1);
+	/**
+	 * @brief Prepares the routes for lookups. Called by the server before it starts listening.
+	 */
+	void compile() { routes.compile(); }
+
+	/// The method and pattern of every route, in the order they were added.
+	const std::vector<std::string> &names() const { return routeNames; }
+
+	/**
+	 * @brief Keeps served files in memory, using at most the given number of bytes. 0 disables the cache.
+	 */
+	void			 enableCache(std::size_t budget) { cache.setBudget(budget); }
+	FileCache::Stats cacheStats() const { return cache.stats(); }
+
+	/**
+	 * @brief Compresses cached text files with gzip for clients that accept it. Precompressed ".gz" siblings are
+	 * served either way.
+	 */
+	void enableCompression(bool enable = true) { cache.compress = enable; }
+
+	/**
+	 * @brief Keeps the listings of served directories in memory, using at most the given number of bytes. 0 reads the
+	 * directory for every listing.
+	 */
+	void				   enableListingCache(std::size_t budget) { listings.setBudget(budget); }
+	DirListingCache::Stats listingStats() const { return listings.stats(); }
+
+	/**
+	 * @brief Loads the files served under web_path into the cache ahead of the first request for them, compressing
+	 * them if compression is enabled.
+	 *
+	 * @return the number of files with a gzip variant
+	 */
+	std::size_t precompress(const std::string &web_path) {
+		auto j = served.find(web_path);
+		if (j == served.end() || !cache.enabled()) return 0;
+		return cache.warm('.' + j->second);
+	}
 
-			auto j = served.find(v);
-			if (j != served.end()) {
-				handleFileRequest(s, j->second, path.substr(i + 1));
-				match = true;
-				break;
-			}
+	/**
+	 * @brief Finds the route for a request.
+	 *
+	 * @param allowed if there is none, receives a bit for each method the path has a route for
+	 */
+	const Route *match(const HTTPRequest &request, RouteParams &params, uint32_t &allowed) const {
+		return routes.find(RequestType::fromString(request.method), request.path, params, allowed);
+	}
 
-		} while ((i = path.rfind('/', std::max(i - 1, 0ul))) != std::string::npos);
+	/**
+	 * @brief Answers a request to a route that is not a STREAM route, once its body has been read.
+	 */
+	void handleRequest(const HTTPRequest &request, RequestBody &body, SocketStream &s) {
+		RouteParams	 params;
+		uint32_t	 allowed;
+		const Route *route = match(request, params, allowed);
+		if (route && route->handler) {
+			Request r{request, params, body};
+			route->handler(s, r);
+			return;
+		}
 
-		if (!match) {
-			renderStatus(s, 404, "Not Found");
+		if (allowed) {
+			std::string methods;
+			for (uint8_t t = RequestType::GET; t <= RequestType::PATCH; t++) {
+				if (!(allowed & (1u << t))) continue;
+				if (!methods.empty()) methods += ", ";
+				methods += RequestType::toString(RequestType::Value(t));
+			}
+			ResponseHead head(405);
+			head.header(ResponseHead::ALLOW, methods).header(ResponseHead::CONTENT_LENGTH, 0);
+			s.send(head);
 			return;
 		}
+		renderStatus(s, 404, "Not Found", &request);
 	}
 
-	void renderStatus(SocketStream &ss, int status, const std::string &msg) {
-		int res = sendFile(ss, "./fixed/" + std::to_string(status) + ".html", status, msg);
+	void renderStatus(SocketStream &ss, int status, const std::string &msg, const HTTPRequest *request = nullptr) {
+		int res = sendFile(ss, "./fixed/" + std::to_string(status) + ".html", status, msg, request);
 		if (res) ss.status(status, msg);
 	}
 
    private:
-	int serveDirList(SocketStream &ss, const std::string &path) {
-		DIR			  *d;
-		struct dirent *file;
-		d = opendir(path.c_str());
-		if (!d) {
+	void insert(RequestType t, const std::string &path, Route route) {
+		route.id = routeNames.size();
+		routeNames.push_back(t.toString() + " " + path);
+		routes.insert(t, path, std::move(route));
+	}
+
+	/**
+	 * @brief Sends the listing of a directory, as HTML or JSON, sorted or not and whole or a page of it depending on
+	 * the query of the request, see DirListingCache::Query.
+	 */
+	int serveDirList(SocketStream &ss, const std::string &path, const HTTPRequest &request) {
+		DirListingCache::Query		 query	 = DirListingCache::Query::parse(request.query);
+		DirListingCache::Listing_ptr listing = listings.get(path, query.format);
+		if (!listing) {
 			dbLog(dbg::LOG_ERROR, "cannot open dir: ", path, " : ", strerror(errno));
 			return 1;
 		}
 
-		std::stringstream list;
+		// the whole listing is kept rendered and sent as it is
+		std::string		 page;
+		std::string_view body = listing->body;
+		if (!query.whole()) body = page = DirListingCache::render(*listing, query);
+
+		ResponseHead head(200);
+		head.header(ResponseHead::CONTENT_TYPE, DirListingCache::contentType(query.format))
+			.header(ResponseHead::CONTENT_LENGTH, body.size());
+		if (request.method == "HEAD") ss.send(head);
+		else if (page.empty()) ss.send(head, body, listing);
+		else ss.send(head, body);
+		return 0;
+	}
+
+	/**
+	 * @brief Sends a file. When the request for it is given, its conditional (If-None-Match, If-Modified-Since),
+	 * Range and Accept-Encoding headers are honoured.
+	 */
+	int sendFile(SocketStream &ss, const std::string &path, int status = 200, const std::string_view &msg = "OK",
+				 const HTTPRequest *request = nullptr) {
+		FileCache::Entry_ptr entry;
+		bool				 gzip = request && acceptsEncoding(request->header("Accept-Encoding"), "gzip");
+		if (gzip) entry = openFile(path, status, msg, FileCache::GZIP);
+		if (!entry) {
+			gzip  = false;
+			entry = openFile(path, status, msg, FileCache::IDENTITY);
+		}
+		if (!entry) return 1;
+
+		SocketBuffer &buffer = ss.getBuffer();
+		bool		  head	 = request && request->method == "HEAD";
+
+		if (request && status == 200) {
+			if (notModified(*request, *entry)) {
+				ResponseHead head(304);
+				head.header(ResponseHead::ETAG, entry->etag).header(ResponseHead::LAST_MODIFIED, entry->lastModified);
+				if (entry->vary) head.header(ResponseHead::VARY, "Accept-Encoding");
+				ss.send(head);
+				return 0;
+			}
+
+			std::string_view  rangeHeader = request->header("Range"), ifRange = request->header("If-Range");
+			ByteRange		  range;
+			ByteRange::Result res = ByteRange::NONE;
+			// a Range is only honoured for the representation the client already has part of
+			if (!rangeHeader.empty() && (ifRange.empty() || ifRange == entry->etag || ifRange == entry->lastModified)) {
+				res = ByteRange::parse(rangeHeader, entry->size, range);
+			}
 
-		if (d) {
-			while ((file = readdir(d)) != NULL) {
-				std::string name = file->d_name;
-				if (file->d_type == DT_DIR) {
-					list << "<a href = \"./" << name << "/\">" << name << "/</a><br>";
-				} else if (file->d_type == DT_REG) {
-					list << "<a href = \"./" << name << "\">" << name << "</a><br>";
+			if (res == ByteRange::UNSATISFIABLE) {
+				ResponseHead head(416);
+				head.header(ResponseHead::CONTENT_RANGE, "bytes */", entry->size).header(ResponseHead::CONTENT_LENGTH, 0);
+				ss.send(head);
+				return 0;
+			}
+			if (res == ByteRange::SATISFIABLE) {
+				ResponseHead partial(206);
+				partial.header(ResponseHead::CONTENT_TYPE, mimeType(path).contentType)
+					.header(ResponseHead::CONTENT_RANGE, "bytes ", range.first, '-', range.last, '/', entry->size)
+					.header(ResponseHead::CONTENT_LENGTH, range.length());
+				if (gzip) partial.header(ResponseHead::CONTENT_ENCODING, "gzip");
+				if (entry->vary) partial.header(ResponseHead::VARY, "Accept-Encoding");
+				partial.header(ResponseHead::ETAG, entry->etag)
+					.header(ResponseHead::LAST_MODIFIED, entry->lastModified)
+					.header(ResponseHead::ACCEPT_RANGES, "bytes");
+				if (head) {
+					ss.send(partial);
+				} else if (entry->fd >= 0) {
+					buffer.writeResponse(partial.view());
+					buffer.sendFile(entry->fd, range.first, range.length(), entry);
+					ss.flush();
 				} else {
-					list << name << "<br>";
+					ss.send(partial, entry->body().substr(range.first, range.length()), entry);
 				}
+				return 0;
 			}
-			closedir(d);
 		}
 
-		ss.send(200, "OK", "text/html", list);
+		if (head) {
+			buffer.write(std::string_view(entry->response).substr(0, entry->headSize), entry);
+		} else {
+			buffer.write(entry->response, entry);
+			if (entry->fd >= 0) buffer.sendFile(entry->fd, 0, entry->size, entry);
+		}
+		ss.flush();
 		return 0;
 	}
 
-	int sendFile(SocketStream &ss, const std::string &path, int status = 200, const std::string_view &msg = "OK") {
-		int fd = open(path.c_str(), O_RDONLY);
-		if (fd < 0) { return 1; }
+	FileCache::Entry_ptr openFile(const std::string &path, int status, std::string_view msg,
+								  FileCache::Encoding encoding) {
+		return cache.enabled() ? cache.get(path, status, msg, encoding) : FileCache::open(path, status, msg, encoding);
+	}
 
-		struct stat statbuf;
-		fstat(fd, &statbuf);
-		if (S_ISDIR(statbuf.st_mode)) {
-			close(fd);
-			return 1;
-		}
+	static bool notModified(const HTTPRequest &request, const FileCache::Entry &entry) {
+		if (request.method != "GET" && request.method != "HEAD") return false;
 
-		ss << "HTTP/1.1 " << status << " " << msg
-		   << "\r\n"
-			  "Content-Type: ";
-
-		if (path.ends_with(".html")) ss << "text/html";
-		else if (path.ends_with(".css")) ss << "text/css";
-		else if (path.ends_with(".js")) ss << "text/javascript";
-		else if (path.ends_with(".png")) ss << "image/png";
-		else if (path.ends_with(".jpg")) ss << "image/jpeg";
-		else if (path.ends_with(".jpeg")) ss << "image/jpeg";
-		else if (path.ends_with(".gif")) ss << "image/gif";
-		else if (path.ends_with(".svg")) ss << "image/svg+xml";
-		else if (path.ends_with(".ico")) ss << "image/x-icon";
-		else if (path.ends_with(".json")) ss << "application/json";
-		else ss << "text/plain";
-
-		ss << ";charset=utf-8\r\n"
-			  "Content-Length: "
-		   << statbuf.st_size << "\r\n\r\n"
-		   << std::flush;
-
-		int res = 1;
-		while (res > 0) {
-			res = sendfile(ss.getSocket(), fd, 0, 409600);
-		}
-		close(fd);
-		return 0;
+		// If-None-Match takes precedence over If-Modified-Since (RFC 9110 13.2.2)
+		std::string_view noneMatch = request.header("If-None-Match");
+		if (!noneMatch.empty()) return etagMatches(noneMatch, entry.etag);
+
+		std::string_view modifiedSince = request.header("If-Modified-Since");
+		time_t			 since;
+		return !modifiedSince.empty() && parseHTTPDate(modifiedSince, since) && entry.mtime.tv_sec <= since;
 	}
 
-	void handleFileRequest(SocketStream &ss, const std::string &cwd, const std::string &path) {
+	void handleFileRequest(SocketStream &ss, const std::string &cwd, const std::string &path,
+						   const HTTPRequest &request) {
 		std::string local_path = '.' + cwd +"/"+ path;
 
 		if (path == "" || path.back() == '/') {
-			int res = sendFile(ss, local_path + "/index.html");
-			if (res) { res = serveDirList(ss, local_path); }
-			if (res) { renderStatus(ss, 404, "Not Found"); }
+			int res = sendFile(ss, local_path + "/index.html", 200, "OK", &request);
+			if (res) { res = serveDirList(ss, local_path, request); }
+			if (res) { renderStatus(ss, 404, "Not Found", &request); }
 			return;
 		}
 
-		int res = sendFile(ss, local_path);
-		if (res) { renderStatus(ss, 404, "Not Found"); }
+		int res = sendFile(ss, local_path, 200, "OK", &request);
+		if (res) { renderStatus(ss, 404, "Not Found", &request); }
 	}
 
-	std::unordered_map<std::pair<std::string, RequestType>, Handler>					  map;
+	RouteTree<Route>																	  routes;
+	std::vector<std::string>															  routeNames;
 	std::unordered_map<std::string, std::string, std::hash<std::string>, std::equal_to<>> served;
+	FileCache																			  cache;
+	DirListingCache																		  listings;
 };
 
 template <>
@@ -2,24 +2,153 @@
 #include <charconv>
 #include <csignal>
 #include <cstring>
+#include <strings.h>
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
 #include <server.hpp>
 #include <socket.hpp>
-#include <sstream>
 #include <thread>
 #include "router.hpp"
 #include "utils.hpp"
 
 static void signalHandler(int sig) { dbLog(dbg::LOG_WARNING, "Caught signal: ", sig); }
 
-TCPServer::TCPServer(const std::string &ip, short port, int threads) {
+// size of the submission queue and the provided receive buffers of a worker's io_uring
+static constexpr unsigned int URING_ENTRIES		= 1024;
+static constexpr unsigned int URING_BUFFERS		= 256;
+static constexpr std::size_t  URING_BUFFER_SIZE = 16 * 1024;
+
+/// user_data of the operations a worker submits for itself, those of a socket carry its address instead
+enum UringEvent : uint64_t { URING_ACCEPT = 1, URING_WAKE, URING_RESUME, URING_TIMER, URING_TICK };
+
+/**
+ * @brief The io_uring socket of a connection, which tells the worker what connection its completions are for.
+ */
+struct TCPServer::UringClient : UringSocket {
+	UringClient(IOUring &ring, int fd, Connections::Ref client) : UringSocket(ring, fd), client(client) {}
+
+	Connections::Ref client;
+};
+
+TCPServer::Shard::Shard(const sockaddr_in6 &address, bool reusePort) {
+	// the destructor does not run for a constructor that throws, so whatever has been opened is closed here
+	auto fail = [this](const char *what) {
+		std::string message = std::string(what) + ": " + strerror(errno);
+		for (int fd : {tickFD, timerFD, resumeFD, wakeFD, epollFD, socket}) {
+			if (fd >= 0) close(fd);
+		}
+		throw std::runtime_error(message);
+	};
+
+	socket = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (socket < 0) { throw std::runtime_error("failed to initialize socket"); }
+
+	int on = 1;
+	setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	if (reusePort && setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) fail("cannot set SO_REUSEPORT");
+	if (bind(socket, (const sockaddr *)&address, sizeof(address)) < 0) fail("cannot bind");
+
+	epollFD = epoll_create1(0);
+	if (epollFD < 0) fail("cannot create epoll");
+
+	// written once on shutdown and never read, so it stays readable and wakes every worker waiting on this shard
+	wakeFD = eventfd(0, EFD_NONBLOCK);
+	if (wakeFD < 0) fail("cannot create eventfd");
+
+	// written by resume() and drained by the worker that handles the resumed connections
+	resumeFD = eventfd(0, EFD_NONBLOCK);
+	if (resumeFD < 0) fail("cannot create eventfd");
+
+	// armed for the earliest resumeAt() of the shard
+	timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (timerFD < 0) fail("cannot create timerfd");
+
+	// ticks the timeout wheel while it holds any timer
+	tickFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (tickFD < 0) fail("cannot create timerfd");
+
+	// events carry a pointer, to the client's slot or to the member holding one of these descriptors
+	epoll_event event;
+	event.events   = EPOLLIN;	  // | EPOLLET;
+	event.data.ptr = &socket;
+	if (epoll_ctl(epollFD, EPOLL_CTL_ADD, socket, &event) < 0) fail("cannot add socket to epoll");
+
+	for (int *fd : {&wakeFD, &resumeFD, &timerFD, &tickFD}) {
+		event.events   = EPOLLIN;
+		event.data.ptr = fd;
+		if (epoll_ctl(epollFD, EPOLL_CTL_ADD, *fd, &event) < 0) fail("cannot add eventfd to epoll");
+	}
+}
+
+TCPServer::Shard::~Shard() {
+	close(socket);
+	close(wakeFD);
+	close(resumeFD);
+	close(timerFD);
+	close(tickFD);
+	close(epollFD);
+}
+
+static void armTimer(int timerFD, std::chrono::steady_clock::time_point when) {
+	// steady_clock is CLOCK_MONOTONIC, a zero expiry would disarm the timer instead
+	auto			  ns   = std::max<int64_t>(std::chrono::nanoseconds(when.time_since_epoch()).count(), 1);
+	itimerspec		  spec = {};
+	spec.it_value.tv_sec   = ns / 1000000000;
+	spec.it_value.tv_nsec  = ns % 1000000000;
+	if (timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+		dbLog(dbg::LOG_ERROR, "cannot arm timer: ", strerror(errno));
+	}
+}
+
+/**
+ * @brief Logs a failed accept at most once a second per worker, a worker that runs out of descriptors would otherwise
+ * log every retry.
+ */
+static void logAcceptFailure(int error) {
+	static thread_local std::chrono::steady_clock::time_point last;
+	static thread_local uint64_t								suppressed = 0;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - last < std::chrono::seconds(1)) {
+		suppressed++;
+		return;
+	}
+	if (suppressed) {
+		dbLog(dbg::LOG_ERROR, "Failed to accept connection: ", strerror(error), " (", suppressed,
+			  " more failures since the last report)");
+	} else {
+		dbLog(dbg::LOG_ERROR, "Failed to accept connection: ", strerror(error));
+	}
+	last	   = now;
+	suppressed = 0;
+}
+
+static uint64_t timeoutTick(std::chrono::steady_clock::time_point t) {
+	return t.time_since_epoch() / TCPServer::TIMEOUT_TICK;
+}
+
+static void setTicking(int tickFD, bool ticking) {
+	itimerspec spec = {};
+	if (ticking) {
+		int64_t ns				 = std::chrono::nanoseconds(TCPServer::TIMEOUT_TICK).count();
+		spec.it_interval.tv_sec	 = ns / 1000000000;
+		spec.it_interval.tv_nsec = ns % 1000000000;
+		spec.it_value			 = spec.it_interval;
+	}
+	if (timerfd_settime(tickFD, 0, &spec, nullptr) < 0) {
+		dbLog(dbg::LOG_ERROR, "cannot set timeout tick: ", strerror(errno));
+	}
+}
+
+TCPServer::TCPServer(const std::string &ip, short port, int threads, bool sharded) {
 	m_numThreads = threads;
-	m_socket	 = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
-	if (m_socket < 0) { throw std::runtime_error("failed to initialize socket"); }
+	m_sharded	 = sharded;
 
 	m_address.sin6_family = AF_INET6;
 	inet_pton(AF_INET6, ip.c_str(), &m_address.sin6_addr);
@@ -27,198 +156,1194 @@ TCPServer::TCPServer(const std::string &ip, short port, int threads) {
 	m_address.sin6_flowinfo = 0;
 	m_address.sin6_scope_id = 0;
 
-	int on = 1;
-	setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-
-	int res;
-	res = bind(m_socket, (struct sockaddr *)&m_address, sizeof(m_address));
-	if (res < 0) { throw std::runtime_error(std::string("cannot bind: ") + strerror(errno)); }
-
-	m_epollFD = epoll_create1(0);
-	if (m_epollFD < 0) { throw std::runtime_error(std::string("cannot create epoll: ") + strerror(errno)); }
-
-	epoll_event event;
-	event.events  = EPOLLIN;	 // | EPOLLET;
-	event.data.fd = m_socket;
-	if (epoll_ctl(m_epollFD, EPOLL_CTL_ADD, m_socket, &event) < 0) {
-		throw std::runtime_error(std::string("cannot add socket to epoll: ") + strerror(errno));
-		close(m_epollFD);
+	unsigned int numShards = m_sharded ? m_numThreads : 1;
+	for (unsigned int i = 0; i < numShards; i++) {
+		m_shards.emplace_back(std::make_unique<Shard>(m_address, m_sharded));
 	}
+
 	if (signal(SIGPIPE, signalHandler) == SIG_ERR) {
 		throw std::runtime_error(std::string("cannot ignore SIGPIPE: ") + strerror(errno));
 	}
 }
 
-void TCPServer::listen() {
-	if (::listen(m_socket, 10) < 0) { throw std::runtime_error(std::string("cannot listen: ") + strerror(errno)); }
+std::unique_lock<std::mutex> TCPServer::lockShard(Shard &shard) {
+	// a shard that belongs to a single worker is never touched by another thread
+	if (m_sharded) return std::unique_lock<std::mutex>(shard.mutex, std::defer_lock);
+	return std::unique_lock<std::mutex>(shard.mutex);
+}
 
-	dbLog(dbg::LOG_INFO, "Listening on ", m_address);
+void TCPServer::worker(int id, Shard &shard) {
+	// set signal mask to ignore SIGPIPE
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGPIPE);
+	if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+		throw std::runtime_error(std::string("cannot set signal mask: ") + strerror(errno));
+	}
+	if (m_backend == Backend::IO_URING) return uringWorker(id, shard);
 
-	auto remove = [this](auto it) {
-		epoll_event event;
-		event.data.fd = it->second->socket;
-		epoll_ctl(m_epollFD, EPOLL_CTL_DEL, int(it->second->socket), &event);
+	std::vector<epoll_event> events(m_batchSize);
+	WorkerStats				&stats = m_stats[id];
+	t_stats							= &stats;
 
-		m_clients.erase(it);
-	};
+	while (m_running.test()) {
+		// wait for client interaction or new connection
+		stats.busy.store(false, std::memory_order_relaxed);
+		int numEvents = epoll_wait(shard.epollFD, events.data(), events.size(), -1);
+		stats.busy.store(true, std::memory_order_relaxed);
+		if (numEvents == -1) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+		}
+		addRelaxed(stats.wakeups);
+		addRelaxed(stats.events, numEvents);
+
+		for (int i = 0; i < numEvents; i++) {
+			if (events[i].data.ptr == &shard.wakeFD) continue;
+			if (events[i].data.ptr == &shard.resumeFD) {
+				resumeClients(shard);
+				continue;
+			}
+			if (events[i].data.ptr == &shard.timerFD) {
+				expireTimers(shard);
+				continue;
+			}
+			if (events[i].data.ptr == &shard.tickFD) {
+				expireTimeouts(shard);
+				continue;
+			}
+			handleEvent(shard, events[i]);
+		}
+	}
+	dbLog(dbg::LOG_DEBUG, "Worker thread ", id, " stopped.");
+}
 
-	auto worker = [this, remove](int id) {
-		// set signal mask to ignore SIGPIPE
-		sigset_t mask;
-		sigemptyset(&mask);
-		sigaddset(&mask, SIGPIPE);
-		if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
-			throw std::runtime_error(std::string("cannot set signal mask: ") + strerror(errno));
-		}
-
-		epoll_event event;
-		while (m_running.test()) {
-			// wait for client interaction or new connection
-			m_occup[id].store(0);
-			int numEvents = epoll_wait(m_epollFD, &event, 1, 1000);
-			m_occup[id].store(1);
-			if (numEvents == -1) {
-				throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+void TCPServer::handleEvent(Shard &shard, const epoll_event &event) {
+	if (event.data.ptr == &shard.socket) {
+		// Accept new client connections
+		for (;;) {
+			sockaddr_in6 client;
+			socklen_t	 clilen = sizeof(client);
+
+			Socket socket = accept4(shard.socket, (sockaddr *)&client, &clilen, SOCK_NONBLOCK);
+			if (socket < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+			if (socket < 0 && (errno == EINTR || errno == ECONNABORTED)) continue;
+			if (socket < 0) {
+				// out of descriptors or memory, the connections stay queued until a client closes or the next tick
+				logAcceptFailure(errno);
+				pauseAccept(shard);
 				break;
 			}
-			if (!numEvents) continue;
-			// dbLog(dbg::LOG_DEBUG, "Worker thread ", id, " got event.");
+			socket.setAddr(client);
+			int sock_fd = int(socket);
 
-			// Client disconnected
-			if (event.events & EPOLLRDHUP) {
-				std::lock_guard lock(m_mutex);
-				auto			it = m_clients.find(event.data.fd);
-				if (it != m_clients.end()) {
-					dbLog(dbg::LOG_DEBUG, "Client ", it->second->socket.getAddr(), " disconnected.");
-					remove(it);
-				}
+			// the new connection is owned by this thread until it is in epoll, events of a previous connection with
+			// the same descriptor that are still being dispatched leave it alone meanwhile
+			Connections::Ref ref = openClient(shard, std::move(socket));
+			if (!ref) continue;
+
+			// Add client socket to epoll
+			epoll_event clientEvent;
+			clientEvent.events	 = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+			clientEvent.data.ptr = ref.slot;
+			if (epoll_ctl(shard.epollFD, EPOLL_CTL_ADD, sock_fd, &clientEvent) == -1) {
+				dbLog(dbg::LOG_ERROR, "Failed to add client socket to epoll instance: ", strerror(errno));
+				closeClient(shard, *ref.slot);
 				continue;
 			}
+			uint32_t seen = 1;
+			if (!Connections::leave(*ref.slot, seen)) serveClient(shard, *ref.slot, seen);
+		}
 
-			if (event.data.fd == m_socket) {
-				// Accept new client connection
-				sockaddr_in6 client;
-				socklen_t	 clilen = sizeof(client);
+	} else {
+		// Handle client request
+		Connections::Slot &slot = *static_cast<Connections::Slot *>(event.data.ptr);
+		if (Connections::enter(slot)) serveClient(shard, slot, slot.events());
+	}
+}
 
-				Socket socket = accept4(m_socket, (sockaddr *)&client, &clilen, SOCK_NONBLOCK);
-				if (socket < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
-				if (socket < 0) { throw std::runtime_error(std::strerror(errno)); }
-				socket.setAddr(client);
+void TCPServer::pauseAccept(Shard &shard) {
+	auto lock = lockShard(shard);
+	if (shard.acceptPaused.load(std::memory_order_relaxed)) return;
+	shard.acceptPaused.store(true, std::memory_order_relaxed);
+	// with io_uring the multishot accept has ended and is simply not armed again
+	if (m_backend == Backend::EPOLL) {
+		epoll_event event = {};
+		event.data.ptr	  = &shard.socket;
+		epoll_ctl(shard.epollFD, EPOLL_CTL_MOD, shard.socket, &event);
+	}
+	// the next tick tries again even if no connection closes
+	setTicking(shard.tickFD, true);
+}
 
-				// Add client socket to epoll
-				event.events  = EPOLLIN | EPOLLRDHUP | EPOLLET;
-				event.data.fd = socket;
-				if (epoll_ctl(m_epollFD, EPOLL_CTL_ADD, socket, &event) == -1) {
-					dbLog(dbg::LOG_ERROR, "Failed to add client socket to epoll instance: ", strerror(errno));
-					close(socket);
-					continue;
-				}
+void TCPServer::resumeAccept(Shard &shard) {
+	if (!shard.acceptPaused.load(std::memory_order_relaxed)) return;
+	auto lock = lockShard(shard);
+	if (!shard.acceptPaused.load(std::memory_order_relaxed)) return;
+	shard.acceptPaused.store(false, std::memory_order_relaxed);
+	if (m_backend == Backend::IO_URING) {
+		if (m_running.test()) armUring(shard, URING_ACCEPT);
+		return;
+	}
+	// level-triggered, the connections that queued up meanwhile are reported right away
+	epoll_event event = {};
+	event.events	  = EPOLLIN;
+	event.data.ptr	  = &shard.socket;
+	epoll_ctl(shard.epollFD, EPOLL_CTL_MOD, shard.socket, &event);
+}
 
-				// Add client to client list
-				std::shared_ptr<ClientData> clientData = nullptr;
-				{
-					std::lock_guard lock(m_mutex);
-					int				sock_fd = int(socket);
-					auto [it, inserted] =
-						m_clients.emplace(int(socket), std::make_shared<ClientData>(std::move(socket)));
-					if (!inserted) {
-						dbLog(dbg::LOG_ERROR, "Failed to add client to client list: ", strerror(errno));
-						close(sock_fd);
-						continue;
-					}
-					clientData = it->second;
-					dbLog(dbg::LOG_DEBUG, "Accepted new client connection from ", it->second->socket.getAddr());
-				}
+TCPServer::Connections::Ref TCPServer::openClient(Shard &shard, Socket &&socket) {
+	int				 sock_fd = int(socket);
+	Connections::Ref ref	 = shard.clients.open(sock_fd, std::move(socket), createContext(), m_bufferSize);
+	if (!ref) {
+		dbLog(dbg::LOG_ERROR, "Failed to add client to client list: descriptor ", sock_fd, " out of range");
+		return ref;
+	}
+	ClientData &clientData = **ref.slot;
+	if (Context *context = clientData.context.get()) {
+		context->connection.shard  = &shard;
+		context->connection.client = ref;
+		context->timeout.owner	   = context;
+	}
+	++shard.numClients;
+	addRelaxed(t_stats->accepted);
+	dbLog(dbg::LOG_DEBUG, "Accepted new client connection from ", clientData.socket.getAddr());
+	return ref;
+}
 
-			} else {
-				// Handle client request
-				std::shared_ptr<ClientData> clientData = nullptr;
-				{
-					std::lock_guard lock(m_mutex);
-					// Handle client request
-					auto it = m_clients.find(event.data.fd);
-					if (it == m_clients.end()) {
-						int fd = event.data.fd;
-						epoll_ctl(m_epollFD, EPOLL_CTL_DEL, fd, &event);
-						continue;
-					}
-					clientData = it->second;
-				}
+void TCPServer::uringWorker(int id, Shard &shard) {
+	IOUring &ring = *shard.ring;
+	if (!ring.enable()) throw std::runtime_error(std::string("cannot enable io_uring: ") + strerror(errno));
+	for (uint64_t what : {URING_ACCEPT, URING_WAKE, URING_RESUME, URING_TIMER, URING_TICK}) {
+		armUring(shard, what);
+	}
 
-				int k = 0;
-				if (clientData->lock.compare_exchange_strong(k, 1)) {
-					clientData->stream.clear();
-					while (clientData->lock.exchange(!!clientData->stream)) {
-						handleRequest(clientData->stream);
-					}
+	WorkerStats &stats = m_stats[id];
+	t_stats			   = &stats;
+	while (m_running.test()) {
+		// everything the previous completions queued goes to the kernel with the same call that waits for the next
+		stats.busy.store(false, std::memory_order_relaxed);
+		if (!ring.submit(1)) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+			throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+		}
+		stats.busy.store(true, std::memory_order_relaxed);
+		unsigned int numEvents = ring.complete([&](const io_uring_cqe &cqe) { handleCompletion(shard, cqe); });
+
+		addRelaxed(stats.wakeups);
+		addRelaxed(stats.events, numEvents);
+	}
+	dbLog(dbg::LOG_DEBUG, "Worker thread ", id, " stopped.");
+}
+
+void TCPServer::armUring(Shard &shard, uint64_t what) {
+	io_uring_sqe *sqe = shard.ring->sqe();
+	sqe->user_data	  = what;
+	if (what == URING_ACCEPT) {
+		sqe->opcode		  = IORING_OP_ACCEPT;
+		sqe->fd			  = shard.socket;
+		sqe->ioprio		  = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK;
+		return;
+	}
+	// the eventfds and timerfds are watched like with epoll and read by the same functions
+	int fds[]		   = {-1, -1, shard.wakeFD, shard.resumeFD, shard.timerFD, shard.tickFD};
+	sqe->opcode		   = IORING_OP_POLL_ADD;
+	sqe->fd			   = fds[what];
+	sqe->poll32_events = POLLIN;
+	sqe->len		   = IORING_POLL_ADD_MULTI;
+}
+
+void TCPServer::handleCompletion(Shard &shard, const io_uring_cqe &cqe) {
+	if (UringSocket::owns(cqe.user_data)) {
+		UringClient *client = static_cast<UringClient *>(UringSocket::owner(cqe.user_data));
+		bool		 ready	= client->complete(cqe);
+		// a closed connection's socket goes away with its last operation
+		if (client->finished()) delete client;
+		else if (ready && Connections::enter(client->client)) {
+			serveClient(shard, *client->client.slot, client->client.slot->events());
+		}
+		return;
+	}
+
+	switch (cqe.user_data) {
+		case URING_ACCEPT: {
+			if (cqe.res < 0) {
+				if (cqe.res == -ECANCELED) break;
+				logAcceptFailure(-cqe.res);
+				// an error ends the multishot accept, right away it would most likely fail again (EMFILE, ENFILE), so
+				// it is armed again on the next tick or once a client closes
+				if (!(cqe.flags & IORING_CQE_F_MORE)) {
+					pauseAccept(shard);
+					return;
 				}
-				//{
-				//	std::lock_guard lock(clientData->spinlock);
-				//	while (clientData->stream) {
-				//		clientData->stream.clear();
-				//		handleRequest(clientData->stream);
-				//	}
-				//}
+				break;
 			}
+			Socket		 socket = cqe.res;
+			sockaddr_in6 client = {};
+			socklen_t	 clilen = sizeof(client);
+			getpeername(socket, (sockaddr *)&client, &clilen);
+			socket.setAddr(client);
+
+			Connections::Ref ref = openClient(shard, std::move(socket));
+			if (!ref) break;
+			ClientData &clientData = **ref.slot;
+			auto		io		   = std::make_unique<UringClient>(*shard.ring, cqe.res, ref);
+			io->start();
+			clientData.stream.getBuffer().setIO(io.get());
+			clientData.io = std::move(io);
+			// handled once right away like with the first epoll event, which sets its idle timeout
+			serveClient(shard, *ref.slot, 1);
+			break;
 		}
-		std::unique_lock lock(m_mutex);
-		dbLog(dbg::LOG_DEBUG, "Worker thread ", id, " stopped.");
-	};
+		case URING_RESUME: resumeClients(shard); break;
+		case URING_TIMER: expireTimers(shard); break;
+		case URING_TICK: expireTimeouts(shard); break;
+	}
+	// multishot operations also end when the kernel runs out of room for their completions, they go on right away then
+	if (!(cqe.flags & IORING_CQE_F_MORE) && m_running.test()) armUring(shard, cqe.user_data);
+}
 
-	for (unsigned int i = 0; i < m_numThreads; i++) {
-		m_workers.emplace_back(worker, i);
+void TCPServer::serveClient(Shard &shard, Connections::Slot &slot, uint32_t seen) {
+	// the thread that entered the connection handles it, events that arrive meanwhile make it go again
+	ClientData &clientData = *slot;
+	do {
+		clientData.stream.clear();
+		if (clientData.context && clientData.context->timedOut.exchange(false)) {
+			handleTimeout(clientData.stream, clientData.context.get());
+		}
+		while (clientData.stream) {
+			handleRequest(clientData.stream, clientData.context.get());
+		}
+		if (clientData.stream.bad()) {
+			closeClient(shard, slot);
+			return;
+		}
+	} while (!Connections::leave(slot, seen));
+}
+
+void TCPServer::closeClient(Shard &shard, Connections::Slot &slot) {
+	ClientData &clientData = *slot;
+	dbLog(dbg::LOG_DEBUG, "Client ", clientData.socket.getAddr(), " disconnected.");
+	if (m_backend == Backend::EPOLL) epoll_ctl(shard.epollFD, EPOLL_CTL_DEL, int(clientData.socket), nullptr);
+	if (clientData.context) cancelTimeout(*clientData.context);
+
+	// the descriptor is closed only once the slot is free, accept() may hand it out again right away
+	Socket socket = std::move(clientData.socket);
+	// the stream may still flush through the io_uring socket while it is destroyed
+	std::unique_ptr<SocketIO> io = std::move(clientData.io);
+	Connections::close(slot);
+	--shard.numClients;
+	addRelaxed(t_stats->closed);
+
+	// operations in flight may still refer to the descriptor, the socket closes it after the last one
+	if (io) {
+		UringClient *client = static_cast<UringClient *>(io.release());
+		client->close(socket.release());
+		if (client->finished()) delete client;
+	} else {
+		close(socket.release());
 	}
+	// the descriptor is free for a connection that could not be accepted
+	resumeAccept(shard);
 }
 
-TCPServer::~TCPServer() {
-	close(m_socket);
-	close(m_epollFD);
+void TCPServer::resume(const ConnectionRef &connection) {
+	Shard &shard = *connection.shard;
+	{
+		std::lock_guard lock(shard.resumeMutex);
+		shard.resumed.push_back(connection.client);
+	}
+	uint64_t one = 1;
+	if (write(shard.resumeFD, &one, sizeof(one)) < 0) {
+		dbLog(dbg::LOG_ERROR, "cannot wake workers: ", strerror(errno));
+	}
 }
 
+void TCPServer::resumeAt(const ConnectionRef &connection, std::chrono::steady_clock::time_point when) {
+	Shard			&shard = *connection.shard;
+	std::lock_guard	 lock(shard.resumeMutex);
+	if (shard.timers.empty() || when < shard.timers.top().when) armTimer(shard.timerFD, when);
+	shard.timers.push({when, connection.client});
+}
+
+void TCPServer::resumeClients(Shard &shard) {
+	// in shared mode every worker waiting on the shard may wake up, whoever reads the counter first takes the list
+	uint64_t count;
+	if (read(shard.resumeFD, &count, sizeof(count)) < 0) return;
+
+	std::vector<Connections::Ref> resumed;
+	{
+		std::lock_guard lock(shard.resumeMutex);
+		resumed.swap(shard.resumed);
+	}
+	serveResumed(shard, resumed);
+}
+
+void TCPServer::expireTimers(Shard &shard) {
+	uint64_t count;
+	if (read(shard.timerFD, &count, sizeof(count)) < 0) return;
+
+	std::vector<Connections::Ref> expired;
+	{
+		std::lock_guard lock(shard.resumeMutex);
+		auto			now = std::chrono::steady_clock::now();
+		while (!shard.timers.empty() && shard.timers.top().when <= now) {
+			expired.push_back(shard.timers.top().client);
+			shard.timers.pop();
+		}
+		if (!shard.timers.empty()) armTimer(shard.timerFD, shard.timers.top().when);
+	}
+	serveResumed(shard, expired);
+}
+
+void TCPServer::setTimeout(Context &context, std::chrono::steady_clock::time_point when) {
+	Shard &shard = *context.connection.shard;
+	auto   lock	 = lockShard(shard);
+	if (shard.timeouts.empty()) {
+		// the wheel did not tick while it was empty
+		shard.timeouts.advance(timeoutTick(std::chrono::steady_clock::now()), [](TimerWheel::Node *) {});
+		setTicking(shard.tickFD, true);
+	}
+	// expires on the first tick after when
+	shard.timeouts.arm(context.timeout, timeoutTick(when) + 1);
+}
+
+void TCPServer::cancelTimeout(Context &context) {
+	Shard &shard = *context.connection.shard;
+	auto   lock	 = lockShard(shard);
+	shard.timeouts.cancel(context.timeout);
+}
+
+void TCPServer::expireTimeouts(Shard &shard) {
+	uint64_t count;
+	if (read(shard.tickFD, &count, sizeof(count)) < 0) return;
+
+	std::vector<Connections::Ref> expired;
+	{
+		// a connection cancels its timeout under the same lock before it is closed, so the context is still alive
+		auto lock = lockShard(shard);
+		shard.timeouts.advance(timeoutTick(std::chrono::steady_clock::now()), [&expired](TimerWheel::Node *node) {
+			Context *context  = static_cast<Context *>(node->owner);
+			context->timedOut = true;
+			expired.push_back(context->connection.client);
+		});
+		// a paused accept is retried on every tick
+		if (shard.timeouts.empty() && !shard.acceptPaused.load(std::memory_order_relaxed)) {
+			setTicking(shard.tickFD, false);
+		}
+	}
+	resumeAccept(shard);
+	serveResumed(shard, expired);
+}
+
+void TCPServer::serveResumed(Shard &shard, const std::vector<Connections::Ref> &clients) {
+	for (const Connections::Ref &client : clients) {
+		// a connection that has been closed meanwhile no longer matches its reference
+		if (Connections::enter(client)) serveClient(shard, *client.slot, client.slot->events());
+	}
+}
+
+void TCPServer::listen() {
+	if (m_backend == Backend::IO_URING) {
+		if (!m_sharded) throw std::runtime_error("the io_uring backend requires sharded mode");
+		for (auto &shard : m_shards) {
+			shard->ring = std::make_unique<IOUring>(URING_ENTRIES, URING_BUFFERS, URING_BUFFER_SIZE);
+		}
+	}
+	for (auto &shard : m_shards) {
+		if (::listen(shard->socket, 10) < 0) {
+			throw std::runtime_error(std::string("cannot listen: ") + strerror(errno));
+		}
+	}
+
+	dbLog(dbg::LOG_INFO, "Listening on ", m_address, m_sharded ? " (sharded)" : "",
+		  m_backend == Backend::IO_URING ? " with io_uring" : "");
+
+	m_stats = std::make_unique<WorkerStats[]>(m_numThreads);
+	for (unsigned int i = 0; i < m_numThreads; i++) {
+		Shard &shard = *m_shards[m_sharded ? i : 0];
+		m_workers.emplace_back(&TCPServer::worker, this, i, std::ref(shard));
+	}
+}
+
+TCPServer::~TCPServer() {}
+
 void TCPServer::stop() {
 	m_running.clear();
+	for (auto &shard : m_shards) {
+		uint64_t one = 1;
+		if (write(shard->wakeFD, &one, sizeof(one)) < 0) {
+			dbLog(dbg::LOG_ERROR, "cannot wake workers: ", strerror(errno));
+		}
+	}
 	for (auto &it : m_workers) {
 		it.join();
 	}
+	m_workers.clear();
 }
 
 void TCPServer::listClients() {
-	std::lock_guard lock1(m_mutex);
-	std::lock_guard lock2(dbg::getMutex());
+	std::size_t numClients = 0;
+	for (auto &shard : m_shards) {
+		numClients += shard->numClients;
+	}
+
+	std::lock_guard lock(dbg::getMutex());
+
+	std::cout << "Clients count: " << numClients << " | thread occupancy: ";
+	for (std::size_t i = 0; m_stats && i < m_numThreads; i++) {
+		std::cout << m_stats[i].busy.load(std::memory_order_relaxed) << " ";
+	}
+	std::cout << "| average epoll batch: " << averageBatchSize() << std::endl;
+}
+
+void TCPServer::writeMetrics(std::ostream &out) const {
+	std::size_t numClients = 0;
+	for (auto &shard : m_shards) {
+		numClients += shard->numClients;
+	}
+	out << "# HELP server_connections Open connections.\n"
+		   "# TYPE server_connections gauge\n"
+		   "server_connections "
+		<< numClients << '\n';
+	if (!m_stats) return;
 
-	std::cout << "Clients count: " << m_clients.size() << " | thread occupancy: ";
+	auto perWorker = [&](const char *name, const char *type, const char *help, auto member) {
+		out << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+		for (std::size_t i = 0; i < m_numThreads; i++) {
+			out << name << "{worker=\"" << i << "\"} " << uint64_t((m_stats[i].*member).load(std::memory_order_relaxed))
+				<< '\n';
+		}
+	};
+	perWorker("server_connections_accepted_total", "counter", "Connections accepted.", &WorkerStats::accepted);
+	perWorker("server_connections_closed_total", "counter", "Connections closed.", &WorkerStats::closed);
+	perWorker("server_wakeups_total", "counter", "Returns from epoll_wait or io_uring_enter.", &WorkerStats::wakeups);
+	perWorker("server_events_total", "counter", "Events or completions handled.", &WorkerStats::events);
+	perWorker("server_worker_busy", "gauge", "Whether the worker is handling events.", &WorkerStats::busy);
+}
+
+double TCPServer::averageBatchSize() const {
+	if (!m_stats) return 0;
+	uint64_t wakeups = 0, events = 0;
 	for (std::size_t i = 0; i < m_numThreads; i++) {
-		std::cout << m_occup[i] << " ";
+		wakeups += m_stats[i].wakeups.load(std::memory_order_relaxed);
+		events += m_stats[i].events.load(std::memory_order_relaxed);
+	}
+	return wakeups ? double(events) / wakeups : 0;
+}
+
+void HTTPServer::listen() {
+	router.compile();
+	m_metrics.setRoutes(router.names());
+	m_keepAliveHeaders = "Connection: keep-alive\r\n";
+	if (timeouts.idle.count()) {
+		auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeouts.idle).count();
+		m_keepAliveHeaders += "Keep-Alive: timeout=" + std::to_string(seconds) + "\r\n";
+	}
+	m_pool = std::make_unique<ComputePool>(computeThreads);
+	TCPServer::listen();
+}
+
+void HTTPServer::listClients() {
+	TCPServer::listClients();
+
+	if (m_pool) {
+		std::lock_guard lock(dbg::getMutex());
+		std::cout << "Compute pool: " << m_pool->size() << " threads, " << m_pool->pending() << " jobs queued"
+				  << std::endl;
+	}
+
+	FileCache::Stats stats = router.cacheStats();
+	if (!stats.budget) return;
+
+	std::lock_guard lock(dbg::getMutex());
+	std::cout << "File cache: " << stats.entries << " entries, " << stats.bytes << "/" << stats.budget
+			  << " bytes | hits: " << stats.hits << " misses: " << stats.misses << " evictions: " << stats.evictions
+			  << std::endl;
+}
+
+void HTTPServer::enableMetrics(const std::string &path) {
+	router.get(path, [this](SocketStream &ss, Request &) {
+		std::ostringstream out;
+		writeMetrics(out);
+		ss.send(200, "OK", "text/plain; version=0.0.4; charset=utf-8", out.str());
+	});
+}
+
+void HTTPServer::writeMetrics(std::ostream &out) const {
+	TCPServer::writeMetrics(out);
+	m_metrics.write(out);
+	out << "# HELP log_records_dropped_total Log records dropped because the ring buffer of a thread was full.\n"
+		   "# TYPE log_records_dropped_total counter\n"
+		   "log_records_dropped_total "
+		<< dbg::Logger::instance().dropped() << '\n';
+
+	if (m_pool) {
+		out << "# HELP compute_pool_jobs_queued Jobs waiting for a thread of the compute pool.\n"
+			   "# TYPE compute_pool_jobs_queued gauge\n"
+			   "compute_pool_jobs_queued "
+			<< m_pool->pending() << '\n';
+	}
+
+	DirListingCache::Stats listings = router.listingStats();
+	if (listings.budget) {
+		out << "# HELP dir_listing_cache_lookups_total Lookups of directory listings in the cache.\n"
+			   "# TYPE dir_listing_cache_lookups_total counter\n"
+			   "dir_listing_cache_lookups_total{result=\"hit\"} "
+			<< listings.hits << "\ndir_listing_cache_lookups_total{result=\"miss\"} " << listings.misses << '\n';
+	}
+
+	FileCache::Stats stats = router.cacheStats();
+	if (!stats.budget) return;
+	out << "# HELP file_cache_bytes Bytes of files held in memory.\n"
+		   "# TYPE file_cache_bytes gauge\n"
+		   "file_cache_bytes "
+		<< stats.bytes
+		<< "\n# HELP file_cache_open_files Descriptors of large files held open by the cache.\n"
+		   "# TYPE file_cache_open_files gauge\n"
+		   "file_cache_open_files "
+		<< stats.openFiles
+		<< "\n# HELP file_cache_lookups_total Lookups of served files in the cache.\n"
+		   "# TYPE file_cache_lookups_total counter\n"
+		   "file_cache_lookups_total{result=\"hit\"} "
+		<< stats.hits << "\nfile_cache_lookups_total{result=\"miss\"} " << stats.misses
+		<< "\n# HELP file_cache_evictions_total Files dropped from the cache to stay within its budget.\n"
+		   "# TYPE file_cache_evictions_total counter\n"
+		   "file_cache_evictions_total "
+		<< stats.evictions << '\n';
+}
+
+void HTTPServer::sendError(SocketStream &stream, HTTPContext &client, int status, const std::string &msg) {
+	client.closeAfterWrite = true;
+	client.linger		   = true;
+	m_metrics.reject(status);
+	// a coroutine handler reading the body may have begun its response already, its next read fails instead
+	if (client.taskBody) return client.taskBody->fail(status, msg);
+
+	beginResponse(stream.getBuffer(), client);
+	router.renderStatus(stream, status, msg);
+	client.state = HTTPContext::WRITING_RESPONSE;
+	client.lastActivity	   = std::chrono::steady_clock::now();
+	// the error response is what gets written for the request
+	client.phaseStart = client.lastActivity;
+}
+
+bool HTTPServer::receive(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer &buffer = stream.getBuffer();
+	ssize_t		  res	 = buffer.fill();
+	if (res > 0) {
+		client.lastActivity = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		stream.setstate(std::ios::failbit);
+	} else if (res < 0 && errno == ENOBUFS) {
+		if (client.state == HTTPContext::IDLE || client.state == HTTPContext::READING_HEADERS) {
+			if (buffer.input().size() >= maxHeaderSize) {
+				sendError(stream, client, 431, "Request Header Fields Too Large");
+				return false;
+			}
+			buffer.reserve(std::min(buffer.input().size() * 2, maxHeaderSize));
+			return receive(stream, client);
+		}
+		// the head and an incomplete chunk line fill the buffer
+		buffer.reserve(buffer.input().size() * 2);
+		return receive(stream, client);
+	} else {
+		stream.setstate(std::ios::badbit);
+	}
+	return false;
+}
+
+bool HTTPServer::beginBody(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer	  &buffer  = stream.getBuffer();
+	const HTTPRequest &request = client.parser->request;
+
+	RouteParams			 params;
+	uint32_t			 allowed;
+	const Router::Route *route	 = router.match(request, params, allowed);
+	BodyOptions			 options = route ? route->body : BodyOptions();
+	if (m_accessLog >= 0) {
+		client.method.assign(request.method);
+		client.target.assign(request.target);
+		client.version.assign(request.version);
+	}
+	client.async					 = route && route->async;
+	client.coroutine				 = route && route->task;
+	client.route					 = route ? route->id : m_metrics.unmatched();
+	if (!request.keepAlive) client.closeAfterWrite = true;
+
+	client.bodyLimit = options.maxSize;
+	if (options.mode == BodyOptions::BUFFER) client.bodyLimit = std::min(client.bodyLimit, maxBodySize);
+	if (request.contentLength > client.bodyLimit) {
+		sendError(stream, client, 413, "Content Too Large");
+		return false;
+	}
+
+	client.headSize	 = client.parser->consumed();
+	client.remaining = request.contentLength;
+	client.received	 = 0;
+	client.chunked.reset();
+
+	if (route && route->task && options.mode == BodyOptions::STREAM) {
+		// the handler reads the body itself, the head stays in front of it meanwhile
+		auto body		  = std::make_unique<TaskBody>();
+		client.taskBody	  = body.get();
+		client.bodyStream = std::move(body);
+	} else if (route && options.mode == BodyOptions::STREAM) {
+		// the handler copies whatever it needs from the head now, so that it does not have to stay buffered
+		client.bodyStream = route->stream(request, params);
+		buffer.consume(client.headSize);
+		client.headSize = 0;
+		// a stream that answers right away rejects the body, which is not going to be read then
+		bool closeAfterWrite   = client.closeAfterWrite;
+		client.closeAfterWrite = true;
+		beginResponse(buffer, client);
+		if (!client.bodyStream->begin(stream)) {
+			client.bodyStream.reset();
+			client.linger = true;
+			client.state = HTTPContext::WRITING_RESPONSE;
+			return false;
+		}
+		client.closeAfterWrite = closeAfterWrite;
+		buffer.insertHeaders({});
+	}
+	if (!request.contentLength && !request.chunked) return true;
+
+	std::string_view expect = request.header("Expect");
+	if (expect.size() == 12 && !strncasecmp(expect.data(), "100-continue", 12)) {
+		stream.send(ResponseHead(100));
 	}
-	std::cout << std::endl;
+
+	if (!client.bodyStream) client.body.begin(options, request.contentLength);
+	return true;
 }
 
-void HTTPServer::handleRequest(SocketStream &stream) {
+bool HTTPServer::readBody(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer	  &buffer  = stream.getBuffer();
+	const HTTPRequest &request = client.parser->request;
+
+	// passes decoded bytes on, returns false if the rest of the body is not going to be read
+	auto deliver = [&](std::string_view data) {
+		client.received += data.size();
+		if (client.received > client.bodyLimit) {
+			sendError(stream, client, 413, "Content Too Large");
+			return false;
+		}
+		if (client.bodyStream) {
+			if (client.bodyStream->data(data)) return true;
+			client.closeAfterWrite = true;
+			client.linger		   = true;
+			beginResponse(buffer, client);
+			client.bodyStream->end(stream);
+			client.bodyStream.reset();
+			client.state = HTTPContext::WRITING_RESPONSE;
+			return false;
+		}
+		if (client.body.append(data)) return true;
+		dbLog(dbg::LOG_ERROR, "cannot store request body: ", strerror(errno));
+		sendError(stream, client, 500, "Internal Server Error");
+		return false;
+	};
+
+	for (;;) {
+		std::string_view pending = buffer.input().substr(client.headSize);
+		std::size_t		 used	 = 0;
+		bool			 done;
+
+		if (request.chunked) {
+			ChunkedDecoder::Result res;
+			std::string_view	   data;
+			std::size_t			   n;
+			while ((res = client.chunked.decode(pending.substr(used), n, data)) == ChunkedDecoder::Result::DATA) {
+				used += n;
+				if (!deliver(data)) return false;
+			}
+			if (res == ChunkedDecoder::Result::ERROR) {
+				sendError(stream, client, 400, "Bad Request");
+				return false;
+			}
+			used += n;
+			done = res == ChunkedDecoder::Result::DONE;
+		} else {
+			std::string_view data = pending.substr(0, client.remaining);
+			if (!data.empty() && !deliver(data)) return false;
+			used = data.size();
+			client.remaining -= used;
+			done = !client.remaining;
+		}
+		buffer.erase(client.headSize, used);
+
+		if (done) {
+			if (client.body.finish()) return true;
+			dbLog(dbg::LOG_ERROR, "cannot store request body: ", strerror(errno));
+			sendError(stream, client, 500, "Internal Server Error");
+			return false;
+		}
+		// a coroutine handler takes the body at its own pace, nothing more is received until it has taken this
+		if (client.taskBody && client.taskBody->hasPending()) return false;
+
+		// with nothing else buffered, the rest of a body of known length is received straight into its buffer
+		if (!request.chunked && !client.bodyStream && buffer.input().size() == client.headSize) {
+			std::span<char> space = client.body.prepare(client.remaining);
+			if (space.empty()) {
+				dbLog(dbg::LOG_ERROR, "cannot store request body: ", strerror(errno));
+				sendError(stream, client, 500, "Internal Server Error");
+				return false;
+			}
+			ssize_t n = buffer.receive(space.data(), space.size());
+			if (n > 0) {
+				client.lastActivity = std::chrono::steady_clock::now();
+				client.body.commit(n);
+				client.received += n;
+				client.remaining -= n;
+				continue;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) stream.setstate(std::ios::failbit);
+			else stream.setstate(std::ios::badbit);
+			return false;
+		}
+
+		if (!receive(stream, client)) return false;
+	}
+}
+
+void HTTPServer::handleRequest(SocketStream &stream, Context *context) {
+	HTTPContext &client = static_cast<HTTPContext &>(*context);
+	serve(stream, client);
+	if (!stream.fail() || stream.bad()) return;
+
+	// the connection is parked: responses held back for pipelined requests go out now, in one write. A connection
+	// writing a response or waiting for output to drain has flushed already
+	bool flushed = client.state == HTTPContext::WRITING_RESPONSE ||
+				   (client.state == HTTPContext::RUNNING_TASK && client.wait == HTTPContext::OUTPUT);
+	if (!flushed && stream.getBuffer().hasPendingOutput()) {
+		flushOutput(stream, client);
+		if (stream.bad()) return;
+	}
+	// whenever the connection is parked, its timeout has to cover its deadline
+	updateDeadline(client);
+}
+
+void HTTPServer::serve(SocketStream &stream, HTTPContext &client) {
 	const Socket &socket = stream.getSocket();
+	SocketBuffer &buffer = stream.getBuffer();
 
-	std::string line;
-	std::getline(stream, line);
-	if (line.empty()) return;
-	dbLog(dbg::LOG_INFO, socket.getAddr(), " -> ", line);
+	switch (client.state) {
+		case HTTPContext::RUNNING_JOB:
+			// the connection reads nothing while the job runs, the job resumes it once it is done
+			if (!client.jobDone.load(std::memory_order_acquire)) {
+				stream.setstate(std::ios::failbit);
+				return;
+			}
+			finishJob(stream, client);
+			return;
 
-	std::istringstream	ss(line);
-	Router::RequestType type;
-	{
-		std::string type_s;
-		ss >> type_s;
-		type = Router::RequestType::fromString(type_s);
+		case HTTPContext::RUNNING_TASK:
+			if (!taskReady(stream, client)) {
+				if (!stream.bad()) stream.setstate(std::ios::failbit);
+				return;
+			}
+			resumeTask(stream, client);
+			return;
+
+		case HTTPContext::DRAINING: drainInput(stream, client); return;
+
+		case HTTPContext::WRITING_RESPONSE:
+			if (!flushOutput(stream, client)) {
+				stream.setstate(std::ios::failbit);
+				return;
+			}
+			client.lastActivity = std::chrono::steady_clock::now();
+			responseSent(stream, client, client.lastActivity);
+			if (client.closeAfterWrite) {
+				// closing with unread input would reset the connection, the client could lose the response with it
+				if (!client.linger || !timeouts.linger.count() || shutdown(socket, SHUT_WR) < 0) {
+					stream.setstate(std::ios::badbit);
+					return;
+				}
+				client.state = HTTPContext::DRAINING;
+				buffer.shrink();
+				drainInput(stream, client);
+				return;
+			}
+			client.state = HTTPContext::IDLE;
+			buffer.shrink();
+			[[fallthrough]];
+
+		case HTTPContext::IDLE:
+		case HTTPContext::READING_HEADERS:
+			for (;;) {
+				if (!client.parser) {
+					// an idle connection does not hold a parser, it takes one once a request starts arriving
+					if (buffer.input().empty()) {
+						if (!receive(stream, client)) return;
+						continue;
+					}
+					client.parser = ObjectPool<HTTPParser>::acquire();
+				}
+				HTTPParser		  &parser = *client.parser;
+				HTTPParser::Result res	  = parser.parse(buffer.input());
+				if (client.state == HTTPContext::IDLE && !buffer.input().empty()) {
+					client.state		= HTTPContext::READING_HEADERS;
+					client.requestStart = std::chrono::steady_clock::now();
+					client.route		= m_metrics.unmatched();
+					client.phaseStart	= client.requestStart;
+					if (m_accessLog >= 0) {
+						client.method.clear();
+						client.target.clear();
+						client.version.clear();
+					}
+				}
+				if (res == HTTPParser::Result::DONE) break;
+				if (res == HTTPParser::Result::ERROR) {
+					dbLog(dbg::LOG_WARNING, socket.getAddr(), " sent a malformed request: ", parser.errorStatus());
+					sendError(stream, client, parser.errorStatus(),
+							  parser.errorStatus() == 505	? "HTTP Version Not Supported"
+							  : parser.errorStatus() == 501 ? "Not Implemented"
+							  : parser.errorStatus() == 431 ? "Request Header Fields Too Large"
+															: "Bad Request");
+					return;
+				}
+				if (!receive(stream, client)) return;
+			}
+
+			if (!beginBody(stream, client)) return;
+			client.state = HTTPContext::READING_BODY;
+			[[fallthrough]];
+
+		case HTTPContext::READING_BODY:
+			// a coroutine handler reading the body starts right away
+			if (!client.taskBody && !readBody(stream, client)) return;
+			break;
+	}
+	client.phaseStart = std::chrono::steady_clock::now();
+	m_metrics.record(client.route, Metrics::PARSE, client.phaseStart - client.requestStart);
+
+	if (client.async) {
+		startJob(stream, client);
+		return;
+	}
+	if (client.coroutine) {
+		startTask(stream, client);
+		return;
+	}
+	beginResponse(buffer, client);
+	if (client.bodyStream) {
+		buffer.cork(pipelined(buffer, client));
+		client.bodyStream->end(stream);
+		client.bodyStream.reset();
+	} else {
+		// the head may have been moved while the body arrived
+		client.parser->parse(buffer.input());
+		buffer.consume(client.headSize);
+		buffer.cork(pipelined(buffer, client));
+		router.handleRequest(client.parser->request, client.body, stream);
+		client.body.reset();
+	}
+	finishRequest(stream, client);
+}
+
+void HTTPServer::beginResponse(SocketBuffer &buffer, const HTTPContext &client) {
+	// persistence is implied for HTTP/1.1, an HTTP/1.0 client has to be told that the connection stays open
+	if (client.closeAfterWrite) buffer.insertHeaders("Connection: close\r\n");
+	else if (client.parser && client.parser->request.version == "HTTP/1.0") buffer.insertHeaders(m_keepAliveHeaders);
+	else buffer.insertHeaders({});
+}
+
+void HTTPServer::startJob(SocketStream &stream, HTTPContext &client) {
+	if (!client.bodyStream) {
+		// the head may have been moved while the body arrived. Nothing is read into the buffer until the job is done,
+		// so the request stays where it is meanwhile
+		SocketBuffer &buffer = stream.getBuffer();
+		client.parser->parse(buffer.input());
+		buffer.consume(client.headSize);
 	}
-	std::string path;
-	ss >> path;
 
-	std::size_t body_len = 0;
-	while (std::getline(stream, line)) {
-		if (line.starts_with("Content-Length:")) {
-			std::string_view length = std::string_view(line).substr(16);
-			std::from_chars(length.begin(), length.end(), body_len);
+	client.state	 = HTTPContext::RUNNING_JOB;
+	client.jobOutput = std::make_unique<SocketStream>(-1);
+	client.jobDone.store(false, std::memory_order_relaxed);
+	beginResponse(client.jobOutput->getBuffer(), client);
+
+	m_pool->submit([this, &client, connection = connection(client)] {
+		SocketStream &out = *client.jobOutput;
+		try {
+			if (client.bodyStream) {
+				client.bodyStream->end(out);
+				client.bodyStream.reset();
+			} else {
+				router.handleRequest(client.parser->request, client.body, out);
+			}
+		} catch (const std::exception &e) {
+			dbLog(dbg::LOG_ERROR, "async handler failed: ", e.what());
+			out.setstate(std::ios::badbit);
 		}
-		if (line == "\r") break;
+		// from here on an I/O worker may finish the request and close the connection, so client is not touched again
+		client.jobDone.store(true, std::memory_order_release);
+		resume(connection);
+	});
+	stream.setstate(std::ios::failbit);
+}
+
+void HTTPServer::finishJob(SocketStream &stream, HTTPContext &client) {
+	std::unique_ptr<SocketStream> out = std::move(client.jobOutput);
+	stream.getBuffer().append(out->getBuffer());
+	client.body.reset();
+	client.async = false;
+
+	if (out->bad()) stream.setstate(std::ios::badbit);
+	finishRequest(stream, client);
+}
+
+void HTTPServer::startTask(SocketStream &stream, HTTPContext &client) {
+	// like for async routes, nothing is read into the buffer until the handler is done, so the request stays where it
+	// is while the handler is suspended. A handler that reads the body itself keeps the head in front of it, the
+	// views into the head are refreshed after every read
+	SocketBuffer &buffer = stream.getBuffer();
+	client.parser->parse(buffer.input());
+	if (!client.taskBody) buffer.consume(client.headSize);
+
+	uint32_t			 allowed;
+	const Router::Route *route = router.match(client.parser->request, client.params, allowed);
+	client.taskRequest =
+		std::make_unique<Request>(Request{client.parser->request, client.params, client.body, client.taskBody});
+	client.taskResponse		   = std::make_unique<Response>(Response{stream});
+	client.task				   = route->task(*client.taskRequest, *client.taskResponse);
+	client.state			   = HTTPContext::RUNNING_TASK;
+	beginResponse(buffer, client);
+	resumeTask(stream, client);
+}
+
+bool HTTPServer::taskReady(SocketStream &stream, HTTPContext &client) {
+	switch (client.wait) {
+		case HTTPContext::NONE: return true;
+		case HTTPContext::TIMER: return std::chrono::steady_clock::now() >= client.wakeTime;
+		case HTTPContext::JOB: return client.jobDone.load(std::memory_order_acquire);
+		case HTTPContext::OUTPUT: return flushOutput(stream, client);
+		case HTTPContext::BODY: return receiveTaskBody(stream, client);
 	}
+	return true;
+}
 
-	router.handleRequest(type, path, stream, body_len);
+bool HTTPServer::receiveTaskBody(SocketStream &stream, HTTPContext &client) {
+	TaskBody &body = *client.taskBody;
+	if (body.ready()) return true;
+	if (readBody(stream, client)) body.ended = true;
+	// the head in front of the body may have been moved by the reads
+	client.parser->parse(stream.getBuffer().input());
+	return body.ready();
+}
+
+bool HTTPServer::TaskBody::next(std::string_view &chunk) {
+	if (status) throw BodyError(status, reason);
+	if (m_pending.empty() && !ended) return false;
+	// the buffers swap roles, the piece handed out stays valid until the next call
+	m_taken.clear();
+	std::swap(m_taken, m_pending);
+	chunk = m_taken;
+	return true;
+}
+
+void HTTPServer::resumeTask(SocketStream &stream, HTTPContext &client) {
+	client.wait = HTTPContext::NONE;
+	client.task.resume(&client);
+	// suspended again, handleRequest() checks what on its next call
+	if (!client.task.done()) return;
+
+	SocketBuffer &buffer = stream.getBuffer();
+	// the rest of a body the handler did not read would be taken for the next request
+	if (client.taskBody && !client.taskBody->ended) client.closeAfterWrite = client.linger = true;
+
+	if (std::exception_ptr e = client.task.exception()) {
+		bool answered = false;
+		try {
+			std::rethrow_exception(e);
+		} catch (const BodyError &ex) {
+			// the body was refused before the handler began its response, the client is told why
+			if (!buffer.responseBegun()) {
+				beginResponse(buffer, client);
+				router.renderStatus(stream, ex.status, ex.what());
+				answered = true;
+			}
+		} catch (const std::exception &ex) {
+			dbLog(dbg::LOG_ERROR, "coroutine handler failed: ", ex.what());
+		} catch (...) {
+			dbLog(dbg::LOG_ERROR, "coroutine handler failed");
+		}
+		if (!answered) stream.setstate(std::ios::badbit);
+	}
+	if (client.taskBody) {
+		buffer.consume(client.headSize);
+		client.headSize = 0;
+		client.taskBody = nullptr;
+		client.bodyStream.reset();
+	}
+	client.task = {};
+	client.taskRequest.reset();
+	client.taskResponse.reset();
+	client.body.reset();
+	client.coroutine = false;
+	finishRequest(stream, client);
+}
+
+void HTTPServer::HTTPContext::sleepUntil(std::chrono::steady_clock::time_point when) {
+	wait	 = TIMER;
+	wakeTime = when;
+	server.resumeAt(TCPServer::connection(*this), when);
+}
+
+void HTTPServer::HTTPContext::offload(std::function<void()> job) {
+	wait = JOB;
+	jobDone.store(false, std::memory_order_relaxed);
+	// the connection is about to be closed together with the task, a job must not outlive the task it writes to
+	if (taskResponse->stream.bad()) return;
+
+	server.m_pool->submit([this, job = std::move(job), &server = server, connection = TCPServer::connection(*this)] {
+		job();
+		// from here on the connection may be finished and closed by an I/O worker
+		jobDone.store(true, std::memory_order_release);
+		server.resume(connection);
+	});
+}
+
+void HTTPServer::finishRequest(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer &buffer = stream.getBuffer();
+	auto		  now	 = std::chrono::steady_clock::now();
+	m_metrics.record(client.route, Metrics::HANDLER, now - client.phaseStart);
+	client.phaseStart = now;
+	if (client.parser) {
+		client.parser->reset();
+		ObjectPool<HTTPParser>::release(std::move(client.parser));
+	}
+
+	buffer.cork(false);
+	if (stream.bad()) return;
+	stream.clear();
+	// headers for a response that the handler did not write must not end up in the next one
+	buffer.insertHeaders({});
+	client.lastActivity = now;
+
+	// the responses to pipelined requests are sent together once the buffered input runs dry, see handleRequest().
+	// Such a response counts as written once it is queued
+	if (pipelined(buffer, client)) {
+		responseSent(stream, client, now);
+		client.state = HTTPContext::IDLE;
+		return;
+	}
+	stream.flush();
+	client.state = buffer.hasPendingOutput() || client.closeAfterWrite ? HTTPContext::WRITING_RESPONSE
+																	   : HTTPContext::IDLE;
+	if (client.state == HTTPContext::IDLE) {
+		responseSent(stream, client, std::chrono::steady_clock::now());
+		buffer.shrink();
+	}
+}
+
+void HTTPServer::responseSent(SocketStream &stream, HTTPContext &client, std::chrono::steady_clock::time_point now) {
+	m_metrics.record(client.route, Metrics::WRITE, now - client.phaseStart);
+	if (m_accessLog < 0) return;
+
+	using dbg::Logger;
+	auto duration = std::chrono::duration_cast<std::chrono::microseconds>(now - client.requestStart).count();
+	Logger::instance().log(m_accessLog, "{\"time\":\"", Logger::Time{std::chrono::system_clock::now()},
+						   "\",\"remote\":\"", stream.getSocket().getAddr(), "\",\"method\":\"", Logger::Json{client.method},
+						   "\",\"target\":\"", Logger::Json{client.target}, "\",\"version\":\"",
+						   Logger::Json{client.version}, "\",\"status\":", stream.getBuffer().status(),
+						   ",\"duration_us\":", duration, "}\n");
+}
+
+bool HTTPServer::pipelined(const SocketBuffer &buffer, const HTTPContext &client) {
+	return !client.closeAfterWrite && !buffer.input().empty() && buffer.pendingOutput() < PIPELINE_OUTPUT;
+}
+
+void HTTPServer::drainInput(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer &buffer = stream.getBuffer();
+	// the time is checked as well, a client that keeps sending would keep the loop going
+	while (std::chrono::steady_clock::now() < deadline(client)) {
+		buffer.consume(buffer.input().size());
+		ssize_t res = buffer.fill();
+		if (res > 0) continue;
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			stream.setstate(std::ios::failbit);
+			return;
+		}
+		break;
+	}
+	stream.setstate(std::ios::badbit);
+}
+
+bool HTTPServer::flushOutput(SocketStream &stream, HTTPContext &client) {
+	SocketBuffer &buffer  = stream.getBuffer();
+	uint64_t	  written = buffer.written();
+	stream.flush();
+	if (buffer.written() != written) client.lastActivity = std::chrono::steady_clock::now();
+	return !buffer.hasPendingOutput();
+}
+
+std::chrono::steady_clock::time_point HTTPServer::deadline(const HTTPContext &client) const {
+	using Clock = std::chrono::steady_clock;
+	auto after	= [](Clock::time_point start, std::chrono::milliseconds timeout) {
+		 return timeout.count() ? start + timeout : Clock::time_point::max();
+	};
+	Clock::time_point request = after(client.requestStart, timeouts.request);
+
+	switch (client.state) {
+		case HTTPContext::IDLE: return after(client.lastActivity, timeouts.idle);
+		case HTTPContext::READING_HEADERS: return std::min(after(client.requestStart, timeouts.header), request);
+		case HTTPContext::READING_BODY: return std::min(after(client.lastActivity, timeouts.body), request);
+		// a job on the compute pool cannot be interrupted
+		case HTTPContext::RUNNING_JOB: return Clock::time_point::max();
+		case HTTPContext::RUNNING_TASK:
+			if (client.wait == HTTPContext::JOB) return Clock::time_point::max();
+			if (client.wait == HTTPContext::OUTPUT) return std::min(after(client.lastActivity, timeouts.send), request);
+			if (client.wait == HTTPContext::BODY) return std::min(after(client.lastActivity, timeouts.body), request);
+			return request;
+		case HTTPContext::WRITING_RESPONSE: return std::min(after(client.lastActivity, timeouts.send), request);
+		// counted from when the response was sent, the input dropped meanwhile does not extend it
+		case HTTPContext::DRAINING: return after(client.lastActivity, timeouts.linger);
+	}
+	return request;
+}
+
+void HTTPServer::updateDeadline(HTTPContext &client) {
+	std::chrono::steady_clock::time_point deadline = this->deadline(client);
+	// a later deadline is checked once the timeout set for an earlier one has passed, which saves setting the timeout
+	// again on every request of a keep-alive connection
+	if (deadline >= client.timeoutAt) return;
+	client.timeoutAt = deadline;
+	setTimeout(client, deadline);
+}
+
+void HTTPServer::handleTimeout(SocketStream &stream, Context *context) {
+	HTTPContext &client = static_cast<HTTPContext &>(*context);
+	client.timeoutAt	= std::chrono::steady_clock::time_point::max();
+	// not due yet, handleRequest() sets the timeout for the actual deadline when the connection is parked again
+	if (deadline(client) > std::chrono::steady_clock::now()) return;
+
+	switch (client.state) {
+		case HTTPContext::IDLE:
+			dbLog(dbg::LOG_DEBUG, "Closing idle connection ", stream.getSocket().getAddr());
+			stream.setstate(std::ios::badbit);
+			return;
+
+		case HTTPContext::READING_HEADERS:
+		case HTTPContext::READING_BODY:
+			dbLog(dbg::LOG_WARNING, stream.getSocket().getAddr(), " timed out sending a request");
+			client.bodyStream.reset();
+			client.body.reset();
+			client.async = client.coroutine = false;
+			sendError(stream, client, 408, "Request Timeout");
+			return;
+
+		case HTTPContext::DRAINING: stream.setstate(std::ios::badbit); return;
+
+		case HTTPContext::RUNNING_JOB:
+		case HTTPContext::RUNNING_TASK:
+		case HTTPContext::WRITING_RESPONSE:
+			dbLog(dbg::LOG_WARNING, stream.getSocket().getAddr(), " timed out, closing the connection");
+			stream.setstate(std::ios::badbit);
+			return;
+	}
 }
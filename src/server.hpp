@@ -1,13 +1,24 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <mutex>
+#include <ostream>
+#include <queue>
 #include <thread>
 
+#include <compute_pool.hpp>
+#include <connection_table.hpp>
+#include <http_parser.hpp>
+#include <io_uring.hpp>
+#include <metrics.hpp>
 #include <router.hpp>
 #include <socket.hpp>
+#include <timer_wheel.hpp>
 #include "utils.hpp"
 
 #if !defined(__linux__)
@@ -16,44 +27,379 @@
 
 class TCPServer {
    public:
-	TCPServer(const std::string &ip = "::1", short port = 8080, int num_threads = std::thread::hardware_concurrency());
+	/**
+	 * @param sharded when set, every worker thread gets its own listening socket (SO_REUSEPORT), epoll instance and
+	 * client table. Connections stay on the worker that accepted them and no locks are shared between workers.
+	 */
+	TCPServer(const std::string &ip = "::1", short port = 8080, int num_threads = std::thread::hardware_concurrency(),
+			  bool sharded = false);
 	virtual ~TCPServer();
 
-	virtual void handleRequest(SocketStream &) = 0;
-	void		 listen();
+   private:
+	struct ClientData;
+	struct Shard;
+
+   public:
+	/**
+	 * @brief Refers to a connection without keeping it open, e.g. from a job that runs on another thread.
+	 */
+	class ConnectionRef {
+	   private:
+		friend class TCPServer;
+		Shard							  *shard = nullptr;
+		ConnectionTable<ClientData>::Ref client;
+	};
+
+	/**
+	 * @brief Per-connection state of the protocol implemented on top of the server.
+	 */
+	struct Context {
+		virtual ~Context() = default;
+
+	   private:
+		friend class TCPServer;
+		ConnectionRef	 connection;
+		TimerWheel::Node timeout;			   // guarded by the shard mutex
+		std::atomic_bool timedOut = false;	   // handleTimeout() is due
+	};
+
+	/// How the workers wait for and perform I/O.
+	enum class Backend {
+		EPOLL,	   ///< readiness events from epoll, I/O with plain system calls
+		IO_URING	///< I/O submitted to an io_uring per worker, which is woken by its completions
+	};
+
+	virtual std::unique_ptr<Context> createContext() { return nullptr; }
+	/**
+	 * @brief Handles whatever input and output is possible without blocking. It is called repeatedly while the stream
+	 * stays good. Setting failbit parks the connection until its next epoll event and setting badbit closes it.
+	 */
+	virtual void handleRequest(SocketStream &, Context *) = 0;
+	virtual void					 listen();
+
+	static ConnectionRef connection(const Context &context) { return context.connection; }
+	/**
+	 * @brief Makes a worker handle the connection as if it had an epoll event, e.g. once a job that ran on another
+	 * thread has finished. Safe to call from any thread, does nothing if the connection has been closed meanwhile.
+	 */
+	void resume(const ConnectionRef &connection);
+	/**
+	 * @brief Like resume(), but not before the given time.
+	 */
+	void resumeAt(const ConnectionRef &connection, std::chrono::steady_clock::time_point when);
 
-	void stop();
-	void listClients();
+	/// Resolution of the timeouts set with setTimeout().
+	static constexpr std::chrono::milliseconds TIMEOUT_TICK{100};
+	/**
+	 * @brief Makes a worker call handleTimeout() for the connection once the given time has passed, in place of the
+	 * timeout set before, if any. Only to be called while handling the connection. Arming and cancelling are O(1),
+	 * the timeouts of a shard are kept in a timer wheel ticking every TIMEOUT_TICK while it holds any.
+	 */
+	void setTimeout(Context &context, std::chrono::steady_clock::time_point when);
+	void cancelTimeout(Context &context);
+	/**
+	 * @brief Called before handleRequest() once the time given to setTimeout() has passed. Setting badbit closes the
+	 * connection.
+	 */
+	virtual void handleTimeout(SocketStream &, Context *) {}
+
+	void		 stop();
+	virtual void listClients();
+	/**
+	 * @brief Writes the counters of the workers in the Prometheus text format. They are kept per worker and only
+	 * summed up here.
+	 */
+	virtual void writeMetrics(std::ostream &out) const;
+
+	/**
+	 * @brief Sets how many epoll events a worker harvests with a single epoll_wait call. Must be called before listen().
+	 */
+	void setEventBatchSize(unsigned int size) { m_batchSize = std::max(size, 1u); }
+	/**
+	 * @brief Sets the initial size of the input and output buffers of a connection. They are only held while the
+	 * connection is active and the input buffer grows for large messages. Must be called before listen().
+	 */
+	void setBufferSize(std::size_t size) { m_bufferSize = std::max<std::size_t>(size, 64); }
+	/**
+	 * @brief Selects the I/O backend. IO_URING requires sharded mode, every worker gets a ring of its own: multishot
+	 * accept and receive into provided buffers, sends and file splices as linked operations, all submitted in one batch
+	 * per wakeup. Must be called before listen(), which throws if the ring cannot be set up.
+	 */
+	void setBackend(Backend backend) { m_backend = backend; }
+	/**
+	 * @brief Average number of events returned by one epoll_wait call across all workers, useful for tuning the batch
+	 * size.
+	 */
+	double averageBatchSize() const;
 
    private:
 	struct ClientData {
 		ClientData(const ClientData &)			  = delete;
 		ClientData &operator=(const ClientData &) = delete;
-		ClientData(Socket &&s) : socket(std::move(s)), stream(socket) {}
+		ClientData(Socket &&s, std::unique_ptr<Context> &&context, std::size_t bufferSize)
+			: socket(std::move(s)), stream(socket, bufferSize), context(std::move(context)) {}
 
-		Socket		 socket;
-		SocketStream stream;
-		std::atomic_int lock; // 0 - free, 1 - locked
-		SpinLock		 spinlock;
+		Socket					  socket;
+		std::unique_ptr<SocketIO> io;	 // with the io_uring backend, outlives the stream
+		SocketStream			  stream;
+		std::unique_ptr<Context>  context;
 	};
-	using ClientData_ptr = std::unique_ptr<ClientData>;
+	using Connections = ConnectionTable<ClientData>;
+	struct UringClient;
+
+	/**
+	 * @brief A listening socket together with the epoll instance and the clients it serves. In shared mode there is a
+	 * single shard used by all workers, its client table needs no lock and its mutex only guards the timeouts. In
+	 * sharded mode each worker owns exactly one shard and never locks.
+	 */
+	struct Shard {
+		Shard(const sockaddr_in6 &address, bool reusePort);
+		~Shard();
+
+		int socket = -1, epollFD = -1, wakeFD = -1, resumeFD = -1, timerFD = -1, tickFD = -1;
+		/// with the io_uring backend, destroyed after the clients whose sockets refer to it
+		std::unique_ptr<IOUring> ring;
+		Connections				 clients;
+		std::mutex				 mutex;
+		std::atomic_size_t		 numClients = 0;
+		/// timeouts of the clients, guarded by mutex
+		TimerWheel timeouts;
+		/// accepting failed for want of descriptors, it is retried on the next tick or once a client closes. Changed
+		/// under mutex
+		std::atomic_bool acceptPaused = false;
+
+		struct Timer {
+			std::chrono::steady_clock::time_point when;
+			Connections::Ref					  client;
+
+			bool operator>(const Timer &other) const { return when > other.when; }
+		};
+
+		/// connections passed to resume(), handled by the worker that reads resumeFD
+		std::vector<Connections::Ref> resumed;
+		/// connections passed to resumeAt(), the earliest one is what timerFD is armed for
+		std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+		std::mutex															resumeMutex;
+	};
+
+	/**
+	 * @brief Per-worker counters, each on its own cache line and only written by the owning worker.
+	 */
+	struct alignas(64) WorkerStats {
+		std::atomic_uint64_t wakeups  = 0;
+		std::atomic_uint64_t events	  = 0;
+		std::atomic_uint64_t accepted = 0;
+		std::atomic_uint64_t closed	  = 0;
+		std::atomic_bool	 busy	  = false;	  // not waiting for events
+	};
+
+	std::unique_lock<std::mutex> lockShard(Shard &shard);
+	void						 worker(int id, Shard &shard);
+	void						 handleEvent(Shard &shard, const epoll_event &event);
+	Connections::Ref			 openClient(Shard &shard, Socket &&socket);
+	void						 pauseAccept(Shard &shard);
+	void						 resumeAccept(Shard &shard);
+	void						 uringWorker(int id, Shard &shard);
+	void						 armUring(Shard &shard, uint64_t what);
+	void						 handleCompletion(Shard &shard, const io_uring_cqe &cqe);
+	void						 serveClient(Shard &shard, Connections::Slot &slot, uint32_t seen);
+	void						 closeClient(Shard &shard, Connections::Slot &slot);
+	void						 resumeClients(Shard &shard);
+	void						 expireTimers(Shard &shard);
+	void						 expireTimeouts(Shard &shard);
+	void						 serveResumed(Shard &shard, const std::vector<Connections::Ref> &clients);
 
-	int									m_socket, m_epollFD;
 	sockaddr_in6						m_address;
-	std::unordered_map<int, std::shared_ptr<ClientData>> m_clients;
-	std::mutex							m_mutex;
+	std::vector<std::unique_ptr<Shard>> m_shards;
 	std::atomic_flag					m_running = 1;
 	std::vector<std::thread>			m_workers;
 	unsigned int						m_numThreads;
+	unsigned int						m_batchSize = 256;
+	std::size_t							m_bufferSize = SocketBuffer::DEFAULT_SIZE;
+	bool								m_sharded;
+	Backend								m_backend = Backend::EPOLL;
 
-	std::atomic_int m_occup[100] = {0};
+	std::unique_ptr<WorkerStats[]> m_stats;
+	/// the counters of the worker running on the calling thread
+	static inline thread_local WorkerStats *t_stats = nullptr;
 };
 
 class HTTPServer : public TCPServer {
    public:
 	using TCPServer::TCPServer;
 
-	virtual void handleRequest(SocketStream &) override;
+	/**
+	 * @brief The body of a request to a coroutine STREAM route. readBody() passes it what it decodes, like to any
+	 * BodyStream, and stops receiving while the handler has not taken it yet.
+	 */
+	class TaskBody : public BodyStream, public BodyReader {
+	   public:
+		bool data(std::string_view chunk) override {
+			m_pending.append(chunk);
+			return true;
+		}
+		void end(SocketStream &) override {}
+		bool next(std::string_view &chunk) override;
+
+		/// whether the handler waiting for the body can be resumed
+		bool ready() const { return !m_pending.empty() || ended || status; }
+		bool hasPending() const { return !m_pending.empty(); }
+		/// the rest of the body is refused, the next read throws
+		void fail(int status, const std::string &msg) {
+			this->status = status;
+			reason		 = msg;
+		}
+
+		bool		ended  = false;
+		int			status = 0;
+		std::string reason;
+
+	   private:
+		std::string m_pending, m_taken;
+	};
+
+	/**
+	 * @brief Where a connection is in its request/response cycle. A connection that would block is parked in its
+	 * current state and resumed on the next EPOLLIN/EPOLLOUT.
+	 */
+	struct HTTPContext : Context, TaskScheduler {
+		/// DRAINING: the response of a rejected request has been sent and the write side shut down, whatever the client
+		/// still sends is read and dropped until it closes, so that unread input does not make the close a reset
+		enum State { IDLE, READING_HEADERS, READING_BODY, RUNNING_JOB, RUNNING_TASK, WRITING_RESPONSE, DRAINING };
+		/// what the coroutine handler of a RUNNING_TASK connection is suspended on
+		enum Wait { NONE, TIMER, JOB, OUTPUT, BODY };
+
+		explicit HTTPContext(HTTPServer &server) : server(server) {}
+
+		HTTPServer				   &server;
+		std::unique_ptr<HTTPParser> parser;	   // only while a request is being read and handled
+		State		state			= IDLE;
+		bool		closeAfterWrite = false;
+		bool		linger			= false;	// the request was rejected before its input was read to the end
+		bool		async			= false;	// the request goes to an async route
+		bool		coroutine		= false;	// the request goes to a coroutine route
+
+		/// when the first byte of the current request arrived
+		std::chrono::steady_clock::time_point requestStart;
+		/// the route and the start of the phase of the current request that the metrics record, see Metrics::Phase
+		std::size_t							  route = 0;
+		std::chrono::steady_clock::time_point phaseStart;
+		/// the request line for the access log, copied because the head is not kept until the response has been sent
+		std::string method, target, version;
+		/// when the connection last made progress: bytes received or sent, or a request finished
+		std::chrono::steady_clock::time_point lastActivity = std::chrono::steady_clock::now();
+		/// what the timeout of the connection is set for, see updateDeadline()
+		std::chrono::steady_clock::time_point timeoutAt = std::chrono::steady_clock::time_point::max();
+
+		/// body of a request to a BUFFER or SPILL route
+		RequestBody body;
+		/// receives the body of a request to a STREAM route
+		std::unique_ptr<BodyStream> bodyStream;
+		/// the bodyStream of a request to a coroutine STREAM route, while its handler runs
+		TaskBody				   *taskBody = nullptr;
+		ChunkedDecoder				chunked;
+		std::size_t					headSize  = 0;	  // bytes of the request head kept in front of the body
+		std::size_t					remaining = 0;	  // body bytes still expected if the length is known
+		std::size_t					received  = 0;	  // decoded body bytes so far
+		std::size_t					bodyLimit = 0;
+
+		/// collects the response of a handler running on the compute pool until the connection takes it
+		std::unique_ptr<SocketStream> jobOutput;
+		/// set by a job on the compute pool once it has returned
+		std::atomic_bool jobDone = false;
+
+		/// the coroutine handler of the current request and what it needs while it is suspended
+		Task<>								  task;
+		Wait								  wait = NONE;
+		std::chrono::steady_clock::time_point wakeTime;
+		RouteParams							  params;
+		std::unique_ptr<Request>			  taskRequest;
+		std::unique_ptr<Response>			  taskResponse;
+
+		void sleepUntil(std::chrono::steady_clock::time_point when) override;
+		void offload(std::function<void()> job) override;
+		void drain() override { wait = OUTPUT; }
+		void receive() override { wait = BODY; }
+	};
+
+	virtual std::unique_ptr<Context> createContext() override { return std::make_unique<HTTPContext>(*this); }
+	virtual void					 handleRequest(SocketStream &, Context *) override;
+	virtual void					 handleTimeout(SocketStream &, Context *) override;
+	virtual void					 listClients() override;
+	virtual void					 writeMetrics(std::ostream &out) const override;
+	virtual void					 listen() override;
+
+	/**
+	 * @brief Adds a route that serves writeMetrics() to Prometheus scrapes: the worker counters and, per route, the
+	 * latency histograms of the parse, handler and write phase of the requests. Must be called before listen().
+	 */
+	void enableMetrics(const std::string &path = "/metrics");
+	/**
+	 * @brief Writes a line of JSON to fd for every response once it has been handed to the socket: time, client
+	 * address, method, target, version, status and duration from the first byte of the request. The lines go through
+	 * the asynchronous dbg::Logger, independently of the dbLog level, so that the workers never wait for fd. The
+	 * descriptor has to stay open while the server runs. Must be called before listen().
+	 */
+	void enableAccessLog(int fd) { m_accessLog = fd; }
+
+	/**
+	 * @brief Deadlines that keep slow, idle or stuck clients from holding on to connections. 0 disables one. They are
+	 * checked every TIMEOUT_TICK.
+	 */
+	struct Timeouts {
+		/// to receive a request head, counted from its first byte, so that it cannot be sent a byte at a time
+		std::chrono::milliseconds header = std::chrono::seconds(10);
+		/// without receiving anything while a request body is expected
+		std::chrono::milliseconds body = std::chrono::seconds(30);
+		/// without the client taking any of a response
+		std::chrono::milliseconds send = std::chrono::seconds(30);
+		/// between requests of a keep-alive connection
+		std::chrono::milliseconds idle = std::chrono::seconds(60);
+		/// for a whole request, from its first byte until its response has been sent. A handler running on the compute
+		/// pool is not interrupted, the request is given up once it has returned
+		std::chrono::milliseconds request = std::chrono::milliseconds(0);
+		/// for the client to close a connection after the error response to a rejected request, 0 closes it right away
+		std::chrono::milliseconds linger = std::chrono::seconds(2);
+	};
+
+	Router		router;
+	Timeouts	timeouts;
+	std::size_t maxBodySize = 64 * 1024 * 1024;
+	/// largest request head, the input buffer of a connection grows up to it while the head arrives
+	std::size_t maxHeaderSize = 16 * 1024;
+	/// threads of the compute pool async routes run on, 0 for one per core. Must be set before listen().
+	unsigned int computeThreads = 0;
+
+   private:
+	/// output that may pile up for pipelined requests before it is sent anyway
+	static constexpr std::size_t PIPELINE_OUTPUT = 64 * 1024;
+
+	void sendError(SocketStream &, HTTPContext &, int status, const std::string &msg);
+	bool receive(SocketStream &, HTTPContext &);
+	bool beginBody(SocketStream &, HTTPContext &);
+	bool readBody(SocketStream &, HTTPContext &);
+	void startJob(SocketStream &, HTTPContext &);
+	void finishJob(SocketStream &, HTTPContext &);
+	void startTask(SocketStream &, HTTPContext &);
+	bool taskReady(SocketStream &, HTTPContext &);
+	/// reads more of the body a coroutine handler waits for, true once it has something to take
+	bool receiveTaskBody(SocketStream &, HTTPContext &);
+	void resumeTask(SocketStream &, HTTPContext &);
+	void finishRequest(SocketStream &, HTTPContext &);
+	/// records the write phase and the access log line of a response that has been handed to the socket
+	void responseSent(SocketStream &, HTTPContext &, std::chrono::steady_clock::time_point now);
+	void serve(SocketStream &, HTTPContext &);
+	bool flushOutput(SocketStream &, HTTPContext &);
+	/// reads and drops the input of a DRAINING connection until the client closes it or its time is up
+	void drainInput(SocketStream &, HTTPContext &);
+	/// whether another request has been received already and the output for the current one may wait for its response
+	static bool pipelined(const SocketBuffer &, const HTTPContext &);
+	void beginResponse(SocketBuffer &, const HTTPContext &);
+	std::chrono::steady_clock::time_point deadline(const HTTPContext &) const;
+	void								  updateDeadline(HTTPContext &);
 
-	Router router;
+	std::unique_ptr<ComputePool> m_pool;
+	Metrics						 m_metrics;
+	int							 m_accessLog = -1;
+	std::string					 m_keepAliveHeaders;	// for the responses to HTTP/1.0 clients that keep the connection
 };
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <array>
 #include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <stdexcept>
 #include <streambuf>
 #include <istream>
+#include <string_view>
+#include <vector>
 #include <netinet/in.h>
 #include <unistd.h>
 
@@ -13,10 +16,11 @@
 #include <arpa/inet.h>
 #include <poll.h>
 
+#include <buffer_pool.hpp>
+#include <output_queue.hpp>
+#include <response.hpp>
 #include <utils.hpp>
 
-#define BUFFER_SIZE 4096
-
 inline void waitREAD(int socket, int timeout = -1) {
 	struct pollfd pfd;
 	pfd.fd		= socket;
@@ -33,29 +37,256 @@ inline void waitWRITE(int socket, int timeout = -1) {
 	if (poll(&pfd, 1, timeout) == -1) { throw std::runtime_error("poll failed"); }
 }
 
+/**
+ * @brief Performs the reads and writes of a SocketBuffer for an I/O backend that does not use plain system calls on
+ * a non-blocking socket, such as one that submits them to io_uring.
+ */
+class SocketIO {
+   public:
+	virtual ~SocketIO() = default;
+
+	/// Like recv with MSG_DONTWAIT: fails with EAGAIN if nothing has been received yet.
+	virtual ssize_t receive(char *dst, std::size_t n) = 0;
+	/**
+	 * @brief Starts sending the queue or continues doing so. Whatever is being sent stays in the queue until it has
+	 * been sent.
+	 *
+	 * @return 0 if everything was sent, 1 if the rest is still on its way and -1 with errno set on error
+	 */
+	virtual int send(OutputQueue &output) = 0;
+	/// Whether sent output has not been confirmed yet.
+	virtual bool sending() const = 0;
+};
+
+/**
+ * @brief Stream buffer of a non-blocking socket. Its input and output buffers are taken from the BufferPool of the
+ * thread that needs them and returned while there is nothing in them, so an idle connection holds no buffer at all.
+ */
 class SocketBuffer : public std::streambuf {
    public:
-	explicit SocketBuffer(int socket_fd) : socket_fd(socket_fd) {
-		setg(buffer, buffer, buffer);
+	static constexpr std::size_t DEFAULT_SIZE = 4096;
+
+	/**
+	 * @param size initial size of the input and output buffers, the input buffer grows with reserve()
+	 */
+	explicit SocketBuffer(int socket_fd, std::size_t size = DEFAULT_SIZE) : socket_fd(socket_fd), size(size) {}
+	~SocketBuffer() override {
+		sync();
+		BufferPool::release(std::move(buffer));
+		BufferPool::release(std::move(output_buffer));
+	}
+
+	/**
+	 * @brief Bytes that have been received but not consumed yet. Views into this range stay valid until the next read
+	 * from the socket.
+	 */
+	std::string_view input() const { return std::string_view(gptr(), egptr() - gptr()); }
+	void			 consume(std::size_t n) { gbump(n); }
+
+	/// Size of the input buffer, 0 while it is not needed.
+	std::size_t capacity() const { return buffer.capacity(); }
+
+	/**
+	 * @brief Grows the input buffer so that it can hold at least n unconsumed bytes.
+	 */
+	void reserve(std::size_t n) {
+		compact();
+		if (n <= buffer.capacity()) return;
+		replaceInput(n);
+	}
+
+	/**
+	 * @brief Returns the buffers to the pool once everything in them has been consumed and sent, or a grown input
+	 * buffer for one of the initial size once a large message has been consumed.
+	 */
+	void shrink() {
+		if (in_message) return;
+		std::size_t pending = egptr() - gptr();
+		if (!pending) releaseInput();
+		else if (buffer.capacity() > size && pending <= size) replaceInput(size);
+
+		if (pptr() == pbase()) {
+			BufferPool::release(std::move(output_buffer));
+			output_buffer = ByteBuffer();
+			setp(nullptr, nullptr);
+		}
+		if (output.empty()) output.shrink();
+	}
+
+	/**
+	 * @brief Moves the unconsumed input to the front of the buffer and reads whatever the socket has available without
+	 * blocking.
+	 *
+	 * @return the number of bytes read, 0 if the peer closed the connection or -1 with errno set (EAGAIN if there is
+	 * nothing to read yet, ENOBUFS if the unconsumed input already fills the buffer)
+	 */
+	ssize_t fill() {
+		acquireInput();
+		compact();
+		std::size_t pending = egptr() - gptr();
+		if (pending == buffer.capacity()) {
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		ssize_t bytes_read = readSocket(buffer.data() + pending, buffer.capacity() - pending);
+		if (bytes_read > 0) {
+			setg(buffer.data(), buffer.data(), buffer.data() + pending + bytes_read);
+		} else if (!pending) {
+			// nothing to keep while the connection waits for more
+			int error = errno;
+			releaseInput();
+			errno = error;
+		}
+		return bytes_read;
+	}
+
+	/**
+	 * @brief Removes n unconsumed bytes starting offset bytes into the input, moving the ones after them back.
+	 */
+	void erase(std::size_t offset, std::size_t n) {
+		if (!n) return;
+		if (!offset) return consume(n);
+		char *from = gptr() + offset;
+		std::memmove(from, from + n, egptr() - from - n);
+		setg(eback(), gptr(), egptr() - n);
+	}
+
+	/**
+	 * @brief Reads from the socket straight into dst without blocking, bypassing the input buffer. Only to be used
+	 * while the input buffer holds nothing the data would have to come after.
+	 *
+	 * @return like recv
+	 */
+	ssize_t receive(char *dst, std::size_t n) { return readSocket(dst, n); }
+
+	/**
+	 * @brief Reads and writes through io instead of the socket from now on. io has to outlive the buffer.
+	 */
+	void setIO(SocketIO *io) { this->io = io; }
+
+	/**
+	 * @brief Makes the stream interface read from the given bytes instead of the input buffer. Past them the stream
+	 * reports end of file instead of reading from the socket.
+	 */
+	void beginMessage(std::string_view message) {
+		saved_input = {eback(), gptr(), egptr()};
+		in_message	= true;
+		char *data	= const_cast<char *>(message.data());
+		setg(data, data, data + message.size());
+	}
+
+	/**
+	 * @brief Returns the stream interface to the input buffer after beginMessage().
+	 */
+	void endMessage() {
+		if (!in_message) return;
+		setg(saved_input[0], saved_input[1], saved_input[2]);
+		in_message = false;
+	}
+
+	/// Whether part of the response is still waiting for the socket to become writable.
+	bool hasPendingOutput() const { return pptr() != pbase() || !output.empty() || (io && io->sending()); }
+	/// Bytes of output waiting for the socket, not counting what output sources have yet to produce.
+	std::size_t pendingOutput() const { return (pptr() - pbase()) + output.size(); }
+	/// While corked, flushing only queues the output, the first flush after uncorking sends it.
+	void cork(bool on) { corked = on; }
+
+	/**
+	 * @brief Adds header lines to the next response written to the buffer, right after its status line, so that
+	 * headers about the connection do not have to be known to whatever writes the response. Headers given earlier and
+	 * not inserted yet are replaced, empty headers cancel them.
+	 *
+	 * @param headers complete lines including their CRLF, must stay valid until they have been inserted
+	 */
+	void insertHeaders(std::string_view headers) {
+		stage();
+		insertion	 = headers;
+		expectStatus = true;
+	}
+	/**
+	 * @brief The status code of the last response written to the buffer, taken from the first status line written
+	 * after insertHeaders() that is not an interim 1xx one. 0 before the first.
+	 */
+	int status() const { return lastStatus; }
+	/// Whether anything has been written since insertHeaders(), that is whether the response it was called for has begun.
+	bool responseBegun() const { return !expectStatus || pptr() != pbase(); }
+	/// Bytes the socket has taken so far, to tell whether a flush made progress.
+	uint64_t written() const { return output.written(); }
+
+	/**
+	 * @brief Queues data after everything written through the stream so far, without copying it into the stream
+	 * buffer.
+	 */
+	void write(std::string &&data) {
+		stage();
+		if (expectStatus) readStatus(data);
+		if (!insertion.empty()) return insert(data, [&](std::string_view part) { output.push(part); });
+		output.push(std::move(data));
+	}
+	void write(std::string_view data, std::shared_ptr<const void> keepAlive) {
+		stage();
+		insert(data, [&](std::string_view part) { output.push(part, keepAlive); });
+	}
+
+	/**
+	 * @brief Queues a response: a copy of head, with the headers of insertHeaders() added, and body, which is copied
+	 * as well unless keepAlive owns the memory it points into. Small responses end up in a single segment.
+	 */
+	void writeResponse(std::string_view head, std::string_view body = {}, std::shared_ptr<const void> keepAlive = nullptr) {
+		stage();
+		insert(head, [&](std::string_view part) { output.push(part); });
+		if (keepAlive) output.push(body, std::move(keepAlive));
+		else output.push(body);
+	}
+
+	/**
+	 * @brief Queues a range of a file to be sent with sendfile. The buffer takes ownership of fd unless keepAlive is
+	 * given to keep it open.
+	 */
+	void sendFile(int fd, off_t offset, std::size_t length, std::shared_ptr<const void> keepAlive = nullptr) {
+		stage();
+		output.pushFile(fd, offset, length, std::move(keepAlive));
+	}
+
+	/**
+	 * @brief Queues a part of the response that source produces while the socket drains.
+	 */
+	void writeSource(std::unique_ptr<OutputSource> source) {
+		stage();
+		output.pushSource(std::move(source));
+	}
 
-		setp(output_buffer, output_buffer + BUFFER_SIZE);
+	/**
+	 * @brief Moves the output of a buffer without a socket, which collected the response of a handler that ran on
+	 * another thread, behind the output of this buffer.
+	 */
+	void append(SocketBuffer &other) {
+		stage();
+		other.stage();
+		output.append(std::move(other.output));
+		if (other.lastStatus) lastStatus = other.lastStatus;
 	}
-	~SocketBuffer() override { sync(); }
 
    protected:
 	int_type underflow() override {
+		if (in_message) { return traits_type::eof(); }
 		if (gptr() == egptr()) {
-			ssize_t bytes_read = read(socket_fd, buffer, BUFFER_SIZE);
-			if (bytes_read <= 0) { throw std::runtime_error("failed to read from socket"); }
-			// if (bytes_read == 0) { return traits_type::eof(); }
+			acquireInput();
+			ssize_t bytes_read = readSocket(buffer.data(), buffer.capacity());
+			if (bytes_read <= 0) { return traits_type::eof(); }
 
-			setg(buffer, buffer, buffer + bytes_read);
+			setg(buffer.data(), buffer.data(), buffer.data() + bytes_read);
 		}
 		return traits_type::to_int_type(*gptr());
 	}
 
 	int_type overflow(int_type ch) override {
-		if (sync() == -1) { return traits_type::eof(); }
+		stage();
+		if (!output_buffer.capacity()) {
+			output_buffer = BufferPool::acquire(size);
+			setp(output_buffer.data(), output_buffer.data() + output_buffer.capacity());
+		}
 		if (ch != traits_type::eof()) {
 			*pptr() = traits_type::to_char_type(ch);
 			pbump(1);
@@ -63,28 +294,96 @@ class SocketBuffer : public std::streambuf {
 		return traits_type::not_eof(ch);
 	}
 
+	/**
+	 * @brief Sends as much of the queued output as the socket accepts without blocking on non-blocking sockets.
+	 * Whatever is left stays queued until the next call.
+	 */
 	int sync() override {
-		ssize_t bytes_to_write = pptr() - pbase();
-		if (bytes_to_write > 0) {
-			ssize_t bytes_written = send(socket_fd, output_buffer, bytes_to_write, 0);
-			if (bytes_written <= 0) {
-				waitWRITE(socket_fd);
-				bytes_written = send(socket_fd, output_buffer, bytes_to_write, 0);
-			}
-
-			if (bytes_written < 0) {
-				dbLog(dbg::LOG_WARNING, "Failed to write to socket: ", strerror(errno));
-				return -1;
-			}
-			pbump(-bytes_written);
+		stage();
+		// without a socket the output stays queued until append() moves it to a connection
+		if (socket_fd < 0 || corked) return 0;
+		if ((io ? io->send(output) : output.flush(socket_fd)) < 0) {
+			dbLog(dbg::LOG_WARNING, "Failed to write to socket: ", strerror(errno));
+			return -1;
 		}
 		return 0;
 	}
 
    private:
-	int	 socket_fd;
-	char buffer[BUFFER_SIZE];
-	char output_buffer[BUFFER_SIZE];
+	ssize_t readSocket(char *dst, std::size_t n) {
+		return io ? io->receive(dst, n) : recv(socket_fd, dst, n, MSG_DONTWAIT);
+	}
+
+	/// Moves the bytes written through the stream interface to the output queue.
+	void stage() {
+		if (pptr() == pbase()) return;
+		insert(std::string_view(pbase(), pptr() - pbase()), [&](std::string_view part) { output.push(part); });
+		setp(pbase(), epptr());
+	}
+
+	/// Passes data on to push, with the pending headers of insertHeaders() after the status line if it ends in data.
+	template <class Push>
+	void insert(std::string_view data, Push &&push) {
+		if (expectStatus) readStatus(data);
+		std::size_t end = insertion.empty() ? std::string_view::npos : data.find('\n');
+		if (end == std::string_view::npos) return push(data);
+		push(data.substr(0, end + 1));
+		output.push(insertion);
+		insertion = {};
+		if (end + 1 < data.size()) push(data.substr(end + 1));
+	}
+
+	/// Takes the status code from data if it starts with a status line, "HTTP/1.1 200 ...".
+	void readStatus(std::string_view data) {
+		if (data.empty()) return;
+		bool statusLine = data.size() >= 12 && data.starts_with("HTTP/1.");
+		// an interim response such as 100 Continue is followed by the final one
+		if (statusLine && data[9] == '1') return;
+		expectStatus = false;
+		if (statusLine) lastStatus = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+	}
+
+	void compact() {
+		std::size_t pending = egptr() - gptr();
+		if (gptr() == buffer.data()) return;
+		std::memmove(buffer.data(), gptr(), pending);
+		setg(buffer.data(), buffer.data(), buffer.data() + pending);
+	}
+
+	void acquireInput() {
+		if (buffer.capacity()) return;
+		buffer = BufferPool::acquire(size);
+		setg(buffer.data(), buffer.data(), buffer.data());
+	}
+
+	void releaseInput() {
+		BufferPool::release(std::move(buffer));
+		buffer = ByteBuffer();
+		setg(nullptr, nullptr, nullptr);
+	}
+
+	/// Moves the unconsumed input into a buffer of the given capacity from the pool.
+	void replaceInput(std::size_t capacity) {
+		std::size_t pending = egptr() - gptr();
+		ByteBuffer	other	= BufferPool::acquire(std::max(capacity, pending));
+		if (pending) std::memcpy(other.data(), gptr(), pending);
+		BufferPool::release(std::move(buffer));
+		buffer = std::move(other);
+		setg(buffer.data(), buffer.data(), buffer.data() + pending);
+	}
+
+	int					  socket_fd;
+	SocketIO			 *io = nullptr;
+	std::size_t			  size;
+	ByteBuffer			  buffer;				 // input, only its capacity is used
+	bool				  in_message  = false;	 // the get area points to a message given to beginMessage()
+	bool				  corked	  = false;
+	std::array<char *, 3> saved_input = {};		 // the get area of the input buffer meanwhile
+	ByteBuffer			  output_buffer;		 // put area of the stream interface
+	std::string_view	  insertion;			 // headers for insertHeaders()
+	bool				  expectStatus = false;	 // the next output written starts a response
+	int					  lastStatus   = 0;
+	OutputQueue			  output;
 };
 
 class Socket {
@@ -110,6 +409,13 @@ class Socket {
 
 	operator int() const { return this->socket; }
 
+	/// Gives up ownership of the descriptor, which is no longer closed by the destructor.
+	int release() {
+		int fd		 = this->socket;
+		this->socket = -1;
+		return fd;
+	}
+
 	const sockaddr_in6 &getAddr() const { return this->addr; }
 	void				setAddr(const sockaddr_in6 &addr) { this->addr = addr; }
 
@@ -124,7 +430,8 @@ class Socket {
 
 class SocketStream : public std::iostream {
    public:
-	SocketStream(const Socket &s) : std::iostream(&buffer), buffer((int)s), socket(&s) {}
+	SocketStream(const Socket &s, std::size_t bufferSize = SocketBuffer::DEFAULT_SIZE)
+		: std::iostream(&buffer), buffer((int)s, bufferSize), socket(&s) {}
 	// SocketStream(SocketStream &&s) : std::iostream(&s.buffer), buffer(std::move(s.buffer)), socket(s.socket) {
 	//	s.socket = nullptr;
 	// }
@@ -132,51 +439,40 @@ class SocketStream : public std::iostream {
 	SocketStream(int socket) : std::iostream(&buffer), buffer(socket), socket(nullptr) {}
 
 	~SocketStream() override { this->flush(); }
-	SocketStream &operator=(SocketStream &&s) {
-		this->buffer = std::move(s.buffer);
-		this->socket = s.socket;
-		s.socket	 = nullptr;
-		return *this;
-	}
+	// the buffer owns queued output that has not reached the socket yet
+	SocketStream &operator=(SocketStream &&s) = delete;
 	const Socket &getSocket() { return *socket; }
+	SocketBuffer &getBuffer() { return buffer; }
+
+	/**
+	 * @brief Sends a response with the reason phrase msg as its HTML body.
+	 */
+	void status(int status, std::string_view msg) {
+		ResponseHead head(status, msg);
+		head.header(ResponseHead::CONTENT_TYPE, "text/html; charset=utf-8")
+			.header(ResponseHead::CONTENT_LENGTH, msg.size());
+		send(head, msg);
+	}
 
-	void status(int status, const std::string &msg) {
-		if (status < 0) { throw std::runtime_error("invalid status code"); }
-		this->clear();
-		(*this) << "HTTP/1.1 " << status << ' ' << msg
-				<< "\r\n"
-				   "Content-Type: text/html\r\n"
-				   "Content-Length: "
-				<< msg.size() << "\r\n\r\n"
-				<< msg << std::flush;
+	/**
+	 * @brief Sends a response with content as its body, which is copied unless keepAlive owns the memory it points
+	 * into.
+	 */
+	void send(int status, std::string_view msg, std::string_view content_type, std::string_view content,
+			  std::shared_ptr<const void> keepAlive = nullptr) {
+		ResponseHead head(status, msg);
+		head.header(ResponseHead::CONTENT_TYPE, content_type).header(ResponseHead::CONTENT_LENGTH, content.size());
+		send(head, content, std::move(keepAlive));
 	}
 
-	void send(int status, const std::string &msg, const std::string &content_type, const std::string &content) {
-		if (status < 0) { throw std::runtime_error("invalid status code"); }
-		this->clear();
-		(*this) << "HTTP/1.1 " << status << ' ' << msg
-				<< "\r\n"
-				   "Content-Type: "
-				<< content_type
-				<< "\r\n"
-				   "Content-Length: "
-				<< content.size() << "\r\n\r\n"
-				<< content << std::flush;
-	}
-
-	void send(int status, const std::string &msg, const std::string &content_type, std::istream &content) {
-		if (status < 0) { throw std::runtime_error("invalid status code"); }
+	/**
+	 * @brief Sends a response with any headers. The body is copied unless keepAlive owns the memory it points into, its
+	 * Content-Length is up to the head.
+	 */
+	void send(const ResponseHead &head, std::string_view content = {}, std::shared_ptr<const void> keepAlive = nullptr) {
 		this->clear();
-		(*this) << "HTTP/1.1 " << status << ' ' << msg
-				<< "\r\n"
-				   "Content-Type: "
-				<< content_type
-				<< "\r\n"
-				   "Content-Length: ";
-		content.seekg(0, std::ios::end);
-		(*this) << content.tellg() << "\r\n\r\n";
-		content.seekg(0, std::ios::beg);
-		(*this) << content.rdbuf() << std::flush;
+		buffer.writeResponse(head.view(), content, std::move(keepAlive));
+		this->flush();
 	}
 
    private:
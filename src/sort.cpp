@@ -0,0 +1,406 @@
+#include <sort.hpp>
+
+#include <algorithm>
+#include <barrier>
+#include <bit>
+#include <charconv>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SORT_X86 1
+#endif
+
+/**
+ * @brief Classification of a 32 byte block, bit i of each mask describes byte i.
+ */
+struct BlockMasks {
+	uint32_t digits, separators, minus, plus;
+};
+
+static bool isSeparator(unsigned char c) { return c == ' ' || c == ',' || (c >= '\t' && c <= '\r'); }
+
+struct ScalarClassifier {
+	BlockMasks operator()(const char *p) const {
+		BlockMasks m{0, 0, 0, 0};
+		for (unsigned i = 0; i < 32; i++) {
+			unsigned char c = p[i];
+			m.digits |= uint32_t(unsigned(c - '0') < 10) << i;
+			m.separators |= uint32_t(isSeparator(c)) << i;
+			m.minus |= uint32_t(c == '-') << i;
+			m.plus |= uint32_t(c == '+') << i;
+		}
+		return m;
+	}
+};
+
+#ifdef SORT_X86
+/// Bytes of c with lo <= c <= lo + n.
+static inline __m128i inRange(__m128i c, char lo, char n) {
+	__m128i x = _mm_sub_epi8(c, _mm_set1_epi8(lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(n)), x);
+}
+
+struct SSE2Classifier {
+	BlockMasks operator()(const char *p) const {
+		BlockMasks m{0, 0, 0, 0};
+		for (unsigned half = 0; half < 2; half++) {
+			__m128i c		   = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * half));
+			__m128i separators = _mm_or_si128(
+				inRange(c, '\t', '\r' - '\t'),
+				_mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(c, _mm_set1_epi8(','))));
+			unsigned shift = 16 * half;
+			m.digits |= uint32_t(_mm_movemask_epi8(inRange(c, '0', 9))) << shift;
+			m.separators |= uint32_t(_mm_movemask_epi8(separators)) << shift;
+			m.minus |= uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('-')))) << shift;
+			m.plus |= uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8('+')))) << shift;
+		}
+		return m;
+	}
+};
+
+struct AVX2Classifier {
+	__attribute__((target("avx2"))) static inline __m256i inRange(__m256i c, char lo, char n) {
+		__m256i x = _mm256_sub_epi8(c, _mm256_set1_epi8(lo));
+		return _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(n)), x);
+	}
+
+	__attribute__((target("avx2"))) BlockMasks operator()(const char *p) const {
+		__m256i c		   = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		__m256i separators = _mm256_or_si256(
+			inRange(c, '\t', '\r' - '\t'),
+			_mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(c, _mm256_set1_epi8(','))));
+		return {
+			uint32_t(_mm256_movemask_epi8(inRange(c, '0', 9))),
+			uint32_t(_mm256_movemask_epi8(separators)),
+			uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('-')))),
+			uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('+')))),
+		};
+	}
+};
+#endif
+
+/**
+ * @brief Converts 1 to 8 digits at p at once. The 8 bytes at p must be readable.
+ */
+static inline uint64_t parseDigits8(const char *p, unsigned len) {
+	uint64_t v;
+	std::memcpy(&v, p, 8);
+	if constexpr (std::endian::native == std::endian::big) v = __builtin_bswap64(v);
+	// move the digits to the top, the bytes after them fall off and zero bytes come in as leading zeros
+	v <<= 8 * (8 - len);
+	v = ((v & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+	v = ((v & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+	return ((v & 0x0000FFFF0000FFFF) * 42949672960001) >> 32;
+}
+
+/**
+ * @brief Converts the len digits at p to a T. At least 8 bytes after the digits must be readable.
+ */
+template <class T>
+static inline bool convert(const char *p, unsigned len, bool negative, T &out) {
+	using U = std::make_unsigned_t<T>;
+	while (len > 1 && *p == '0') p++, len--;
+	if (len > std::numeric_limits<T>::digits10 + 1u) return false;
+
+	uint64_t v;
+	if (len <= 8) v = parseDigits8(p, len);
+	else if (len <= 16) v = parseDigits8(p, len - 8) * 100000000 + parseDigits8(p + len - 8, 8);
+	else
+		v = parseDigits8(p, len - 16) * 10000000000000000 + parseDigits8(p + len - 16, 8) * 100000000 +
+			parseDigits8(p + len - 8, 8);
+
+	if (v > uint64_t(std::numeric_limits<T>::max()) + negative) return false;
+	out = T(negative ? U(0) - U(v) : U(v));
+	return true;
+}
+
+/**
+ * @brief Where parseBlocks() left off. Bit 0 of each field describes the byte before the next block.
+ */
+struct ParseState {
+	uint32_t digit = 0, sign = 0, minus = 0;
+};
+
+/**
+ * @brief Parses the numbers that start in whole 32 byte blocks from begin while at least 64 bytes are left, so that
+ * a number starting in a block always ends inside the next one.
+ *
+ * @return the start of the first block that was not parsed, nullptr on error
+ */
+template <class T, class Classifier>
+[[gnu::always_inline]] static inline const char *parseBlocks(const char *begin, const char *end, ParseState &state,
+															 std::vector<T> &out, Classifier classify) {
+	const char *p = begin;
+	if (end - p < 64) return p;
+
+	BlockMasks current = classify(p);
+	while (end - p >= 64) {
+		BlockMasks next = classify(p + 32);
+		uint32_t   signs = current.minus | current.plus;
+		if (~(current.digits | current.separators | signs)) return nullptr;
+
+		uint64_t digits = current.digits | uint64_t(next.digits) << 32;
+		// a sign has to be followed by a digit and cannot follow a digit or another sign
+		uint32_t before = (current.digits | signs) << 1 | state.digit | state.sign;
+		if ((signs & ~uint32_t(digits >> 1)) || (signs & before)) return nullptr;
+
+		uint32_t starts = current.digits & ~(current.digits << 1 | state.digit);
+		uint32_t minus	= current.minus << 1 | state.minus;
+		while (starts) {
+			unsigned s = std::countr_zero(starts);
+			starts &= starts - 1;
+			unsigned len	  = std::countr_zero(~(digits >> s));
+			bool	 negative = (minus >> s) & 1;
+
+			T value;
+			if (s + len < 64) {
+				if (!convert(p + s, len, negative, value)) return nullptr;
+			} else {
+				// a run of digits longer than the rest of the window, which is only valid with leading zeros
+				using U		  = std::make_unsigned_t<T>;
+				const char *q = p + s, *e = q;
+				while (e != end && unsigned(*e - '0') < 10) e++;
+				U u;
+				auto [ptr, ec] = std::from_chars(q, e, u);
+				if (ec != std::errc() || u > U(std::numeric_limits<T>::max()) + negative) return nullptr;
+				value = T(negative ? U(0) - u : u);
+			}
+			out.push_back(value);
+		}
+
+		state = {current.digits >> 31, signs >> 31, current.minus >> 31};
+		current = next;
+		p += 32;
+	}
+	return p;
+}
+
+template <class T, class Classifier>
+[[gnu::always_inline]] static inline bool parseWith(std::string_view text, std::vector<T> &out, Classifier classify) {
+	ParseState	state;
+	const char *p = parseBlocks(text.data(), text.data() + text.size(), state, out, classify);
+	if (!p) return false;
+
+	// the last blocks are parsed from a copy padded with spaces
+	char		padded[96];
+	std::size_t rest = text.data() + text.size() - p;
+	std::memcpy(padded, p, rest);
+	std::memset(padded + rest, ' ', sizeof(padded) - rest);
+	return parseBlocks(padded, padded + sizeof(padded), state, out, classify) != nullptr;
+}
+
+#ifdef SORT_X86
+template <class T>
+__attribute__((target("avx2"))) static bool parseAVX2(std::string_view text, std::vector<T> &out) {
+	return parseWith(text, out, AVX2Classifier());
+}
+
+static bool hasAVX2() {
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2;
+}
+#endif
+
+template <class T>
+bool parseIntegers(std::string_view text, std::vector<T> &out) {
+	// most numbers take more than 8 characters with their separator, the text may also be one of many pieces
+	std::size_t expected = out.size() + text.size() / 8;
+	if (expected > out.capacity()) out.reserve(std::max(expected, out.capacity() * 2));
+#ifdef SORT_X86
+	if (hasAVX2()) return parseAVX2(text, out);
+	return parseWith(text, out, SSE2Classifier());
+#else
+	return parseWith(text, out, ScalarClassifier());
+#endif
+}
+
+/**
+ * @brief The byte of key that a pass sorts by. The sign bit is flipped so that negative numbers come first.
+ */
+template <class U>
+static inline unsigned radixDigit(U key, unsigned pass) {
+	unsigned digit = (key >> (8 * pass)) & 0xFF;
+	return pass == sizeof(U) - 1 ? digit ^ 0x80 : digit;
+}
+
+template <class U>
+static void radixSortSerial(U *data, U *tmp, std::size_t n) {
+	constexpr unsigned PASSES = sizeof(U);
+	std::size_t		   counts[PASSES][256] = {};
+	for (std::size_t i = 0; i < n; i++) {
+		for (unsigned pass = 0; pass < PASSES; pass++) counts[pass][radixDigit(data[i], pass)]++;
+	}
+
+	U *src = data, *dst = tmp;
+	for (unsigned pass = 0; pass < PASSES; pass++) {
+		std::size_t *count = counts[pass];
+		if (count[radixDigit(src[0], pass)] == n) continue;
+
+		std::size_t offsets[256];
+		for (std::size_t b = 0, sum = 0; b < 256; b++) {
+			offsets[b] = sum;
+			sum += count[b];
+		}
+		for (std::size_t i = 0; i < n; i++) dst[offsets[radixDigit(src[i], pass)]++] = src[i];
+		std::swap(src, dst);
+	}
+	if (src != data) std::memcpy(data, src, n * sizeof(U));
+}
+
+/**
+ * @brief Every thread owns a contiguous part of the array. For each pass it counts the digits in its part, waits for
+ * the others, computes where its elements go from all the counts and scatters them.
+ */
+template <class U>
+static void radixSortParallel(U *data, U *tmp, std::size_t n, unsigned threads) {
+	constexpr unsigned PASSES = sizeof(U);
+	using Counts			  = std::size_t[256];
+
+	std::unique_ptr<Counts[]> counts(new Counts[threads]);
+	bool					  skip[PASSES];
+	std::barrier			  sync(threads);
+
+	auto worker = [&](unsigned t) {
+		std::size_t from = n * t / threads, to = n * (t + 1) / threads;
+		Counts	   &count = counts[t];
+
+		// a first round over all bytes finds the passes that would not move anything
+		std::size_t total[PASSES][256] = {};
+		for (std::size_t i = from; i < to; i++) {
+			for (unsigned pass = 0; pass < PASSES; pass++) total[pass][radixDigit(data[i], pass)]++;
+		}
+		for (unsigned pass = 0; pass < PASSES; pass++) {
+			std::memcpy(count, total[pass], sizeof(Counts));
+			sync.arrive_and_wait();
+			if (t == 0) {
+				std::size_t sum = 0;
+				for (unsigned u = 0; u < threads; u++) sum += counts[u][radixDigit(data[0], pass)];
+				skip[pass] = sum == n;
+			}
+			sync.arrive_and_wait();
+		}
+
+		U *src = data, *dst = tmp;
+		for (unsigned pass = 0; pass < PASSES; pass++) {
+			if (skip[pass]) continue;
+
+			std::fill(std::begin(count), std::end(count), 0);
+			for (std::size_t i = from; i < to; i++) count[radixDigit(src[i], pass)]++;
+			sync.arrive_and_wait();
+
+			std::size_t offsets[256];
+			for (std::size_t b = 0, sum = 0; b < 256; b++) {
+				for (unsigned u = 0; u < threads; u++) {
+					if (u == t) offsets[b] = sum;
+					sum += counts[u][b];
+				}
+			}
+			for (std::size_t i = from; i < to; i++) dst[offsets[radixDigit(src[i], pass)]++] = src[i];
+			// the counts of this pass must not be overwritten before everyone has computed their offsets
+			sync.arrive_and_wait();
+			std::swap(src, dst);
+		}
+		if (src != data) std::memcpy(data + from, src + from, (to - from) * sizeof(U));
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; t++) pool.emplace_back(worker, t);
+	worker(0);
+	for (std::thread &thread : pool) thread.join();
+}
+
+template <class T>
+void radixSort(T *data, std::size_t n, unsigned threads) {
+	using U = std::make_unsigned_t<T>;
+	if (n < RADIX_SORT_THRESHOLD) {
+		std::sort(data, data + n);
+		return;
+	}
+
+	if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+	// every thread should get a sizeable part of the array
+	threads = std::min<std::size_t>(threads, n / (PARALLEL_SORT_THRESHOLD / 4));
+
+	std::unique_ptr<U[]> tmp(new U[n]);
+	U					*keys = reinterpret_cast<U *>(data);
+	if (n < PARALLEL_SORT_THRESHOLD || threads < 2) radixSortSerial(keys, tmp.get(), n);
+	else radixSortParallel(keys, tmp.get(), n, threads);
+}
+
+static constexpr char DIGIT_PAIRS[] = "00010203040506070809"
+									  "10111213141516171819"
+									  "20212223242526272829"
+									  "30313233343536373839"
+									  "40414243444546474849"
+									  "50515253545556575859"
+									  "60616263646566676869"
+									  "70717273747576777879"
+									  "80818283848586878889"
+									  "90919293949596979899";
+
+template <class U>
+static inline unsigned digitCount(U v) {
+	for (unsigned n = 1;; n += 4) {
+		if (v < 10) return n;
+		if (v < 100) return n + 1;
+		if (v < 1000) return n + 2;
+		if (v < 10000) return n + 3;
+		v /= 10000;
+	}
+}
+
+template <class T>
+char *writeInteger(char *p, T value) {
+	using U = std::make_unsigned_t<T>;
+	U u		= U(value);
+	if (value < 0) {
+		*p++ = '-';
+		u	 = U(0) - u;
+	}
+
+	char *end = p + digitCount(u);
+	char *q	  = end;
+	while (u >= 100) {
+		q -= 2;
+		std::memcpy(q, DIGIT_PAIRS + (u % 100) * 2, 2);
+		u /= 100;
+	}
+	if (u >= 10) std::memcpy(q - 2, DIGIT_PAIRS + u * 2, 2);
+	else q[-1] = char('0' + u);
+	return end;
+}
+
+template <class T>
+char *writeIntegerList(char *out, const T *values, std::size_t n, std::string_view separator) {
+	for (std::size_t i = 0; i < n; i++) {
+		if (i) {
+			std::memcpy(out, separator.data(), separator.size());
+			out += separator.size();
+		}
+		out = writeInteger(out, values[i]);
+	}
+	return out;
+}
+
+template <class T>
+char *writeJSONArray(char *out, const T *values, std::size_t n) {
+	*out++ = '[';
+	out	   = writeIntegerList(out, values, n, ", ");
+	*out++ = ']';
+	return out;
+}
+
+template bool  parseIntegers(std::string_view, std::vector<int32_t> &);
+template bool  parseIntegers(std::string_view, std::vector<int64_t> &);
+template void  radixSort(int32_t *, std::size_t, unsigned);
+template void  radixSort(int64_t *, std::size_t, unsigned);
+template char *writeInteger(char *, int32_t);
+template char *writeInteger(char *, int64_t);
+template char *writeIntegerList(char *, const int32_t *, std::size_t, std::string_view);
+template char *writeIntegerList(char *, const int64_t *, std::size_t, std::string_view);
+template char *writeJSONArray(char *, const int32_t *, std::size_t);
+template char *writeJSONArray(char *, const int64_t *, std::size_t);
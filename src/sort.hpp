@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+/// Below this many elements radixSort() falls back to std::sort.
+constexpr std::size_t RADIX_SORT_THRESHOLD = 512;
+/// From this many elements on radixSort() splits every pass between threads.
+constexpr std::size_t PARALLEL_SORT_THRESHOLD = 256 * 1024;
+
+/**
+ * @brief Parses decimal integers separated by whitespace or commas and appends them to out. Each number may have a
+ * '+' or '-' sign directly in front of it.
+ *
+ * Uses AVX2 or SSE2 to classify 32 bytes at a time and converts up to eight digits at once, with a scalar fallback on
+ * other architectures.
+ *
+ * @return false if the text contains anything else or a number does not fit in T
+ */
+template <class T>
+bool parseIntegers(std::string_view text, std::vector<T> &out);
+
+/**
+ * @brief Sorts ascending with an LSD radix sort over bytes, skipping the passes where all elements share the byte.
+ *
+ * @param threads threads to split the passes between from PARALLEL_SORT_THRESHOLD elements on, 0 for one per core
+ */
+template <class T>
+void radixSort(T *data, std::size_t n, unsigned threads = 0);
+
+/// The most characters writeInteger() writes for a T, including the sign.
+template <class T>
+constexpr std::size_t MAX_INTEGER_CHARS = std::numeric_limits<T>::digits10 + 2;
+
+/**
+ * @brief Writes value in decimal at p, like std::to_chars with enough room.
+ *
+ * @return the end of the written characters
+ */
+template <class T>
+char *writeInteger(char *p, T value);
+
+/// The most characters writeIntegerList() writes for n elements with the given separator length.
+template <class T>
+constexpr std::size_t maxIntegerListSize(std::size_t n, std::size_t separator) {
+	return n * (MAX_INTEGER_CHARS<T> + separator);
+}
+
+/**
+ * @brief Writes the values in decimal with separator between them at out, which needs room for
+ * maxIntegerListSize<T>(n, separator.size()) characters.
+ *
+ * @return the end of the written characters
+ */
+template <class T>
+char *writeIntegerList(char *out, const T *values, std::size_t n, std::string_view separator);
+
+/// The most characters writeJSONArray() writes for n elements.
+template <class T>
+constexpr std::size_t maxJSONArraySize(std::size_t n) {
+	return 2 + n * (MAX_INTEGER_CHARS<T> + 2);
+}
+
+/**
+ * @brief Writes the values as a JSON array, "[1, 2, 3]", at out, which needs room for maxJSONArraySize<T>(n)
+ * characters.
+ *
+ * @return the end of the written characters
+ */
+template <class T>
+char *writeJSONArray(char *out, const T *values, std::size_t n);
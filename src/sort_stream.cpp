@@ -0,0 +1,553 @@
+#include <sort_stream.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "socket.hpp"
+#include "sort.hpp"
+
+enum class InputFormat { TEXT, ARRAY, FRAMES };
+enum OutputFormat { JSON, NDJSON, TEXT, INT32, INT64 };
+
+/// Indexed by OutputFormat, in the order the server prefers them.
+static constexpr std::string_view OUTPUT_TYPES[] = {"application/json", "application/x-ndjson", "text/plain",
+													"application/x-int32", "application/x-int64"};
+
+/**
+ * @brief How the numbers of a text response are written, indexed by OutputFormat.
+ */
+struct TextLayout {
+	std::string_view prefix, separator, suffix;
+};
+static constexpr TextLayout TEXT_LAYOUTS[] = {{"[", ", ", "]"}, {"", "\n", "\n"}, {"", " ", "\n"}};
+
+static constexpr std::string_view SEPARATORS = " \t\n\v\f\r,";
+
+/// The longest number (with its leading zeros) that is kept while waiting for the rest of it.
+static constexpr std::size_t MAX_NUMBER_LENGTH = 4096;
+
+/// Memory limits below this are raised to it, so that runs do not get absurdly short.
+static constexpr std::size_t MIN_MEMORY_LIMIT = 1024 * 1024;
+
+/**
+ * @brief Converts between little-endian and native byte order.
+ */
+template <class T>
+static T littleEndian(T v) {
+	if constexpr (std::endian::native == std::endian::big) {
+		if constexpr (sizeof(T) == 4) return T(__builtin_bswap32(uint32_t(v)));
+		else return T(__builtin_bswap64(uint64_t(v)));
+	}
+	return v;
+}
+
+/**
+ * @brief A sorted run of numbers in the temporary file of a request, offset and count in elements.
+ */
+struct Run {
+	std::size_t offset, count;
+};
+
+/**
+ * @brief Merges sorted runs (mapped from the temporary file) and the sorted numbers that were left in memory into
+ * the response while the socket drains. Text responses are sent with chunked transfer encoding.
+ */
+template <class T>
+class RunMerger : public OutputSource {
+   public:
+	/// The response is produced in pieces of about this size.
+	static constexpr std::size_t BLOCK_SIZE = 256 * 1024;
+
+	/**
+	 * @brief Takes ownership of fd and of the numbers in rest.
+	 */
+	RunMerger(int fd, const std::vector<Run> &runs, std::vector<T> &&rest, int format)
+		: m_format(format), m_rest(std::move(rest)), m_block(new char[BLOCK_SIZE + CHUNK_OVERHEAD]) {
+		std::size_t count = 0;
+		for (const Run &run : runs) count = std::max(count, run.offset + run.count);
+		if (count) {
+			m_mappedSize = count * sizeof(T);
+			void *map	 = mmap(nullptr, m_mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (map != MAP_FAILED) {
+				m_mapped = static_cast<const T *>(map);
+				madvise(map, m_mappedSize, MADV_SEQUENTIAL);
+			}
+		}
+		if (fd >= 0) close(fd);
+
+		if (m_mapped) {
+			for (const Run &run : runs) {
+				const T *begin = m_mapped + run.offset;
+				m_heap.push_back({begin, begin + run.count, pageStart(begin)});
+			}
+		}
+		if (!m_rest.empty()) m_heap.push_back({m_rest.data(), m_rest.data() + m_rest.size(), nullptr});
+		for (std::size_t i = m_heap.size() / 2; i-- > 0;) siftDown(i);
+	}
+
+	~RunMerger() override {
+		if (m_mapped) munmap(const_cast<T *>(m_mapped), m_mappedSize);
+	}
+
+	/// Whether the temporary file could be mapped, otherwise there is nothing to merge.
+	bool valid(const std::vector<Run> &runs) const { return runs.empty() || m_mapped; }
+
+	/// The memory the merge needs apart from the mapped runs.
+	std::size_t memoryUse() const {
+		return BLOCK_SIZE + CHUNK_OVERHEAD + m_rest.capacity() * sizeof(T) + m_heap.capacity() * sizeof(Cursor);
+	}
+
+	bool next(std::string_view &data) override {
+		if (m_done) {
+			data = std::string_view();
+			return true;
+		}
+		data = m_format == INT32 || m_format == INT64 ? binary() : text();
+		dropConsumed();
+		return true;
+	}
+
+   private:
+	/// Room for the chunk size line in front of a block and the end of the chunk (and the last chunk) after it.
+	static constexpr std::size_t CHUNK_HEAD		= 16;
+	static constexpr std::size_t CHUNK_OVERHEAD = CHUNK_HEAD + 16;
+	/// Consumed parts of the mapped runs are dropped from memory in steps of this size.
+	static constexpr std::size_t DROP_STEP = 1024 * 1024;
+
+	struct Cursor {
+		const T	   *pos, *end;
+		const char *dropped;	 // nullptr for the numbers in memory
+	};
+
+	void siftDown(std::size_t i) {
+		Cursor		c = m_heap[i];
+		std::size_t n = m_heap.size();
+		for (;;) {
+			std::size_t child = 2 * i + 1;
+			if (child >= n) break;
+			if (child + 1 < n && *m_heap[child + 1].pos < *m_heap[child].pos) child++;
+			if (*c.pos <= *m_heap[child].pos) break;
+			m_heap[i] = m_heap[child];
+			i		  = child;
+		}
+		m_heap[i] = c;
+	}
+
+	T pop() {
+		Cursor &top	  = m_heap.front();
+		T		value = *top.pos++;
+		if (top.pos == top.end) {
+			drop(top, reinterpret_cast<const char *>(top.end));
+			top = m_heap.back();
+			m_heap.pop_back();
+		}
+		if (!m_heap.empty()) siftDown(0);
+		return value;
+	}
+
+	static const char *pageStart(const void *p) {
+		static const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+		return reinterpret_cast<const char *>(reinterpret_cast<uintptr_t>(p) & ~(pageSize - 1));
+	}
+
+	/**
+	 * @brief Drops the pages of a run before until. A page shared with the previous run is read again from the file if
+	 * that run still needs it.
+	 */
+	void drop(Cursor &c, const char *until) {
+		if (!c.dropped) return;
+		const char *aligned = pageStart(until);
+		if (aligned <= c.dropped) return;
+		madvise(const_cast<char *>(c.dropped), aligned - c.dropped, MADV_DONTNEED);
+		c.dropped = aligned;
+	}
+
+	/// Lets the kernel reclaim the pages of the runs that have been merged already.
+	void dropConsumed() {
+		for (Cursor &c : m_heap) {
+			const char *pos = reinterpret_cast<const char *>(c.pos);
+			if (c.dropped && std::size_t(pos - c.dropped) >= DROP_STEP) drop(c, pos);
+		}
+	}
+
+	std::string_view binary() {
+		char *begin = m_block.get(), *p = begin, *end = begin + BLOCK_SIZE;
+		if (m_format == INT64) {
+			for (; p + sizeof(int64_t) <= end && !m_heap.empty(); p += sizeof(int64_t)) {
+				int64_t x = littleEndian(int64_t(pop()));
+				std::memcpy(p, &x, sizeof(x));
+			}
+		} else {
+			for (; p + sizeof(T) <= end && !m_heap.empty(); p += sizeof(T)) {
+				T x = littleEndian(pop());
+				std::memcpy(p, &x, sizeof(x));
+			}
+		}
+		m_done = m_heap.empty();
+		return std::string_view(begin, p - begin);
+	}
+
+	std::string_view text() {
+		const TextLayout &layout = TEXT_LAYOUTS[m_format];
+		char			 *begin = m_block.get() + CHUNK_HEAD, *p = begin;
+		char			 *limit = begin + BLOCK_SIZE - MAX_INTEGER_CHARS<T> - layout.separator.size();
+
+		if (m_first) {
+			p = std::copy(layout.prefix.begin(), layout.prefix.end(), p);
+			if (!m_heap.empty()) p = writeInteger(p, pop());
+			m_first = false;
+		}
+		while (p < limit && !m_heap.empty()) {
+			p = std::copy(layout.separator.begin(), layout.separator.end(), p);
+			p = writeInteger(p, pop());
+		}
+		m_done = m_heap.empty();
+		if (m_done) p = std::copy(layout.suffix.begin(), layout.suffix.end(), p);
+
+		// frame the block as a chunk
+		char		size[CHUNK_HEAD];
+		int			n	  = snprintf(size, sizeof(size), "%zx\r\n", std::size_t(p - begin));
+		char	   *chunk = begin - n;
+		std::memcpy(chunk, size, n);
+		std::string_view end = m_done ? "\r\n0\r\n\r\n" : "\r\n";
+		p					 = std::copy(end.begin(), end.end(), p);
+		return std::string_view(chunk, p - chunk);
+	}
+
+	int						m_format;
+	std::vector<T>			m_rest;
+	std::unique_ptr<char[]> m_block;
+	std::vector<Cursor>		m_heap;
+	const T				   *m_mapped	 = nullptr;
+	std::size_t				m_mappedSize = 0;
+	bool					m_first = true, m_done = false;
+};
+
+template <class T>
+class SortStream : public BodyStream {
+   public:
+	SortStream(InputFormat input, std::string_view accept, std::size_t expected, std::size_t memoryLimit)
+		: m_input(input), m_limit(std::max(memoryLimit, MIN_MEMORY_LIMIT)) {
+		if constexpr (sizeof(T) == 4) {
+			m_output = negotiateMediaType(accept, OUTPUT_TYPES);
+		} else {
+			// an int64 body cannot be answered with int32
+			const std::string_view offered[] = {OUTPUT_TYPES[JSON], OUTPUT_TYPES[NDJSON], OUTPUT_TYPES[TEXT],
+												OUTPUT_TYPES[INT64]};
+			m_output = negotiateMediaType(accept, offered);
+			if (m_output == 3) m_output = INT64;
+		}
+		// sorting a run needs as much memory again
+		m_runSize = m_limit / 2 / sizeof(T);
+		m_values.reserve(std::min(expected, m_runSize));
+	}
+
+	~SortStream() override {
+		if (m_fd >= 0) close(m_fd);
+	}
+
+	/// Answers with the status instead of reading the body.
+	void refuse(int status, std::string message) {
+		m_status  = status;
+		m_message = std::move(message);
+	}
+
+	bool begin(SocketStream &s) override {
+		if (!m_status && m_output < 0) refuse(406, "Not Acceptable");
+		if (!m_status) return true;
+		s.status(m_status, m_message);
+		return false;
+	}
+
+	bool data(std::string_view chunk) override {
+		switch (m_input) {
+			case InputFormat::TEXT: return text(chunk);
+			case InputFormat::ARRAY: return appendElements(chunk);
+			case InputFormat::FRAMES: return frames(chunk);
+		}
+		return false;
+	}
+
+	void end(SocketStream &s) override {
+		bool complete = m_input == InputFormat::TEXT
+							? parse(m_carry)
+							: m_carry.empty() && m_header.empty() && !m_frameLeft;
+		if (!m_status && (!complete || (m_values.empty() && m_runs.empty()))) refuse(400, "Bad Request");
+		if (m_status) {
+			s.status(m_status, m_message);
+			return;
+		}
+
+		sort();
+		respond(s);
+	}
+
+   private:
+	bool text(std::string_view chunk) {
+		// only numbers followed by a separator are complete, the rest waits for the next piece
+		std::size_t last = chunk.find_last_of(SEPARATORS);
+		if (last == std::string_view::npos) {
+			m_carry.append(chunk);
+			return m_carry.size() <= MAX_NUMBER_LENGTH || fail(400, "Bad Request");
+		}
+
+		if (!m_carry.empty()) {
+			std::size_t first = chunk.find_first_of(SEPARATORS);
+			m_carry.append(chunk.substr(0, first));
+			if (!parse(m_carry)) return false;
+			m_carry.clear();
+			chunk.remove_prefix(first);
+			last -= first;
+		}
+		if (!parse(chunk.substr(0, last + 1))) return false;
+		m_carry.assign(chunk.substr(last + 1));
+		return true;
+	}
+
+	bool parse(std::string_view text) {
+		// a number takes at least two characters with its separator
+		if (!makeRoom((text.size() + 1) / 2)) return false;
+		return parseIntegers(text, m_values) || fail(400, "Bad Request");
+	}
+
+	bool fail(int status, std::string message) {
+		refuse(status, std::move(message));
+		return false;
+	}
+
+	bool frames(std::string_view bytes) {
+		while (!bytes.empty()) {
+			if (!m_frameLeft) {
+				std::size_t n = std::min(sizeof(uint32_t) - m_header.size(), bytes.size());
+				m_header.append(bytes.substr(0, n));
+				bytes.remove_prefix(n);
+				if (m_header.size() < sizeof(uint32_t)) return true;
+
+				uint32_t count;
+				std::memcpy(&count, m_header.data(), sizeof(count));
+				m_header.clear();
+				m_frameLeft = std::size_t(littleEndian(count)) * sizeof(T);
+				continue;
+			}
+
+			std::size_t n = std::min(m_frameLeft, bytes.size());
+			if (!appendElements(bytes.substr(0, n))) return false;
+			bytes.remove_prefix(n);
+			m_frameLeft -= n;
+		}
+		return true;
+	}
+
+	bool appendElements(std::string_view bytes) {
+		// an element split between two pieces of the body
+		if (!m_carry.empty()) {
+			std::size_t n = std::min(sizeof(T) - m_carry.size(), bytes.size());
+			m_carry.append(bytes.substr(0, n));
+			bytes.remove_prefix(n);
+			if (m_carry.size() < sizeof(T)) return true;
+			if (!append(m_carry.data(), 1)) return false;
+			m_carry.clear();
+		}
+
+		std::size_t count = bytes.size() / sizeof(T);
+		if (!append(bytes.data(), count)) return false;
+		m_carry.assign(bytes.substr(count * sizeof(T)));
+		return true;
+	}
+
+	bool append(const char *bytes, std::size_t count) {
+		while (count) {
+			// a full run is written out by makeRoom()
+			std::size_t room = m_runSize > m_values.size() ? m_runSize - m_values.size() : m_runSize;
+			std::size_t n	 = std::min(count, room);
+			if (!makeRoom(n)) return false;
+
+			std::size_t old = m_values.size();
+			m_values.resize(old + n);
+			std::memcpy(m_values.data() + old, bytes, n * sizeof(T));
+			if constexpr (std::endian::native == std::endian::big) {
+				for (std::size_t i = old; i < m_values.size(); i++) m_values[i] = littleEndian(m_values[i]);
+			}
+			bytes += n * sizeof(T);
+			count -= n;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Makes room for n more numbers, writing the ones in memory out as a run if they would exceed the run size.
+	 */
+	bool makeRoom(std::size_t n) {
+		if (m_values.size() + n > m_runSize && !m_values.empty() && !spill()) return false;
+
+		std::size_t need = m_values.size() + n;
+		if (need > m_values.capacity()) {
+			m_values.reserve(std::max(need, std::min(m_values.capacity() * 2, m_runSize)));
+		}
+		notePeak(0);
+		return true;
+	}
+
+	/**
+	 * @brief Sorts the numbers in memory and appends them to the temporary file as a run.
+	 */
+	bool spill() {
+		if (m_fd < 0 && (m_fd = createTempFile()) < 0) {
+			dbLog(dbg::LOG_ERROR, "cannot create a temporary file for sorting: ", strerror(errno));
+			return fail(500, "Internal Server Error");
+		}
+
+		sort();
+		const char *p	 = reinterpret_cast<const char *>(m_values.data());
+		std::size_t left = m_values.size() * sizeof(T);
+		while (left) {
+			ssize_t res = ::write(m_fd, p, left);
+			if (res < 0 && errno == EINTR) continue;
+			if (res <= 0) {
+				dbLog(dbg::LOG_ERROR, "cannot write a sorted run: ", strerror(errno));
+				return fail(500, "Internal Server Error");
+			}
+			p += res;
+			left -= res;
+		}
+
+		m_runs.push_back({m_spilled, m_values.size()});
+		m_spilled += m_values.size();
+		m_values.clear();
+		return true;
+	}
+
+	void sort() {
+		// the radix sort needs a second array of the same size
+		if (m_values.size() >= RADIX_SORT_THRESHOLD) notePeak(m_values.size() * sizeof(T));
+		radixSort(m_values.data(), m_values.size());
+	}
+
+	void notePeak(std::size_t extra) {
+		std::size_t use = m_values.capacity() * sizeof(T) + m_carry.capacity() + m_header.capacity() + extra;
+		m_peak			= std::max(m_peak, use);
+	}
+
+	void writeHead(SocketStream &s, std::size_t length) {
+		ResponseHead head(200);
+		head.header(ResponseHead::CONTENT_TYPE, OUTPUT_TYPES[m_output]);
+		if (length == SIZE_MAX) head.header(ResponseHead::TRANSFER_ENCODING, "chunked");
+		else head.header(ResponseHead::CONTENT_LENGTH, length);
+		head.header("X-Sort-Runs", m_runs.size()).header("X-Sort-Peak-Memory", m_peak);
+		s.clear();
+		s.getBuffer().writeResponse(head.view());
+
+		dbLog(dbg::LOG_INFO, "sorted ", m_spilled + m_values.size(), " numbers in ", m_runs.size(),
+			  " runs on disk, peak memory ", m_peak, " bytes");
+	}
+
+	void respond(SocketStream &s) {
+		std::size_t n	   = m_values.size();
+		std::size_t width  = m_output == INT64 ? sizeof(int64_t) : m_output == INT32 ? sizeof(int32_t) : 0;
+		std::size_t output = width ? n * width
+								   : TEXT_LAYOUTS[m_output].prefix.size() + TEXT_LAYOUTS[m_output].suffix.size() +
+										 maxIntegerListSize<T>(n, TEXT_LAYOUTS[m_output].separator.size());
+
+		if (m_runs.empty() && width == sizeof(T)) {
+			// the sorted array already is the response
+			for (T &x : m_values) x = littleEndian(x);
+			auto array = std::make_shared<std::vector<T>>(std::move(m_values));
+			writeHead(s, n * sizeof(T));
+			s.getBuffer().write(std::string_view(reinterpret_cast<const char *>(array->data()), n * sizeof(T)), array);
+			s.flush();
+			return;
+		}
+
+		if (!m_runs.empty() || m_values.capacity() * sizeof(T) + output > m_limit) {
+			// merge the runs, or just write out the numbers in memory, while the socket drains
+			std::size_t total  = m_spilled + n;
+			auto		merger = std::make_unique<RunMerger<T>>(std::exchange(m_fd, -1), m_runs, std::move(m_values),
+																m_output);
+			if (!merger->valid(m_runs)) {
+				dbLog(dbg::LOG_ERROR, "cannot map the sorted runs: ", strerror(errno));
+				s.status(500, "Internal Server Error");
+				return;
+			}
+			m_peak = std::max(m_peak, merger->memoryUse());
+			writeHead(s, width ? total * width : SIZE_MAX);
+			s.getBuffer().writeSource(std::move(merger));
+			s.flush();
+			return;
+		}
+
+		auto out = std::make_shared<ByteBuffer>();
+		out->resize(output);
+		char *end = out->data();
+		if (width) {
+			// int32 numbers widened to an int64 array
+			for (std::size_t i = 0; i < n; i++, end += sizeof(int64_t)) {
+				int64_t x = littleEndian(int64_t(m_values[i]));
+				std::memcpy(end, &x, sizeof(x));
+			}
+		} else {
+			const TextLayout &layout = TEXT_LAYOUTS[m_output];
+			end						 = std::copy(layout.prefix.begin(), layout.prefix.end(), end);
+			end						 = writeIntegerList(end, m_values.data(), n, layout.separator);
+			end						 = std::copy(layout.suffix.begin(), layout.suffix.end(), end);
+		}
+		out->resize(end - out->data());
+		m_peak = std::max(m_peak, m_values.capacity() * sizeof(T) + out->capacity());
+
+		writeHead(s, out->size());
+		s.getBuffer().write(*out, out);
+		s.flush();
+	}
+
+	InputFormat	   m_input;
+	int			   m_output;
+	std::vector<T> m_values;
+	/// an unfinished number of a text body or an unfinished element of a binary body
+	std::string m_carry;
+	/// the unfinished element count of a frame
+	std::string m_header;
+	/// bytes of the current frame that have not arrived yet
+	std::size_t m_frameLeft = 0;
+	int			m_status	= 0;
+	std::string m_message;
+
+	std::size_t		 m_limit, m_runSize;
+	int				 m_fd = -1;
+	std::vector<Run> m_runs;
+	/// numbers written to the temporary file so far
+	std::size_t m_spilled = 0;
+	std::size_t m_peak	  = 0;
+};
+
+std::unique_ptr<BodyStream> createSortStream(const HTTPRequest &request, std::size_t memoryLimit) {
+	std::string_view type	= request.header("Content-Type");
+	std::string_view accept = request.header("Accept");
+
+	auto binary = [&](InputFormat input, std::size_t width) -> std::unique_ptr<BodyStream> {
+		std::size_t expected = request.contentLength / width;
+		if (width == 4) return std::make_unique<SortStream<int32_t>>(input, accept, expected, memoryLimit);
+		return std::make_unique<SortStream<int64_t>>(input, accept, expected, memoryLimit);
+	};
+
+	if (hasMediaType(type, "application/x-int32")) return binary(InputFormat::ARRAY, 4);
+	if (hasMediaType(type, "application/x-int64")) return binary(InputFormat::ARRAY, 8);
+	if (hasMediaType(type, "application/x-int32-frames")) return binary(InputFormat::FRAMES, 4);
+	if (hasMediaType(type, "application/x-int64-frames")) return binary(InputFormat::FRAMES, 8);
+
+	// most numbers take more than 8 characters with their separator
+	auto stream =
+		std::make_unique<SortStream<int32_t>>(InputFormat::TEXT, accept, request.contentLength / 8, memoryLimit);
+	// curl -d sends form data by default
+	if (!type.empty() && !hasMediaType(type, "text/plain") && !hasMediaType(type, "application/x-ndjson") &&
+		!hasMediaType(type, "application/x-www-form-urlencoded")) {
+		stream->refuse(415, "Unsupported Media Type");
+	}
+	return stream;
+}
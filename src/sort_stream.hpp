@@ -0,0 +1,29 @@
+#pragma once
+
+#include <memory>
+
+#include "http_parser.hpp"
+#include "request_body.hpp"
+
+/**
+ * @brief Creates the body stream of a /sort request, which collects the numbers while the body arrives and answers
+ * with them sorted.
+ *
+ * Content-Type selects how the body is read:
+ * - text/plain, application/x-ndjson (or no type, or curl's default form type): decimal int32 numbers separated by
+ *   whitespace or commas, parsed piece by piece as the body arrives
+ * - application/x-int32, application/x-int64: an array of little-endian integers
+ * - application/x-int32-frames, application/x-int64-frames: frames, each a little-endian uint32 element count followed
+ *   by that many little-endian integers
+ *
+ * Accept selects the response: application/json ("[1, 2, 3]"), application/x-ndjson (a number per line),
+ * text/plain (numbers separated by spaces) or a little-endian application/x-int32 or application/x-int64 array.
+ * Unknown body types get 415, unacceptable responses 406 and malformed bodies 400.
+ *
+ * The numbers of a request are kept in memory up to half of memoryLimit. Beyond that each full buffer is sorted and
+ * written to a temporary file as a run, and the runs are merged into the response while it is sent. Responses that
+ * would not fit into the limit are sent in pieces as well, with chunked transfer encoding for text. The X-Sort-Runs
+ * and X-Sort-Peak-Memory response headers report the runs written and the most memory the request needed, not
+ * counting the page cache.
+ */
+std::unique_ptr<BodyStream> createSortStream(const HTTPRequest &request, std::size_t memoryLimit);
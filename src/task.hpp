@@ -0,0 +1,255 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+/**
+ * @brief What a suspended coroutine handler waits for. Implemented by the connection the handler runs for, which
+ * resumes the handler on one of its I/O workers once the awaited event has happened.
+ */
+class TaskScheduler {
+   public:
+	virtual ~TaskScheduler() = default;
+
+	/// resume once the given time has passed
+	virtual void sleepUntil(std::chrono::steady_clock::time_point when) = 0;
+	/// run job on the compute pool and resume once it has returned
+	virtual void offload(std::function<void()> job) = 0;
+	/// resume once the socket has taken all output written so far
+	virtual void drain() = 0;
+	/// resume once more of the request body has arrived, see BodyReader
+	virtual void receive() = 0;
+};
+
+/**
+ * @brief The body of a request to a coroutine STREAM route as its handler reads it, implemented by the connection.
+ */
+class BodyReader {
+   public:
+	virtual ~BodyReader() = default;
+
+	/**
+	 * @brief Takes what has arrived of the body since the last call, an empty piece once it has all been taken. The
+	 * view stays valid until the next call. Throws BodyError if the rest of the body was refused.
+	 *
+	 * @return false if nothing has arrived yet
+	 */
+	virtual bool next(std::string_view &chunk) = 0;
+};
+
+struct TaskPromiseBase {
+	TaskScheduler		   *scheduler = nullptr;
+	std::coroutine_handle<> continuation;	 // the task awaiting this one, none for the handler itself
+	std::exception_ptr		exception;
+	TaskPromiseBase		   *root = nullptr;	   // the promise of the handler
+	std::coroutine_handle<> leaf;			   // of the handler: the innermost task, the one to resume
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	void				unhandled_exception() noexcept { exception = std::current_exception(); }
+
+	/// continues the awaiting task, if any, in place of the finished one
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			std::coroutine_handle<> next = h.promise().continuation;
+			if (!next) return std::noop_coroutine();
+			h.promise().root->leaf = next;
+			return next;
+		}
+		void await_resume() noexcept {}
+	};
+	FinalAwaiter final_suspend() noexcept { return {}; }
+};
+
+/**
+ * @brief A lazily started coroutine that produces a T, the return type of coroutine handlers and of the functions they
+ * co_await. Awaiting a Task runs it to completion before the awaiting coroutine continues, with the same scheduler.
+ */
+template <class T = void>
+class [[nodiscard]] Task {
+   public:
+	struct promise_type;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	struct promise_type : TaskPromiseBase {
+		std::optional<T> value;
+
+		Task get_return_object() { return Task(Handle::from_promise(*this)); }
+		template <class U>
+		void return_value(U &&v) {
+			value.emplace(std::forward<U>(v));
+		}
+	};
+
+	Task() = default;
+	Task(Task &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (m_handle) m_handle.destroy();
+			m_handle = std::exchange(other.m_handle, nullptr);
+		}
+		return *this;
+	}
+	~Task() {
+		if (m_handle) m_handle.destroy();
+	}
+
+	explicit operator bool() const { return bool(m_handle); }
+	bool	 done() const { return m_handle.done(); }
+
+	/**
+	 * @brief Starts or continues the task until it suspends or finishes. Only for the outermost task, the ones it
+	 * awaits are resumed through it.
+	 */
+	void resume(TaskScheduler *scheduler) {
+		promise_type &promise = m_handle.promise();
+		if (!promise.root) {
+			promise.root = &promise;
+			promise.leaf = m_handle;
+		}
+		promise.scheduler = scheduler;
+		promise.leaf.resume();
+	}
+	/// The exception the task ended with, if any.
+	std::exception_ptr exception() const { return m_handle.promise().exception; }
+
+	struct Awaiter {
+		Handle handle;
+
+		bool await_ready() noexcept { return false; }
+		template <class P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> caller) noexcept {
+			handle.promise().scheduler	  = caller.promise().scheduler;
+			handle.promise().continuation = caller;
+			handle.promise().root		  = caller.promise().root;
+			handle.promise().root->leaf	  = handle;
+			return handle;
+		}
+		T await_resume() {
+			if (handle.promise().exception) std::rethrow_exception(handle.promise().exception);
+			if constexpr (!std::is_void_v<T>) return std::move(*handle.promise().value);
+		}
+	};
+	Awaiter operator co_await() && noexcept { return Awaiter{m_handle}; }
+
+   private:
+	explicit Task(Handle handle) : m_handle(handle) {}
+
+	Handle m_handle;
+};
+
+template <>
+struct Task<void>::promise_type : TaskPromiseBase {
+	Task get_return_object() { return Task(Handle::from_promise(*this)); }
+	void return_void() {}
+};
+
+/**
+ * @brief Suspends the awaiting task until the given time without occupying a worker.
+ */
+class SleepAwaitable {
+   public:
+	explicit SleepAwaitable(std::chrono::steady_clock::time_point when) : m_when(when) {}
+
+	bool await_ready() const { return m_when <= std::chrono::steady_clock::now(); }
+	template <class P>
+	void await_suspend(std::coroutine_handle<P> h) {
+		static_assert(std::is_base_of_v<TaskPromiseBase, P>, "can only be awaited in a Task");
+		h.promise().scheduler->sleepUntil(m_when);
+	}
+	void await_resume() const {}
+
+   private:
+	std::chrono::steady_clock::time_point m_when;
+};
+
+inline SleepAwaitable sleepUntil(std::chrono::steady_clock::time_point when) { return SleepAwaitable(when); }
+inline SleepAwaitable sleepFor(std::chrono::steady_clock::duration duration) {
+	return SleepAwaitable(std::chrono::steady_clock::now() + duration);
+}
+
+/**
+ * @brief Runs a function on the compute pool while the awaiting task is suspended. co_await gives its result or
+ * rethrows its exception.
+ */
+template <class F>
+class OffloadAwaitable {
+	using Result = std::invoke_result_t<F &>;
+
+   public:
+	explicit OffloadAwaitable(F fn) : m_fn(std::move(fn)) {}
+
+	bool await_ready() const { return false; }
+	template <class P>
+	void await_suspend(std::coroutine_handle<P> h) {
+		static_assert(std::is_base_of_v<TaskPromiseBase, P>, "can only be awaited in a Task");
+		h.promise().scheduler->offload([this] {
+			try {
+				if constexpr (std::is_void_v<Result>) m_fn();
+				else m_result.emplace(m_fn());
+			} catch (...) { m_exception = std::current_exception(); }
+		});
+	}
+	Result await_resume() {
+		if (m_exception) std::rethrow_exception(m_exception);
+		if constexpr (!std::is_void_v<Result>) return std::move(*m_result);
+	}
+
+   private:
+	F m_fn;
+	std::optional<std::conditional_t<std::is_void_v<Result>, std::monostate, Result>> m_result;
+	std::exception_ptr m_exception;
+};
+
+template <class F>
+OffloadAwaitable<F> offload(F fn) {
+	return OffloadAwaitable<F>(std::move(fn));
+}
+
+/**
+ * @brief Suspends the awaiting task until the socket has taken everything written to the response so far.
+ */
+class DrainAwaitable {
+   public:
+	bool await_ready() const { return false; }
+	template <class P>
+	void await_suspend(std::coroutine_handle<P> h) {
+		static_assert(std::is_base_of_v<TaskPromiseBase, P>, "can only be awaited in a Task");
+		h.promise().scheduler->drain();
+	}
+	void await_resume() const {}
+};
+
+/**
+ * @brief Suspends the awaiting task until more of the request body has arrived. co_await gives the next piece, valid
+ * until the next read, or an empty view once the whole body has been read.
+ */
+class ReadAwaitable {
+   public:
+	explicit ReadAwaitable(BodyReader &reader) : m_reader(reader) {}
+
+	bool await_ready() { return m_ready = m_reader.next(m_chunk); }
+	template <class P>
+	void await_suspend(std::coroutine_handle<P> h) {
+		static_assert(std::is_base_of_v<TaskPromiseBase, P>, "can only be awaited in a Task");
+		h.promise().scheduler->receive();
+	}
+	std::string_view await_resume() {
+		// the connection resumes the task only once there is something to take
+		if (!m_ready) m_reader.next(m_chunk);
+		return m_chunk;
+	}
+
+   private:
+	BodyReader		&m_reader;
+	std::string_view m_chunk;
+	bool			 m_ready = false;
+};
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * @brief A hierarchical timer wheel with four levels of 64 slots. Each slot of a level spans a whole turn of the level
+ * below, so timers can be up to 2^24 ticks ahead. Timers are intrusive list nodes: arming and cancelling are O(1),
+ * advancing costs O(1) per tick plus the timers that expire or move down a level.
+ */
+class TimerWheel {
+   public:
+	/// A timer, embedded in whatever it belongs to. An armed node must be cancelled before it is destroyed.
+	struct Node {
+		Node	*prev	= nullptr;
+		Node	*next	= nullptr;
+		uint64_t expiry = 0;
+		void	*owner	= nullptr;	  // what the timer belongs to, for the callback of advance()
+
+		bool armed() const { return next; }
+	};
+
+	explicit TimerWheel(uint64_t now = 0) : m_now(now) {
+		for (auto &level : m_slots) {
+			for (Node &head : level) {
+				head.prev = head.next = &head;
+			}
+		}
+	}
+	TimerWheel(const TimerWheel &)			  = delete;
+	TimerWheel &operator=(const TimerWheel &) = delete;
+
+	bool		empty() const { return !m_count; }
+	std::size_t size() const { return m_count; }
+	uint64_t	now() const { return m_now; }
+
+	/**
+	 * @brief Arms node to expire at the given tick, or on the next tick if that has passed. An armed node is moved.
+	 */
+	void arm(Node &node, uint64_t expiry) {
+		if (node.armed()) unlink(node);
+		else m_count++;
+		node.expiry = expiry > m_now ? expiry : m_now + 1;
+		link(node);
+	}
+
+	void cancel(Node &node) {
+		if (!node.armed()) return;
+		unlink(node);
+		m_count--;
+	}
+
+	/**
+	 * @brief Moves the wheel forward to the given tick and calls fn with every node that expires on the way, already
+	 * disarmed, so fn may arm it again.
+	 */
+	template <class F>
+	void advance(uint64_t now, F &&fn) {
+		// nothing to expire, time can jump
+		if (!m_count) {
+			if (now > m_now) m_now = now;
+			return;
+		}
+		while (m_now < now) {
+			m_now++;
+			// when a level completes a turn, the next slot of each level above is spread over the levels below
+			unsigned int top = 0;
+			while (top + 1 < LEVELS && !(m_now & ((uint64_t(1) << (BITS * (top + 1))) - 1))) top++;
+			for (unsigned int level = top; level > 0; level--) {
+				cascade(m_slots[level][(m_now >> (BITS * level)) & (SLOTS - 1)]);
+			}
+
+			Node &head = m_slots[0][m_now & (SLOTS - 1)];
+			while (head.next != &head) {
+				Node *node = head.next;
+				unlink(*node);
+				m_count--;
+				fn(node);
+			}
+		}
+	}
+
+   private:
+	static constexpr unsigned int BITS	 = 6;
+	static constexpr unsigned int SLOTS	 = 1u << BITS;
+	static constexpr unsigned int LEVELS = 4;
+	static constexpr uint64_t	  SPAN	 = uint64_t(1) << (BITS * LEVELS);
+
+	void link(Node &node) {
+		// expiries further ahead than the wheel reaches fire early, on the last tick it does reach
+		if (node.expiry - m_now >= SPAN) node.expiry = m_now + SPAN - 1;
+		uint64_t	 delta = node.expiry > m_now ? node.expiry - m_now : 0;
+		unsigned int level = 0;
+		while (level + 1 < LEVELS && delta >= (uint64_t(1) << (BITS * (level + 1)))) level++;
+
+		Node &head = m_slots[level][(node.expiry >> (BITS * level)) & (SLOTS - 1)];
+		node.prev  = head.prev;
+		node.next  = &head;
+		head.prev->next = &node;
+		head.prev		= &node;
+	}
+
+	static void unlink(Node &node) {
+		node.prev->next = node.next;
+		node.next->prev = node.prev;
+		node.prev = node.next = nullptr;
+	}
+
+	void cascade(Node &head) {
+		if (head.next == &head) return;
+		// detach the whole slot first, nodes may be linked into it again
+		Node list;
+		list.next		= head.next;
+		list.prev		= head.prev;
+		list.next->prev = &list;
+		list.prev->next = &list;
+		head.prev = head.next = &head;
+		while (list.next != &list) {
+			Node *node = list.next;
+			unlink(*node);
+			link(*node);
+		}
+	}
+
+	Node		m_slots[LEVELS][SLOTS];	   // list heads
+	uint64_t	m_now;
+	std::size_t m_count = 0;
+};
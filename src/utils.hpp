@@ -6,14 +6,25 @@
 #include <string>
 #include <iostream>
 
+#include <logger.hpp>
+
 template <int N, typename... Ts>
 using NthTypeOf = typename std::tuple_element<N, std::tuple<Ts...>>::type;
 
+/**
+ * @brief Mixes a hash into a seed. Unlike a plain XOR, equal or swapped members do not cancel out.
+ */
+inline std::size_t hashCombine(std::size_t seed, std::size_t h) {
+	return seed ^ (h + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
+
 template <class... Args>
 struct std::hash<std::tuple<Args...>> {
 	std::size_t operator()(const std::tuple<Args...> &t) const {
 		return [&]<std::size_t... p>(std::index_sequence<p...>) {
-			return ((std::hash<NthTypeOf<p, Args...>>{}(std::get<p>(t))) ^ ...);
+			std::size_t seed = 0;
+			((seed = hashCombine(seed, std::hash<NthTypeOf<p, Args...>>{}(std::get<p>(t)))), ...);
+			return seed;
 		}(std::make_index_sequence<std::tuple_size_v<std::tuple<Args...>>>{});
 	}
 };
@@ -21,7 +32,7 @@ struct std::hash<std::tuple<Args...>> {
 template <class A, class B>
 struct std::hash<std::pair<A, B>> {
 	std::size_t operator()(const std::pair<A, B> &p) const {
-		return std::hash<A>{}(p.first) ^ std::hash<B>{}(p.second);
+		return hashCombine(std::hash<A>{}(p.first), std::hash<B>{}(p.second));
 	}
 };
 
@@ -70,20 +81,19 @@ static const char *log_colors[]{COLOR_GREEN, COLOR_YELLOW, COLOR_RESET, COLOR_RE
 std::mutex &getMutex();
 
 /**
- * @brief prints to std::cerr
+ * @brief Hands a line to the asynchronous Logger, which writes it to fd.
  *
  * @return 1
  */
 template <class... Types>
-bool inline f_dbLog(std::ostream &out, Types... args) {
-	std::lock_guard lock(dbg::getMutex());
-	(out << ... << args) << std::endl;
+bool inline f_dbLog(int fd, const Types &...args) {
+	Logger::instance().log(fd, args..., '\n');
 	return 1;
 }
 
 /**
  * @def dbLog(severity, ...)
- * If severity is greater than the definition DBG_LOG_LEVEL, prints all arguments to std::cerr
+ * If severity is greater than the definition DBG_LOG_LEVEL, writes all arguments to stderr through the Logger
  */
 
 #ifndef NDEBUG
@@ -93,7 +103,7 @@ bool inline f_dbLog(std::ostream &out, Types... args) {
 	#endif
 	#define dbLog(severity, ...)                                                                                   \
 		severity >= DBG_LOG_LEVEL                                                                                  \
-			? (dbg::f_dbLog(std::cerr, dbg::log_colors[severity], "[", #severity, "] ", __VA_ARGS__, COLOR_RESET)) \
+			? (dbg::f_dbLog(2, dbg::log_colors[severity], "[", #severity, "] ", __VA_ARGS__, COLOR_RESET))         \
 			: 0;
 #else
 	#ifndef DBG_LOG_LEVEL